@@ -22,9 +22,107 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
-#include <windows.h>
+#ifdef _WIN32
+    #include <windows.h>
+    #include <malloc.h>
+#else
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <pthread.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <sys/types.h>
+    #include <time.h>
+    #include <unistd.h>
+    #ifdef __linux__
+        #include <sys/syscall.h>
+    #endif
+    // Batched reads through io_uring, built unless DEXT2_NO_IO_URING is defined
+    #if defined(__linux__) && !defined(DEXT2_NO_IO_URING) && defined(__has_include)
+        #if __has_include(<linux/io_uring.h>)
+            #include <linux/io_uring.h>
+            #include <sys/syscall.h>
+            #define DEXT2_HAVE_IO_URING
+        #endif
+    #endif
+#endif // _WIN32
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Portability
+//
+// The library is written against the Win32 type names. On other
+// platforms the subset of types and file functions it relies on is
+// provided here, so the same code builds for Linux image files
+#ifndef _WIN32
+typedef int BOOL;
+typedef char CHAR;
+typedef uint8_t BYTE, *PBYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD, *PDWORD;
+typedef int32_t LONG, *PLONG;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG, *PULONGLONG;
+typedef char* LPSTR;
+typedef const char* LPCSTR;
+typedef void* LPVOID;
+typedef const void* LPCVOID;
+typedef void* HANDLE;
+
+#define TRUE 1
+#define FALSE 0
+#define OUT
+
+#define INVALID_HANDLE_VALUE ( (HANDLE) (intptr_t) -1 )
+#define GENERIC_READ 0x80000000
+#define GENERIC_WRITE 0x40000000
+#define CREATE_ALWAYS 2
+#define OPEN_EXISTING 3
+#define FILE_ATTRIBUTE_NORMAL 0x80
+
+static inline HANDLE CreateFileA(LPCSTR fileName, DWORD desiredAccess, DWORD shareMode, LPVOID securityAttributes,
+                                 DWORD creationDisposition, DWORD flagsAndAttributes, HANDLE hTemplateFile) {
+    (void) shareMode;
+    (void) securityAttributes;
+    (void) flagsAndAttributes;
+    (void) hTemplateFile;
+    int flags = (desiredAccess & GENERIC_WRITE) ? O_WRONLY : O_RDONLY;
+    if (creationDisposition == CREATE_ALWAYS) {
+        flags |= O_CREAT | O_TRUNC;
+    }
+    int fd = open(fileName, flags, 0644);
+    return fd < 0 ? INVALID_HANDLE_VALUE : (HANDLE) (intptr_t) fd;
+}
+
+static inline BOOL WriteFile(HANDLE hFile, LPCVOID buffer, DWORD nBytesToWrite, PDWORD bytesWritten, LPVOID overlapped) {
+    (void) overlapped;
+    const BYTE* source = (const BYTE*) buffer;
+    DWORD total = 0;
+    while (total < nBytesToWrite) {
+        ssize_t written = write((int) (intptr_t) hFile, source + total, nBytesToWrite - total);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        total += (DWORD) written;
+    }
+    if (bytesWritten != NULL) {
+        *bytesWritten = total;
+    }
+    return total == nBytesToWrite;
+}
+
+static inline BOOL CloseHandle(HANDLE hObject) {
+    return close((int) (intptr_t) hObject) == 0;
+}
+
+static inline BOOL CreateDirectoryA(LPCSTR pathName, LPVOID securityAttributes) {
+    (void) securityAttributes;
+    return mkdir(pathName, 0755) == 0;
+}
+#endif // _WIN32
 
 // Logging
 #ifdef DEBUG
@@ -44,13 +142,46 @@ SOFTWARE.
 #define DEXT2_SUPER_MAGIC 0xEF53
 #define DEXT2_SUPERBLOCK_OFFSET 1024
 #define DEXT2_SUPERBLOCK_SIZE 1024
-#define DEXT2_GROUP_DESCRIPTOR_ENTRY_SIZE 32
+#define DEXT2_GROUP_DESCRIPTOR_ENTRY_SIZE 32     // Without the 64bit feature
 #define DEXT2_MAX_NAME_LEN 255
 #define DEXT2_N_BLOCKS 15
-#define DEXT2_INODE_SIZE 128
+#define DEXT2_INODE_SIZE 128     // Revision 0, later revisions store it in s_inode_size
 
 #define DEXT2_INODE_IS_DIR 0x4000 
 #define DEXT2_INODE_IS_FILE 0x8000 
+#define DEXT2_INODE_FORMAT_MASK 0xF000
+#define DEXT2_INODE_IS_SOCKET 0xC000
+#define DEXT2_INODE_IS_SYMLINK 0xA000
+#define DEXT2_INODE_IS_BLOCK_DEVICE 0x6000
+#define DEXT2_INODE_IS_CHAR_DEVICE 0x2000
+#define DEXT2_INODE_IS_FIFO 0x1000
+
+// Revision 1 feature flags
+#define DEXT2_FEATURE_INCOMPAT_FILETYPE 0x0002
+#define DEXT2_FEATURE_INCOMPAT_META_BG 0x0010
+#define DEXT2_FEATURE_INCOMPAT_EXTENTS 0x0040
+#define DEXT2_FEATURE_INCOMPAT_64BIT 0x0080
+#define DEXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define DEXT2_FEATURE_RO_COMPAT_LARGE_FILE 0x0002
+#define DEXT2_FEATURE_RO_COMPAT_GDT_CSUM 0x0010
+#define DEXT2_FEATURE_RO_COMPAT_METADATA_CSUM 0x0400
+
+// Inode flags
+#define DEXT2_EXTENTS_FL 0x00080000     // i_block holds an extent tree
+
+// Group descriptor flags
+#define DEXT2_BG_INODE_UNINIT 0x0001    // Inode table and bitmap not initialized
+#define DEXT2_BG_BLOCK_UNINIT 0x0002    // Block bitmap not initialized
+
+// Values of ext2_dir_entry.file_type
+#define DEXT2_FT_UNKNOWN 0
+#define DEXT2_FT_REG_FILE 1
+#define DEXT2_FT_DIR 2
+#define DEXT2_FT_CHRDEV 3
+#define DEXT2_FT_BLKDEV 4
+#define DEXT2_FT_FIFO 5
+#define DEXT2_FT_SOCK 6
+#define DEXT2_FT_SYMLINK 7
 
 
 #define DEXT2_MAX_PARTITION_COUNT 128
@@ -73,7 +204,9 @@ typedef enum
 /***********************************************************
 * ALL STRUCTURES FIELDS SPECIFIC TO ext2 WITH VERSION
 * GREATER OR EQUAL TO 1.0 THAT USUALLY PLACED AT THE 
-* END OF STRUCTURE ARE OMITTED
+* END OF STRUCTURE ARE OMITTED, EXCEPT THE SUPERBLOCK
+* FIELDS UP TO THE ext4 DESCRIPTOR SIZE AND THE FLAGS OF
+* THE GROUP DESCRIPTORS
 * 
 * Structs and their fields follow Linux-kernel-style naming
 * 'cause it is easier to develop while reading documentation
@@ -104,6 +237,30 @@ typedef struct {
     DWORD s_checkinterval;         // Maximum time between checks
     DWORD s_creator_os;            // OS that created filesystem
     DWORD s_rev_level;             // Revision level
+    WORD s_def_resuid;             // Default uid for reserved blocks
+    WORD s_def_resgid;             // Default gid for reserved blocks
+    // Valid only when s_rev_level is 1 or greater
+    DWORD s_first_ino;             // First non-reserved inode
+    WORD s_inode_size;             // Size of inode structure
+    WORD s_block_group_nr;         // Block group number of this superblock
+    DWORD s_feature_compat;        // Compatible feature set
+    DWORD s_feature_incompat;      // Incompatible feature set
+    DWORD s_feature_ro_compat;     // Read-only compatible feature set
+    BYTE s_uuid[16];               // Volume UUID
+    CHAR s_volume_name[16];        // Volume name
+    CHAR s_last_mounted[64];       // Directory where last mounted
+    DWORD s_algorithm_usage_bitmap; // Compression algorithms
+    BYTE s_prealloc_blocks;        // Blocks to preallocate for files
+    BYTE s_prealloc_dir_blocks;    // Blocks to preallocate for directories
+    WORD s_reserved_gdt_blocks;    // Reserved descriptor blocks for growth
+    BYTE s_journal_uuid[16];       // UUID of the journal superblock
+    DWORD s_journal_inum;          // Inode number of the journal file
+    DWORD s_journal_dev;           // Device number of the journal file
+    DWORD s_last_orphan;           // Start of the list of inodes to delete
+    DWORD s_hash_seed[4];          // HTREE hash seed
+    BYTE s_def_hash_version;       // Default hash version
+    BYTE s_jnl_backup_type;        // Journal backup type
+    WORD s_desc_size;              // Group descriptor size with the 64bit feature
 } ext2_super_block;
 
 typedef struct {
@@ -113,6 +270,7 @@ typedef struct {
     WORD bg_free_blocks_count;     // Free blocks count
     WORD bg_free_inodes_count;     // Free inodes count
     WORD bg_used_dirs_count;       // Directories count
+    WORD bg_flags;                 // DEXT2_BG_*, ext4 only
 } ext2_group_desc;
 
 typedef struct {
@@ -133,43 +291,284 @@ typedef struct {
     DWORD i_block[DEXT2_N_BLOCKS]; // Pointers to blocks
     DWORD i_generation;            // File version (for NFS)
     DWORD i_file_acl;              // File ACL (not used in version 0)
-    DWORD i_dir_acl;               // Directory ACL (not used in version 0)
+    DWORD i_dir_acl;               // High 32 bits of the size of regular files since revision 1
     DWORD i_faddr;                 // Fragment address
 } ext2_inode;
 
 typedef struct {
     DWORD inode;                   // Inode number
     WORD rec_len;                  // Directory entry length
-    WORD name_len;                 // Name length
+    BYTE name_len;                 // Name length
+    BYTE file_type;                // DEXT2_FT_*, high byte of name_len without the filetype feature
     CHAR name[DEXT2_MAX_NAME_LEN]; // File name
 } ext2_dir_entry;
 
 
-BOOL GetDataBlocks(HANDLE hExt2, ext2_inode* pInode, OUT PDWORD* dataBlocks, OUT PULONGLONG dataBlocksSize);
-BOOL GetInodeByNumber(HANDLE hExt2, DWORD inodeNumber, OUT ext2_inode* lpInode);
+/***********************************************************
+* THREADING PRIMITIVES
+************************************************************/
+
+#ifdef _WIN32
+typedef SRWLOCK dext2_mutex;
+
+void InitMutex(dext2_mutex* mutex) { InitializeSRWLock(mutex); }
+void DestroyMutex(dext2_mutex* mutex) { (void) mutex; }
+void LockMutex(dext2_mutex* mutex) { AcquireSRWLockExclusive(mutex); }
+void UnlockMutex(dext2_mutex* mutex) { ReleaseSRWLockExclusive(mutex); }
+
+typedef CONDITION_VARIABLE dext2_cond;
+
+void InitCondition(dext2_cond* cond) { InitializeConditionVariable(cond); }
+void DestroyCondition(dext2_cond* cond) { (void) cond; }
+void WaitCondition(dext2_cond* cond, dext2_mutex* mutex) { SleepConditionVariableSRW(cond, mutex, INFINITE, 0); }
+void SignalCondition(dext2_cond* cond) { WakeConditionVariable(cond); }
+void BroadcastCondition(dext2_cond* cond) { WakeAllConditionVariable(cond); }
+
+// Thread routines are declared with DEXT2_THREAD_PROC and return 0
+typedef HANDLE dext2_thread;
+typedef LPTHREAD_START_ROUTINE DEXT2_THREAD_ROUTINE;
+#define DEXT2_THREAD_PROC(name) DWORD WINAPI name(LPVOID parameter)
+
+BOOL StartThread(dext2_thread* thread, DEXT2_THREAD_ROUTINE routine, LPVOID parameter) {
+    *thread = CreateThread(NULL, 0, routine, parameter, 0, NULL);
+    return *thread != NULL;
+}
+
+void JoinThread(dext2_thread thread) {
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+DWORD GetProcessorCount(void) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+}
+
+// Relaxed 64-bit atomics for statistics and flags, nothing is ordered by them
+ULONGLONG AtomicAdd(volatile ULONGLONG* target, ULONGLONG value) {
+    return (ULONGLONG) InterlockedExchangeAdd64((volatile LONG64*) target, (LONG64) value) + value;
+}
+
+ULONGLONG AtomicLoad(volatile ULONGLONG* target) {
+    return (ULONGLONG) InterlockedCompareExchange64((volatile LONG64*) target, 0, 0);
+}
+
+void AtomicStore(volatile ULONGLONG* target, ULONGLONG value) {
+    InterlockedExchange64((volatile LONG64*) target, (LONG64) value);
+}
+
+void AtomicMax(volatile ULONGLONG* target, ULONGLONG value) {
+    ULONGLONG current = AtomicLoad(target);
+    while (current < value) {
+        ULONGLONG seen = (ULONGLONG) InterlockedCompareExchange64((volatile LONG64*) target, (LONG64) value, (LONG64) current);
+        if (seen == current) {
+            break;
+        }
+        current = seen;
+    }
+}
+
+ULONGLONG GetMonotonicNanoseconds(void) {
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER now;
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&now);
+    return (ULONGLONG) (now.QuadPart / frequency.QuadPart) * 1000000000ULL
+        + (ULONGLONG) (now.QuadPart % frequency.QuadPart) * 1000000000ULL / (ULONGLONG) frequency.QuadPart;
+}
+#else
+typedef pthread_mutex_t dext2_mutex;
+
+void InitMutex(dext2_mutex* mutex) { pthread_mutex_init(mutex, NULL); }
+void DestroyMutex(dext2_mutex* mutex) { pthread_mutex_destroy(mutex); }
+void LockMutex(dext2_mutex* mutex) { pthread_mutex_lock(mutex); }
+void UnlockMutex(dext2_mutex* mutex) { pthread_mutex_unlock(mutex); }
+
+typedef pthread_cond_t dext2_cond;
+
+void InitCondition(dext2_cond* cond) { pthread_cond_init(cond, NULL); }
+void DestroyCondition(dext2_cond* cond) { pthread_cond_destroy(cond); }
+void WaitCondition(dext2_cond* cond, dext2_mutex* mutex) { pthread_cond_wait(cond, mutex); }
+void SignalCondition(dext2_cond* cond) { pthread_cond_signal(cond); }
+void BroadcastCondition(dext2_cond* cond) { pthread_cond_broadcast(cond); }
+
+// Thread routines are declared with DEXT2_THREAD_PROC and return 0
+typedef pthread_t dext2_thread;
+typedef void* (*DEXT2_THREAD_ROUTINE)(void*);
+#define DEXT2_THREAD_PROC(name) void* name(void* parameter)
+
+BOOL StartThread(dext2_thread* thread, DEXT2_THREAD_ROUTINE routine, LPVOID parameter) {
+    return pthread_create(thread, NULL, routine, parameter) == 0;
+}
+
+void JoinThread(dext2_thread thread) {
+    pthread_join(thread, NULL);
+}
+
+DWORD GetProcessorCount(void) {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (DWORD) count : 1;
+}
+
+static inline DWORD GetCurrentThreadId(void) {
+#ifdef __linux__
+    return (DWORD) syscall(SYS_gettid);
+#else
+    return (DWORD) (uintptr_t) pthread_self();
+#endif // __linux__
+}
+
+static inline DWORD GetCurrentProcessId(void) {
+    return (DWORD) getpid();
+}
+
+// Relaxed 64-bit atomics for statistics and flags, nothing is ordered by them
+ULONGLONG AtomicAdd(volatile ULONGLONG* target, ULONGLONG value) {
+    return __atomic_add_fetch(target, value, __ATOMIC_RELAXED);
+}
+
+ULONGLONG AtomicLoad(volatile ULONGLONG* target) {
+    return __atomic_load_n(target, __ATOMIC_RELAXED);
+}
+
+void AtomicStore(volatile ULONGLONG* target, ULONGLONG value) {
+    __atomic_store_n(target, value, __ATOMIC_RELAXED);
+}
+
+void AtomicMax(volatile ULONGLONG* target, ULONGLONG value) {
+    ULONGLONG current = __atomic_load_n(target, __ATOMIC_RELAXED);
+    while (current < value
+           && !__atomic_compare_exchange_n(target, &current, value, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+ULONGLONG GetMonotonicNanoseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (ULONGLONG) now.tv_sec * 1000000000ULL + (ULONGLONG) now.tv_nsec;
+}
+#endif // _WIN32
+
+/***********************************************************
+* BLOCK DEVICES
+*
+* Every read of the volume goes through a dext2_device.
+* A driver only has to implement positional reads, so one
+* device can be shared by several threads: there is no
+* common file pointer to race on
+************************************************************/
+
+typedef struct dext2_device dext2_device;
+
+// One read of a batch. success is filled in when the batch completes
+typedef struct {
+    LONGLONG offset;
+    DWORD length;
+    LPVOID buffer;
+    BOOL success;
+} dext2_io_request;
+
+struct dext2_device {
+    BOOL (*read)(dext2_device* device, LONGLONG offset, DWORD nBytes, OUT LPVOID destination);
+    // Optional, keeps many reads in flight at once. NULL when the driver
+    // has no asynchronous engine, batches are then read one by one
+    BOOL (*readBatch)(dext2_device* device, dext2_io_request* requests, DWORD count);
+    void (*close)(dext2_device* device);
+    // Set by memory-mapped drivers: the whole device is readable in place
+    const BYTE* mappedBase;
+    ULONGLONG mappedSize;
+};
+
+typedef enum {
+    DEXT2_ADVICE_NORMAL,
+    DEXT2_ADVICE_RANDOM,
+    DEXT2_ADVICE_SEQUENTIAL,
+    DEXT2_ADVICE_WILLNEED
+} DEXT2_ACCESS_ADVICE;
+
+// Pointer to nBytes of the device at offset, or NULL if the device is not
+// mapped or the range is outside of it
+const BYTE* GetMappedBytes(dext2_device* device, LONGLONG offset, ULONGLONG nBytes) {
+    if (device->mappedBase == NULL || offset < 0 || (ULONGLONG) offset + nBytes > device->mappedSize) {
+        return NULL;
+    }
+    return device->mappedBase + offset;
+}
+
+BOOL MappedDeviceRead(dext2_device* device, LONGLONG offset, DWORD nBytes, OUT LPVOID destination) {
+    const BYTE* source = GetMappedBytes(device, offset, nBytes);
+    if (source == NULL) {
+        DEXT2_LOG_DEBUG("Read past the end of the mapping");
+        return FALSE;
+    }
+    memcpy(destination, source, nBytes);
+    return TRUE;
+}
+
+// Reads every request of the batch. Returns TRUE if all of them succeeded,
+// the success field of each request tells which ones did not
+BOOL ReadDeviceBatch(dext2_device* device, dext2_io_request* requests, DWORD count) {
+    if (device->readBatch != NULL) {
+        return device->readBatch(device, requests, count);
+    }
+    BOOL allRead = TRUE;
+    for (DWORD i = 0; i < count; i++) {
+        requests[i].success = device->read(device, requests[i].offset, requests[i].length, requests[i].buffer);
+        allRead = allRead && requests[i].success;
+    }
+    return allRead;
+}
+
+// Access pattern hint for a mapped range, ignored for other devices
+void AdviseDeviceRange(dext2_device* device, LONGLONG offset, ULONGLONG nBytes, DEXT2_ACCESS_ADVICE advice) {
+    if (GetMappedBytes(device, offset, nBytes) == NULL || nBytes == 0) {
+        return;
+    }
+#ifdef _WIN32
+    // PrefetchVirtualMemory is Windows 8+ only, the cache manager does
+    // its own read-ahead on mapped files
+    (void) advice;
+#else
+    LONGLONG pageSize = sysconf(_SC_PAGESIZE);
+    LONGLONG alignedOffset = offset - offset % pageSize;
+    int posixAdvice = advice == DEXT2_ADVICE_RANDOM ? MADV_RANDOM
+                    : advice == DEXT2_ADVICE_SEQUENTIAL ? MADV_SEQUENTIAL
+                    : advice == DEXT2_ADVICE_WILLNEED ? MADV_WILLNEED
+                    : MADV_NORMAL;
+    madvise((void*) (device->mappedBase + alignedOffset), (size_t) (nBytes + (ULONGLONG) (offset - alignedOffset)), posixAdvice);
+#endif // _WIN32
+}
 
-ext2_super_block g_mainSuperBlock = {0};
-#define llBlockSize ( (LONGLONG) (1024 << g_mainSuperBlock.s_log_block_size) )
-#define dwBlockSize ( (DWORD) (1024 << g_mainSuperBlock.s_log_block_size) )
-LONGLONG g_partitionStart = 0;
+#ifdef _WIN32
+typedef struct {
+    dext2_device base;
+    HANDLE hDisk;
+    BOOL ownsHandle;
+} dext2_win32_device;
 
-BOOL ReadBytes(HANDLE hFile, LONGLONG fromWhereToRead, DWORD nBytesToRead, OUT LPVOID destination) {
+// Physical drives only accept sector-aligned reads, so the request is
+// widened to whole sectors and the wanted part is copied out
+BOOL Win32DeviceRead(dext2_device* device, LONGLONG fromWhereToRead, DWORD nBytesToRead, OUT LPVOID destination) {
+    HANDLE hDisk = ((dext2_win32_device*) device)->hDisk;
     DWORD startingOffset = fromWhereToRead % 512;
     fromWhereToRead -= (LONGLONG) startingOffset;
     nBytesToRead += startingOffset;
-    LARGE_INTEGER li = { .QuadPart = fromWhereToRead };
-    if (!SetFilePointerEx(hFile, li, NULL, FILE_BEGIN)) {
-        DEXT2_LOG_DEBUG("Fucked up file pointer");
-        return FALSE;
-    }
 
     DWORD bufferSize = nBytesToRead % 512 != 0 ?
         (nBytesToRead/512 + 1) * 512 :
         nBytesToRead; 
     PBYTE buffer = (PBYTE) malloc((size_t) bufferSize);
     DWORD bytesRead;
+
+    // An explicit offset makes ReadFile positional, no SetFilePointerEx needed
+    OVERLAPPED overlapped = {0};
+    overlapped.Offset = (DWORD) (fromWhereToRead & 0xFFFFFFFF);
+    overlapped.OffsetHigh = (DWORD) (fromWhereToRead >> 32);
     
-    if (!ReadFile(hFile, (LPVOID) buffer, bufferSize, &bytesRead, NULL) || bytesRead < nBytesToRead) {
+    if (!ReadFile(hDisk, (LPVOID) buffer, bufferSize, &bytesRead, &overlapped) || bytesRead < nBytesToRead) {
         DEXT2_LOG_DEBUG("Fucked up while trying to read file");
         free(buffer);
         return FALSE;
@@ -180,476 +579,4994 @@ BOOL ReadBytes(HANDLE hFile, LONGLONG fromWhereToRead, DWORD nBytesToRead, OUT L
     }
 }
 
-BOOL GetInodeByNumber(HANDLE hExt2, DWORD inodeNumber, OUT ext2_inode* lpInode) {
-    DWORD inodesPerGroup = g_mainSuperBlock.s_inodes_per_group;
-    DWORD blockGroupNumber = (inodeNumber - 1) / inodesPerGroup;
-    LONGLONG blockGroupDescriptorTableLocation;
-    if (llBlockSize == 1024)
-        blockGroupDescriptorTableLocation =  2 * llBlockSize;
-    else
-        blockGroupDescriptorTableLocation =  1 * llBlockSize;
-    LONGLONG entryLocation = blockGroupDescriptorTableLocation
-                             + (LONGLONG) DEXT2_GROUP_DESCRIPTOR_ENTRY_SIZE*blockGroupNumber;
-    ext2_group_desc descriptor;
-    if (!ReadBytes(hExt2, g_partitionStart + entryLocation, sizeof(ext2_group_desc), &descriptor)) {
-        DEXT2_LOG_DEBUG("GetInodeByNumber fail");
-        return FALSE;
+void Win32DeviceClose(dext2_device* device) {
+    dext2_win32_device* win32Device = (dext2_win32_device*) device;
+    if (win32Device->ownsHandle) {
+        CloseHandle(win32Device->hDisk);
     }
-    LONGLONG inodeTableLocation = (LONGLONG) descriptor.bg_inode_table * llBlockSize;
-    DWORD inodeIndex = (inodeNumber - 1) % inodesPerGroup;
-    LONGLONG inodePhysicalLocation = inodeTableLocation + DEXT2_INODE_SIZE*((LONGLONG) inodeIndex);
-    if(!ReadBytes(hExt2, g_partitionStart + inodePhysicalLocation, sizeof(ext2_inode), lpInode)) {
-        DEXT2_LOG_DEBUG("GetInodeByNumber fail");
-        return FALSE;
+    free(win32Device);
+}
+
+// Wraps an already opened disk, partition or image handle
+dext2_device* OpenWin32Device(HANDLE hDisk, BOOL ownsHandle) {
+    dext2_win32_device* device = (dext2_win32_device*) malloc(sizeof(dext2_win32_device));
+    if (device == NULL) {
+        return NULL;
+    }
+    device->base.read = Win32DeviceRead;
+    device->base.readBatch = NULL;
+    device->base.close = Win32DeviceClose;
+    device->base.mappedBase = NULL;
+    device->base.mappedSize = 0;
+    device->hDisk = hDisk;
+    device->ownsHandle = ownsHandle;
+    return &device->base;
+}
+#else
+BOOL PosixDeviceReadAt(int fd, LONGLONG fromWhereToRead, DWORD nBytesToRead, OUT LPVOID destination) {
+    PBYTE buffer = (PBYTE) destination;
+    DWORD total = 0;
+    while (total < nBytesToRead) {
+        ssize_t bytesRead = pread(fd, buffer + total, nBytesToRead - total, (off_t) (fromWhereToRead + total));
+        if (bytesRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead <= 0) {
+            DEXT2_LOG_DEBUG("pread failed at offset %lld", (long long) (fromWhereToRead + total));
+            return FALSE;
+        }
+        total += (DWORD) bytesRead;
     }
     return TRUE;
 }
 
-DEXT2_ERROR SeekInodeByFileName(HANDLE hExt2, LPCSTR fileName, ext2_inode* pInode, OUT ext2_inode* pNewInode) {
-    if ((pInode->i_mode & DEXT2_INODE_IS_DIR) == 0) {
-        return DEXT2_ERROR_FILE_MISSING;
+#ifdef DEXT2_HAVE_IO_URING
+// io_uring engine
+//
+// Talks to the kernel through the raw system calls, so liburing is not
+// needed. One ring per device, batches from different threads take turns
+#define DEXT2_URING_QUEUE_DEPTH 256
+#define DEXT2_URING_STACK_REQUESTS 64
+
+typedef struct {
+    int ringFd;
+    LPVOID sqRing;
+    size_t sqRingSize;
+    LPVOID cqRing;                 // Same as sqRing with IORING_FEAT_SINGLE_MMAP
+    size_t cqRingSize;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned sqEntries;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_cqe* cqes;
+    unsigned cqEntries;
+    BOOL broken;                   // io_uring_enter failed, batches go through pread
+    dext2_mutex lock;
+} dext2_uring;
+
+void FreeUring(dext2_uring* ring) {
+    if (ring == NULL) {
+        return;
     }
-    PDWORD dataBlocks = NULL;
-    ULONGLONG dataBlocksSize;
-    if(!GetDataBlocks(hExt2, pInode, &dataBlocks, &dataBlocksSize)) {
-        return DEXT2_ERROR_READING_DISK;
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing != NULL && ring->cqRing != MAP_FAILED && ring->cqRing != ring->sqRing) munmap(ring->cqRing, ring->cqRingSize);
+    if (ring->sqRing != NULL && ring->sqRing != MAP_FAILED) munmap(ring->sqRing, ring->sqRingSize);
+    if (ring->ringFd >= 0) close(ring->ringFd);
+    DestroyMutex(&ring->lock);
+    free(ring);
+}
+
+// NULL when the kernel has no io_uring or it is not allowed, e.g. by seccomp
+dext2_uring* CreateUring(void) {
+    dext2_uring* ring = (dext2_uring*) calloc(1, sizeof(dext2_uring));
+    if (ring == NULL) {
+        return NULL;
     }
-    PBYTE buffer = (PBYTE) malloc(llBlockSize);
-    PBYTE dePointer = buffer;
-    for (DWORD i = 0; i < dataBlocksSize; i++) {
-        if(!ReadBytes(hExt2, g_partitionStart + llBlockSize*dataBlocks[i], dwBlockSize, buffer)) {
-            free(buffer);
-            free(dataBlocks);
-            return DEXT2_ERROR_READING_DISK;
+    InitMutex(&ring->lock);
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->ringFd = (int) syscall(__NR_io_uring_setup, DEXT2_URING_QUEUE_DEPTH, &params);
+    if (ring->ringFd < 0) {
+        DEXT2_LOG_DEBUG("io_uring is not available, errno %d", errno);
+        FreeUring(ring);
+        return NULL;
+    }
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqRingSize > ring->sqRingSize) {
+            ring->sqRingSize = ring->cqRingSize;
         }
-        dePointer = buffer;
-        while (TRUE) {
-            ext2_dir_entry de = *(ext2_dir_entry*) dePointer;
-            if ((LONGLONG) (dePointer - buffer) >= llBlockSize) {
-                break;
-            }
-            if (de.rec_len == 0) {
-                free(buffer);
-                free(dataBlocks);
-                return DEXT2_ERROR_FILE_MISSING;
-            }
-            if (strncmp(fileName, de.name, 255) == 0) {
-                if (!GetInodeByNumber(hExt2, de.inode, pNewInode)) {
-                    free(buffer);
-                    free(dataBlocks);
-                    return DEXT2_ERROR_READING_DISK;
-                }
-                free(buffer);
-                free(dataBlocks);
-                return DEXT2_NO_ERROR;
-            }
-            dePointer += de.rec_len;
+        ring->cqRingSize = ring->sqRingSize;
+    }
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringFd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED) {
+        FreeUring(ring);
+        return NULL;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cqRing = ring->sqRing;
+    } else {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringFd, IORING_OFF_CQ_RING);
+        if (ring->cqRing == MAP_FAILED) {
+            FreeUring(ring);
+            return NULL;
         }
     }
-    
-    free(buffer);
-    free(dataBlocks);
-    return DEXT2_ERROR_FILE_MISSING;
-}
-DEXT2_ERROR GetChilds(HANDLE hExt2, ext2_inode* pInode, OUT ext2_dir_entry** directoryEntries, OUT PULONGLONG arraySize) {
-    *arraySize = 32;
-    *directoryEntries = (ext2_dir_entry*) malloc((*arraySize) * sizeof(ext2_dir_entry));
-    if (*directoryEntries == NULL) {
-        return DEXT2_ERROR_INTERNAL;
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*) mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringFd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        FreeUring(ring);
+        return NULL;
     }
 
-    ULONGLONG deIndex = 0;
-    if ((pInode->i_mode & DEXT2_INODE_IS_DIR) == 0) {
-        free(*directoryEntries);
-        return DEXT2_ERROR_FILE_MISSING;
-    }
+    PBYTE sq = (PBYTE) ring->sqRing;
+    PBYTE cq = (PBYTE) ring->cqRing;
+    ring->sqHead = (unsigned*) (sq + params.sq_off.head);
+    ring->sqTail = (unsigned*) (sq + params.sq_off.tail);
+    ring->sqMask = (unsigned*) (sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned*) (sq + params.sq_off.array);
+    ring->sqEntries = params.sq_entries;
+    ring->cqHead = (unsigned*) (cq + params.cq_off.head);
+    ring->cqTail = (unsigned*) (cq + params.cq_off.tail);
+    ring->cqMask = (unsigned*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+    ring->cqEntries = params.cq_entries;
+    return ring;
+}
 
-    PDWORD dataBlocks = NULL;
-    ULONGLONG dataBlocksSize;
-    if (!GetDataBlocks(hExt2, pInode, &dataBlocks, &dataBlocksSize)) {
-        free(*directoryEntries);
-        return DEXT2_ERROR_READING_DISK;
+// Keeps up to the ring size of reads in flight. Short reads are resubmitted
+// for the rest, failed ones are retried with a plain pread so an old kernel
+// without IORING_OP_READ still works
+BOOL UringReadBatch(dext2_uring* ring, int fd, dext2_io_request* requests, DWORD count) {
+    // Bookkeeping of the usual batch sizes stays on the stack
+    DWORD doneSmall[DEXT2_URING_STACK_REQUESTS];
+    DWORD queueSmall[DEXT2_URING_STACK_REQUESTS];
+    BOOL onStack = count <= DEXT2_URING_STACK_REQUESTS;
+    PDWORD done = onStack ? doneSmall : (PDWORD) malloc(count * sizeof(DWORD));
+    PDWORD queue = onStack ? queueSmall : (PDWORD) malloc(count * sizeof(DWORD));
+    if (done == NULL || queue == NULL) {
+        if (!onStack) {
+            free(done);
+            free(queue);
+        }
+        return FALSE;
     }
-
-    PBYTE buffer = (PBYTE) malloc(llBlockSize);
-    if (buffer == NULL) {
-        free(*directoryEntries);
-        free(dataBlocks);
-        return DEXT2_ERROR_INTERNAL;
+    memset(done, 0, count * sizeof(DWORD));
+    // Requests waiting for submission, in order
+    DWORD queueHead = 0;
+    DWORD queueCount = count;
+    for (DWORD i = 0; i < count; i++) {
+        queue[i] = i;
+        requests[i].success = FALSE;
     }
 
-    for (DWORD i = 0; i < dataBlocksSize; i++) {
-        if (!ReadBytes(hExt2, g_partitionStart + llBlockSize * dataBlocks[i], dwBlockSize, buffer)) {
-            free(buffer);
-            free(dataBlocks);
-            free(*directoryEntries);
-            return DEXT2_ERROR_READING_DISK;
+    LockMutex(&ring->lock);
+    DWORD inFlight = 0;
+    BOOL ringFailed = ring->broken;
+    while (!ringFailed) {
+        unsigned tail = *ring->sqTail;
+        unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+        while (queueCount > 0 && tail - head < ring->sqEntries && inFlight + (tail - head) < ring->cqEntries) {
+            DWORD index = queue[queueHead];
+            queueHead = (queueHead + 1) % count;
+            queueCount--;
+            unsigned slot = tail & *ring->sqMask;
+            struct io_uring_sqe* sqe = &ring->sqes[slot];
+            memset(sqe, 0, sizeof(struct io_uring_sqe));
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->off = (__u64) (requests[index].offset + done[index]);
+            sqe->addr = (__u64) (uintptr_t) ((PBYTE) requests[index].buffer + done[index]);
+            sqe->len = requests[index].length - done[index];
+            sqe->user_data = index;
+            ring->sqArray[slot] = slot;
+            tail++;
+        }
+        __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+        // Entries the kernel has not consumed yet, including ones left by an interrupted call
+        unsigned toSubmit = tail - head;
+        if (toSubmit == 0 && inFlight == 0) {
+            break;
         }
 
-        PBYTE dePointer = buffer;
-        while (TRUE) {
-            ext2_dir_entry de = *(ext2_dir_entry*) dePointer;
-            if ((LONGLONG)(dePointer - buffer) >= llBlockSize) {
-                break;
+        long entered = syscall(__NR_io_uring_enter, ring->ringFd, toSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (entered < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
             }
-            if (de.rec_len == 0) {
-                free(buffer);
-                free(dataBlocks);
-                free(*directoryEntries);
-                return DEXT2_ERROR_FILE_MISSING;
-            }
-
-            (*directoryEntries)[deIndex] = de;
-            deIndex++;
-            if (deIndex >= *arraySize) {
-                ext2_dir_entry* temp = (ext2_dir_entry*) realloc(*directoryEntries, (*arraySize) * 2 * sizeof(ext2_dir_entry));
-                if (temp == NULL) {
-                    free(*directoryEntries);
-                    free(buffer);
-                    free(dataBlocks);
-                    return DEXT2_ERROR_INTERNAL;
+            DEXT2_LOG_DEBUG("io_uring_enter failed, errno %d", errno);
+            ring->broken = TRUE;
+            ringFailed = TRUE;
+            break;
+        }
+        inFlight += (DWORD) entered;
+
+        unsigned cqHead = *ring->cqHead;
+        unsigned cqTail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+        while (cqHead != cqTail) {
+            struct io_uring_cqe* cqe = &ring->cqes[cqHead & *ring->cqMask];
+            DWORD index = (DWORD) cqe->user_data;
+            int result = cqe->res;
+            cqHead++;
+            inFlight--;
+            if (result > 0) {
+                done[index] += (DWORD) result;
+                if (done[index] == requests[index].length) {
+                    requests[index].success = TRUE;
+                    continue;
                 }
-                *directoryEntries = temp;
-                *arraySize *= 2;
             }
-            dePointer += de.rec_len;
+            if (result == -EAGAIN || result == -EINTR || (result > 0 && done[index] < requests[index].length)) {
+                queue[(queueHead + queueCount) % count] = index;
+                queueCount++;
+            }
+            // Any other error or end of file is settled by the pread below
         }
+        __atomic_store_n(ring->cqHead, cqHead, __ATOMIC_RELEASE);
     }
+    UnlockMutex(&ring->lock);
 
-    *arraySize = deIndex;
-    free(buffer);
-    free(dataBlocks);
-    return DEXT2_NO_ERROR;
+    BOOL allRead = TRUE;
+    if (inFlight == 0) {
+        for (DWORD i = 0; i < count; i++) {
+            if (!requests[i].success) {
+                requests[i].success = requests[i].length == done[i] || PosixDeviceReadAt(fd, requests[i].offset + done[i],
+                                                                                         requests[i].length - done[i],
+                                                                                         (PBYTE) requests[i].buffer + done[i]);
+            }
+            allRead = allRead && requests[i].success;
+        }
+    } else {
+        // Reads may still land in the buffers, nothing can be trusted
+        allRead = FALSE;
+    }
+    if (!onStack) {
+        free(done);
+        free(queue);
+    }
+    return allRead;
 }
+#endif // DEXT2_HAVE_IO_URING
 
+typedef struct {
+    dext2_device base;
+    int fd;
+    BOOL ownsFd;
+#ifdef DEXT2_HAVE_IO_URING
+    dext2_uring* ring;
+#endif // DEXT2_HAVE_IO_URING
+} dext2_posix_device;
 
-DEXT2_ERROR _ResolvePathInner(HANDLE hExt2, LPCSTR path, ext2_inode* pInode) {
-    CHAR fileName[256];
-    DWORD i = 0;
-    while (path[i] != '\0' && path[i] != '/') {
-        if (i >= 256) {
-            return DEXT2_ERROR_INTERNAL;
-        }
-        fileName[i] = path[i];
-        i++;   
+BOOL PosixDeviceRead(dext2_device* device, LONGLONG fromWhereToRead, DWORD nBytesToRead, OUT LPVOID destination) {
+    return PosixDeviceReadAt(((dext2_posix_device*) device)->fd, fromWhereToRead, nBytesToRead, destination);
+}
+
+#ifdef DEXT2_HAVE_IO_URING
+BOOL PosixDeviceReadBatch(dext2_device* device, dext2_io_request* requests, DWORD count) {
+    dext2_posix_device* posixDevice = (dext2_posix_device*) device;
+    return UringReadBatch(posixDevice->ring, posixDevice->fd, requests, count);
+}
+#endif // DEXT2_HAVE_IO_URING
+
+void PosixDeviceClose(dext2_device* device) {
+    dext2_posix_device* posixDevice = (dext2_posix_device*) device;
+#ifdef DEXT2_HAVE_IO_URING
+    FreeUring(posixDevice->ring);
+#endif // DEXT2_HAVE_IO_URING
+    if (posixDevice->ownsFd) {
+        close(posixDevice->fd);
     }
-    fileName[i] = '\0';
-    ext2_inode newInode;
-    DEXT2_ERROR status = SeekInodeByFileName(hExt2, fileName, pInode, &newInode);
-    if (status != DEXT2_NO_ERROR) {
-        return status;
+    free(posixDevice);
+}
+
+// Wraps an already opened block device or image file descriptor. Batched
+// reads go through io_uring when the kernel allows it
+dext2_device* OpenPosixDevice(int fd, BOOL ownsFd) {
+    dext2_posix_device* device = (dext2_posix_device*) malloc(sizeof(dext2_posix_device));
+    if (device == NULL) {
+        return NULL;
     }
-    *pInode = newInode;
-    DWORD pathLength = strnlen(path, 256);
-    if (pathLength == i || (path[pathLength-1] == '/' && pathLength - 1 == i)) {
-        return DEXT2_NO_ERROR;
+    device->base.read = PosixDeviceRead;
+    device->base.readBatch = NULL;
+    device->base.close = PosixDeviceClose;
+    device->base.mappedBase = NULL;
+    device->base.mappedSize = 0;
+    device->fd = fd;
+    device->ownsFd = ownsFd;
+#ifdef DEXT2_HAVE_IO_URING
+    device->ring = CreateUring();
+    if (device->ring != NULL) {
+        device->base.readBatch = PosixDeviceReadBatch;
     }
-    return _ResolvePathInner(hExt2, path + i + 1, pInode);
+#endif // DEXT2_HAVE_IO_URING
+    return &device->base;
 }
+#endif // _WIN32
 
-DEXT2_ERROR ResolvePath(HANDLE hExt2, LPCSTR path, OUT ext2_inode* pInode) {
-    if (path[0] != '/') {
-        return DEXT2_ERROR_FILE_MISSING;
+// Opens a raw image file (or a device path) read-only with the native driver
+dext2_device* OpenImageFile(LPCSTR path) {
+#ifdef _WIN32
+    HANDLE hImage = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    if (hImage == INVALID_HANDLE_VALUE) {
+        return NULL;
     }
-    if (!GetInodeByNumber(hExt2, 2, pInode)) {
-        return DEXT2_ERROR_READING_DISK;
+    dext2_device* device = OpenWin32Device(hImage, TRUE);
+    if (device == NULL) {
+        CloseHandle(hImage);
     }
-    if (path[1] == '\0') {
-        return DEXT2_NO_ERROR;
+    return device;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
     }
-    return _ResolvePathInner(hExt2, path + 1, pInode);
+    dext2_device* device = OpenPosixDevice(fd, TRUE);
+    if (device == NULL) {
+        close(fd);
+    }
+    return device;
+#endif // _WIN32
 }
 
-BOOL GetPartitions(HANDLE hDisk, OUT PPARTITION_INFORMATION_EX* partitions, OUT PDWORD arrayLength) {
-    DWORD bytesReturned;
-    size_t bufferSize = sizeof(DRIVE_LAYOUT_INFORMATION_EX) 
-        + DEXT2_MAX_PARTITION_COUNT * sizeof(PARTITION_INFORMATION_EX);
-    PDRIVE_LAYOUT_INFORMATION_EX driveLayout = (PDRIVE_LAYOUT_INFORMATION_EX) malloc(bufferSize);
+// Maps a local image file read-only. Reads become plain copies out of the
+// mapping and metadata is parsed in place. Raw disks cannot be mapped,
+// NULL is returned for them as for any other failure
+#ifdef _WIN32
+typedef struct {
+    dext2_device base;
+    HANDLE hImage;
+    HANDLE hMapping;
+} dext2_win32_mapped_device;
 
-    if (!DeviceIoControl(
-            hDisk,
-            IOCTL_DISK_GET_DRIVE_LAYOUT_EX,
-            NULL,
-            0,
-            driveLayout,
-            (DWORD) bufferSize,
-            &bytesReturned,
-            NULL)
-    ) {
-        free(driveLayout);
-        return FALSE;
-    }
+void Win32MappedDeviceClose(dext2_device* device) {
+    dext2_win32_mapped_device* mappedDevice = (dext2_win32_mapped_device*) device;
+    UnmapViewOfFile((LPCVOID) mappedDevice->base.mappedBase);
+    CloseHandle(mappedDevice->hMapping);
+    CloseHandle(mappedDevice->hImage);
+    free(mappedDevice);
+}
 
-    if (
-        driveLayout->PartitionStyle != PARTITION_STYLE_GPT
-        && driveLayout->PartitionStyle != PARTITION_STYLE_MBR
-    ) {
-        free(driveLayout);
-        return FALSE;
+dext2_device* OpenMappedImageFile(LPCSTR path) {
+    HANDLE hImage = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    if (hImage == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(hImage, &size) || size.QuadPart == 0) {
+        CloseHandle(hImage);
+        return NULL;
+    }
+    HANDLE hMapping = CreateFileMappingA(hImage, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (hMapping == NULL) {
+        CloseHandle(hImage);
+        return NULL;
+    }
+    LPVOID view = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    dext2_win32_mapped_device* device = (dext2_win32_mapped_device*) malloc(sizeof(dext2_win32_mapped_device));
+    if (view == NULL || device == NULL) {
+        if (view != NULL) UnmapViewOfFile(view);
+        free(device);
+        CloseHandle(hMapping);
+        CloseHandle(hImage);
+        return NULL;
     }
+    device->base.read = MappedDeviceRead;
+    device->base.readBatch = NULL;
+    device->base.close = Win32MappedDeviceClose;
+    device->base.mappedBase = (const BYTE*) view;
+    device->base.mappedSize = (ULONGLONG) size.QuadPart;
+    device->hImage = hImage;
+    device->hMapping = hMapping;
+    return &device->base;
+}
+#else
+void PosixMappedDeviceClose(dext2_device* device) {
+    munmap((void*) device->mappedBase, (size_t) device->mappedSize);
+    free(device);
+}
 
-    *arrayLength = driveLayout->PartitionCount;
-    size_t partitionsSize = *arrayLength * sizeof(PARTITION_INFORMATION_EX);
-    *partitions = (PPARTITION_INFORMATION_EX) malloc(partitionsSize);
-    memcpy(*partitions, driveLayout->PartitionEntry, partitionsSize);
-    free(driveLayout);
-    return TRUE;
+dext2_device* OpenMappedImageFile(LPCSTR path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size <= 0) {
+        close(fd);
+        return NULL;
+    }
+    void* view = mmap(NULL, (size_t) size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping keeps the file referenced
+    close(fd);
+    if (view == MAP_FAILED) {
+        return NULL;
+    }
+    dext2_device* device = (dext2_device*) malloc(sizeof(dext2_device));
+    if (device == NULL) {
+        munmap(view, (size_t) size);
+        return NULL;
+    }
+    device->read = MappedDeviceRead;
+    device->readBatch = NULL;
+    device->close = PosixMappedDeviceClose;
+    device->mappedBase = (const BYTE*) view;
+    device->mappedSize = (ULONGLONG) size;
+    // Metadata lookups jump around the image, file extraction
+    // switches its own ranges to sequential
+    AdviseDeviceRange(device, 0, device->mappedSize, DEXT2_ADVICE_RANDOM);
+    return device;
 }
+#endif // _WIN32
 
-BOOL IsPartitionEmpty(PPARTITION_INFORMATION_EX partition) {
-    if (partition->PartitionStyle == PARTITION_STYLE_MBR) {
-        return partition->Mbr.PartitionType == PARTITION_ENTRY_UNUSED; 
-    } 
-    else if (partition->PartitionStyle == PARTITION_STYLE_GPT) {
-        GUID emptyGuid = {0};
-        return memcmp(&partition->Gpt.PartitionType, &emptyGuid, sizeof(GUID)) == 0;
+void CloseDevice(dext2_device* device) {
+    if (device != NULL) {
+        device->close(device);
     }
-    return FALSE;
 }
 
-BOOL GetDataBlocks(HANDLE hExt2, ext2_inode* pInode, OUT PDWORD* dataBlocks, OUT PULONGLONG dataBlocksSize) {
-    DWORD fileSize = pInode->i_size;
-    DWORD nDataBlocks = fileSize / dwBlockSize + ((fileSize % dwBlockSize) != 0);
-    DWORD addressesPerBlock = dwBlockSize / sizeof(DWORD);
-    *dataBlocksSize = nDataBlocks;
-    *dataBlocks = (PDWORD) malloc(nDataBlocks * sizeof(DWORD));
+/***********************************************************
+* CACHE
+*
+* Fixed-size values keyed by a 64-bit number. Keys are
+* spread over independently locked shards, each one being
+* a chained hash table with its own LRU list, so concurrent
+* readers rarely wait on each other. Values are copied in
+* and out under the shard lock, callers never hold pointers
+* into the cache
+************************************************************/
 
-    PDWORD indirect = (PDWORD) malloc(llBlockSize);
-    PDWORD doublyIndirect = (PDWORD) malloc(llBlockSize);
-    PDWORD treblyIndirect = (PDWORD) malloc(llBlockSize);
+#define DEXT2_CACHE_SHARD_COUNT 16
 
-    DWORD currentBlockIndex = 0;
-    { // direct
-        for (; currentBlockIndex < nDataBlocks && currentBlockIndex < 12; currentBlockIndex++) {
-            (*dataBlocks)[currentBlockIndex] = pInode->i_block[currentBlockIndex];
-        }
-    }
-    { // singly indirect
-        LONGLONG indirectBlockLocation1 = (LONGLONG) pInode->i_block[12] * llBlockSize;
-        if (!ReadBytes(hExt2, indirectBlockLocation1 + g_partitionStart, dwBlockSize, indirect)) {
-            goto fail;
-        }
-        for (DWORD i = 0; currentBlockIndex < nDataBlocks && i < addressesPerBlock; currentBlockIndex++, i++) {
-            (*dataBlocks)[currentBlockIndex] = indirect[i];
-        }
-    }
+typedef struct dext2_cache_entry dext2_cache_entry;
 
-    { // doubly indirect
-        LONGLONG indirectBlockLocation2 = (LONGLONG) pInode->i_block[13] * llBlockSize;
-        if (!ReadBytes(hExt2, indirectBlockLocation2 + g_partitionStart, dwBlockSize, doublyIndirect)) {
-            goto fail;
-        }
-        for (DWORD j = 0; currentBlockIndex < nDataBlocks && j < addressesPerBlock; currentBlockIndex++, j++) {
-            LONGLONG indirectBlockLocation1 = (LONGLONG) doublyIndirect[j] * llBlockSize;
-            if (!ReadBytes(hExt2, indirectBlockLocation1 + g_partitionStart, dwBlockSize, indirect)) {
-                goto fail;
-            }
-            for (DWORD i = 0; currentBlockIndex < nDataBlocks && i < addressesPerBlock; currentBlockIndex++, i++) {
-                (*dataBlocks)[currentBlockIndex] = indirect[i];
-            }
-        }
+struct dext2_cache_entry {
+    ULONGLONG key;
+    dext2_cache_entry* hashNext;
+    dext2_cache_entry* lruPrev;    // towards most recently used
+    dext2_cache_entry* lruNext;    // towards least recently used
+    // value of valueSize bytes follows
+};
+
+#define CacheEntryValue(entry) ( (PBYTE) ((entry) + 1) )
+
+typedef struct {
+    dext2_mutex lock;
+    dext2_cache_entry** buckets;
+    DWORD bucketCount;
+    dext2_cache_entry* lruHead;
+    dext2_cache_entry* lruTail;
+    DWORD entryCount;
+    DWORD capacity;
+    ULONGLONG hits;
+    ULONGLONG misses;
+} dext2_cache_shard;
+
+typedef struct {
+    DWORD valueSize;
+    dext2_cache_shard shards[DEXT2_CACHE_SHARD_COUNT];
+} dext2_cache;
+
+typedef struct {
+    ULONGLONG hits;
+    ULONGLONG misses;
+    ULONGLONG entryCount;
+    ULONGLONG capacity;            // in entries
+    DWORD valueSize;
+} dext2_cache_stats;
+
+ULONGLONG CacheHash(ULONGLONG key) {
+    key ^= key >> 33;
+    key *= 0xFF51AFD7ED558CCDULL;
+    key ^= key >> 33;
+    return key;
+}
+
+dext2_cache* CreateCache(DWORD valueSize, ULONGLONG byteBudget) {
+    ULONGLONG totalCapacity = byteBudget / (valueSize + sizeof(dext2_cache_entry));
+    DWORD shardCapacity = (DWORD) (totalCapacity / DEXT2_CACHE_SHARD_COUNT);
+    if (shardCapacity == 0) {
+        shardCapacity = 1;
     }
 
-    { // trebly indirect
-        LONGLONG indirectBlockLOcation3 = (LONGLONG) pInode->i_block[14] * llBlockSize;
-        if (!ReadBytes(hExt2, indirectBlockLOcation3 + g_partitionStart, dwBlockSize, treblyIndirect)) {
-            goto fail;
-        }
-        for (DWORD k = 0; currentBlockIndex < nDataBlocks && k < addressesPerBlock; currentBlockIndex++, k++) {
-            LONGLONG indirectBlockLocation2 = (LONGLONG) treblyIndirect[k] * llBlockSize;
-            if (!ReadBytes(hExt2, indirectBlockLocation2 + g_partitionStart, dwBlockSize, doublyIndirect)) {
-                goto fail;
-            }
-            for (DWORD j = 0; currentBlockIndex < nDataBlocks && j < addressesPerBlock; currentBlockIndex++, j++) {
-                LONGLONG indirectBlockLocation1 = (LONGLONG) doublyIndirect[j] * llBlockSize;
-                if (!ReadBytes(hExt2, indirectBlockLocation1 + g_partitionStart, dwBlockSize, indirect)) {
-                    goto fail;
-                }
-                for (DWORD i = 0; currentBlockIndex < nDataBlocks && i < addressesPerBlock; currentBlockIndex++, i++) {
-                    (*dataBlocks)[currentBlockIndex] = indirect[i];
-                }
+    dext2_cache* cache = (dext2_cache*) calloc(1, sizeof(dext2_cache));
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache->valueSize = valueSize;
+    for (DWORD i = 0; i < DEXT2_CACHE_SHARD_COUNT; i++) {
+        dext2_cache_shard* shard = &cache->shards[i];
+        InitMutex(&shard->lock);
+        shard->capacity = shardCapacity;
+        shard->bucketCount = shardCapacity;
+        shard->buckets = (dext2_cache_entry**) calloc(shard->bucketCount, sizeof(dext2_cache_entry*));
+        if (shard->buckets == NULL) {
+            for (DWORD j = 0; j <= i; j++) {
+                free(cache->shards[j].buckets);
+                DestroyMutex(&cache->shards[j].lock);
             }
+            free(cache);
+            return NULL;
         }
     }
+    return cache;
+}
 
-    success:
-        free(indirect);
-        free(doublyIndirect);
-        free(treblyIndirect);
+dext2_cache_shard* CacheShard(dext2_cache* cache, ULONGLONG hash) {
+    return &cache->shards[hash % DEXT2_CACHE_SHARD_COUNT];
+}
+
+void CacheUnlinkLru(dext2_cache_shard* shard, dext2_cache_entry* entry) {
+    if (entry->lruPrev != NULL) entry->lruPrev->lruNext = entry->lruNext;
+    else shard->lruHead = entry->lruNext;
+    if (entry->lruNext != NULL) entry->lruNext->lruPrev = entry->lruPrev;
+    else shard->lruTail = entry->lruPrev;
+}
+
+void CachePushLru(dext2_cache_shard* shard, dext2_cache_entry* entry) {
+    entry->lruPrev = NULL;
+    entry->lruNext = shard->lruHead;
+    if (shard->lruHead != NULL) shard->lruHead->lruPrev = entry;
+    shard->lruHead = entry;
+    if (shard->lruTail == NULL) shard->lruTail = entry;
+}
+
+void CacheUnlinkHash(dext2_cache_shard* shard, dext2_cache_entry* entry, DWORD bucket) {
+    dext2_cache_entry** link = &shard->buckets[bucket];
+    while (*link != entry) {
+        link = &(*link)->hashNext;
+    }
+    *link = entry->hashNext;
+}
+
+BOOL CacheLookup(dext2_cache* cache, ULONGLONG key, OUT LPVOID value) {
+    ULONGLONG hash = CacheHash(key);
+    dext2_cache_shard* shard = CacheShard(cache, hash);
+    DWORD bucket = (DWORD) ((hash / DEXT2_CACHE_SHARD_COUNT) % shard->bucketCount);
+
+    LockMutex(&shard->lock);
+    for (dext2_cache_entry* entry = shard->buckets[bucket]; entry != NULL; entry = entry->hashNext) {
+        if (entry->key == key) {
+            if (shard->lruHead != entry) {
+                CacheUnlinkLru(shard, entry);
+                CachePushLru(shard, entry);
+            }
+            memcpy(value, CacheEntryValue(entry), cache->valueSize);
+            shard->hits++;
+            UnlockMutex(&shard->lock);
+            return TRUE;
+        }
+    }
+    shard->misses++;
+    UnlockMutex(&shard->lock);
+    return FALSE;
+}
+
+// Presence check that leaves the LRU order and the statistics alone
+BOOL CacheContains(dext2_cache* cache, ULONGLONG key) {
+    ULONGLONG hash = CacheHash(key);
+    dext2_cache_shard* shard = CacheShard(cache, hash);
+    DWORD bucket = (DWORD) ((hash / DEXT2_CACHE_SHARD_COUNT) % shard->bucketCount);
+
+    LockMutex(&shard->lock);
+    dext2_cache_entry* entry = shard->buckets[bucket];
+    while (entry != NULL && entry->key != key) {
+        entry = entry->hashNext;
+    }
+    UnlockMutex(&shard->lock);
+    return entry != NULL;
+}
+
+void CacheInsert(dext2_cache* cache, ULONGLONG key, LPCVOID value) {
+    ULONGLONG hash = CacheHash(key);
+    dext2_cache_shard* shard = CacheShard(cache, hash);
+    DWORD bucket = (DWORD) ((hash / DEXT2_CACHE_SHARD_COUNT) % shard->bucketCount);
+
+    LockMutex(&shard->lock);
+    dext2_cache_entry* entry = shard->buckets[bucket];
+    while (entry != NULL && entry->key != key) {
+        entry = entry->hashNext;
+    }
+
+    if (entry != NULL) {
+        CacheUnlinkLru(shard, entry);
+    } else {
+        if (shard->entryCount < shard->capacity) {
+            entry = (dext2_cache_entry*) malloc(sizeof(dext2_cache_entry) + cache->valueSize);
+            if (entry == NULL) {
+                UnlockMutex(&shard->lock);
+                return;
+            }
+            shard->entryCount++;
+        } else {
+            // Recycle the least recently used entry
+            entry = shard->lruTail;
+            ULONGLONG victimHash = CacheHash(entry->key);
+            CacheUnlinkLru(shard, entry);
+            CacheUnlinkHash(shard, entry, (DWORD) ((victimHash / DEXT2_CACHE_SHARD_COUNT) % shard->bucketCount));
+        }
+        entry->key = key;
+        entry->hashNext = shard->buckets[bucket];
+        shard->buckets[bucket] = entry;
+    }
+    memcpy(CacheEntryValue(entry), value, cache->valueSize);
+    CachePushLru(shard, entry);
+    UnlockMutex(&shard->lock);
+}
+
+void ClearCache(dext2_cache* cache) {
+    for (DWORD i = 0; i < DEXT2_CACHE_SHARD_COUNT; i++) {
+        dext2_cache_shard* shard = &cache->shards[i];
+        LockMutex(&shard->lock);
+        dext2_cache_entry* entry = shard->lruHead;
+        while (entry != NULL) {
+            dext2_cache_entry* next = entry->lruNext;
+            free(entry);
+            entry = next;
+        }
+        memset(shard->buckets, 0, shard->bucketCount * sizeof(dext2_cache_entry*));
+        shard->lruHead = NULL;
+        shard->lruTail = NULL;
+        shard->entryCount = 0;
+        UnlockMutex(&shard->lock);
+    }
+}
+
+void FreeCache(dext2_cache* cache) {
+    if (cache == NULL) {
+        return;
+    }
+    ClearCache(cache);
+    for (DWORD i = 0; i < DEXT2_CACHE_SHARD_COUNT; i++) {
+        free(cache->shards[i].buckets);
+        DestroyMutex(&cache->shards[i].lock);
+    }
+    free(cache);
+}
+
+void GetCacheStats(dext2_cache* cache, OUT dext2_cache_stats* stats) {
+    memset(stats, 0, sizeof(dext2_cache_stats));
+    if (cache == NULL) {
+        return;
+    }
+    stats->valueSize = cache->valueSize;
+    for (DWORD i = 0; i < DEXT2_CACHE_SHARD_COUNT; i++) {
+        dext2_cache_shard* shard = &cache->shards[i];
+        LockMutex(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->entryCount += shard->entryCount;
+        stats->capacity += shard->capacity;
+        UnlockMutex(&shard->lock);
+    }
+}
+
+/***********************************************************
+* BUFFER POOL
+*
+* Keeps released scratch buffers of one size for reuse, so the
+* read path stops allocating once it has warmed up. Buffers
+* are aligned for unbuffered and direct I/O. A pool adopts the
+* size of the first request after it changes, dropping the
+* buffers of the old size. Taking and returning a buffer is a
+* pointer pop or push under the pool's lock
+************************************************************/
+
+#define DEXT2_BUFFER_ALIGNMENT 4096
+
+LPVOID AllocAligned(size_t size) {
+#ifdef _WIN32
+    return _aligned_malloc(size, DEXT2_BUFFER_ALIGNMENT);
+#else
+    LPVOID memory;
+    return posix_memalign(&memory, DEXT2_BUFFER_ALIGNMENT, size) == 0 ? memory : NULL;
+#endif // _WIN32
+}
+
+void FreeAligned(LPVOID memory) {
+#ifdef _WIN32
+    _aligned_free(memory);
+#else
+    free(memory);
+#endif // _WIN32
+}
+
+typedef struct {
+    PBYTE* buffers;                // Idle buffers, a stack
+    DWORD count;
+    DWORD limit;                   // Idle buffers kept, more are freed on release
+    DWORD bufferSize;
+    dext2_mutex lock;
+} dext2_buffer_pool;
+
+BOOL InitBufferPool(dext2_buffer_pool* pool, DWORD limit) {
+    pool->buffers = (PBYTE*) malloc(limit * sizeof(PBYTE));
+    pool->count = 0;
+    pool->limit = pool->buffers == NULL ? 0 : limit;
+    pool->bufferSize = 0;
+    InitMutex(&pool->lock);
+    return pool->buffers != NULL;
+}
+
+// Raises the number of idle buffers kept to at least limit, for callers
+// about to hold many at once. FALSE, with the old limit kept, when out of memory
+BOOL ReserveBufferPool(dext2_buffer_pool* pool, DWORD limit) {
+    LockMutex(&pool->lock);
+    BOOL success = TRUE;
+    if (limit > pool->limit) {
+        PBYTE* buffers = (PBYTE*) realloc(pool->buffers, limit * sizeof(PBYTE));
+        if (buffers != NULL) {
+            pool->buffers = buffers;
+            pool->limit = limit;
+        } else {
+            success = FALSE;
+        }
+    }
+    UnlockMutex(&pool->lock);
+    return success;
+}
+
+void DrainBufferPool(dext2_buffer_pool* pool) {
+    LockMutex(&pool->lock);
+    for (DWORD i = 0; i < pool->count; i++) {
+        FreeAligned(pool->buffers[i]);
+    }
+    pool->count = 0;
+    UnlockMutex(&pool->lock);
+}
+
+void DestroyBufferPool(dext2_buffer_pool* pool) {
+    DrainBufferPool(pool);
+    free(pool->buffers);
+    DestroyMutex(&pool->lock);
+}
+
+PBYTE AcquireBuffer(dext2_buffer_pool* pool, DWORD size) {
+    LockMutex(&pool->lock);
+    if (pool->bufferSize != size) {
+        for (DWORD i = 0; i < pool->count; i++) {
+            FreeAligned(pool->buffers[i]);
+        }
+        pool->count = 0;
+        pool->bufferSize = size;
+    }
+    if (pool->count > 0) {
+        PBYTE buffer = pool->buffers[--pool->count];
+        UnlockMutex(&pool->lock);
+        return buffer;
+    }
+    UnlockMutex(&pool->lock);
+    return (PBYTE) AllocAligned(size);
+}
+
+// size is the one the buffer was acquired with. NULL is ignored
+void ReleaseBuffer(dext2_buffer_pool* pool, PBYTE buffer, DWORD size) {
+    if (buffer == NULL) {
+        return;
+    }
+    LockMutex(&pool->lock);
+    if (pool->bufferSize == size && pool->count < pool->limit) {
+        pool->buffers[pool->count++] = buffer;
+        buffer = NULL;
+    }
+    UnlockMutex(&pool->lock);
+    FreeAligned(buffer);
+}
+
+/***********************************************************
+* STATISTICS
+*
+* Counters of the work done on the hot paths and latency
+* histograms of the main API calls, kept per filesystem. Every
+* update is one relaxed atomic add, so threads never wait on
+* each other to count. Define DEXT2_NO_STATS to compile the
+* updates out. Hits and misses of the caches are counted by
+* the caches themselves, see Get*CacheStats
+************************************************************/
+
+typedef enum {
+    DEXT2_COUNTER_READ_CALLS,          // ReadBytes calls
+    DEXT2_COUNTER_READ_BYTES,          // Bytes asked of ReadBytes
+    DEXT2_COUNTER_DEVICE_READS,        // Single reads issued to the device
+    DEXT2_COUNTER_DEVICE_BATCHES,      // Batches issued to the device
+    DEXT2_COUNTER_DEVICE_BYTES,        // Bytes of both
+    DEXT2_COUNTER_INODE_LOOKUPS,       // GetInodeByNumber calls
+    DEXT2_COUNTER_INODE_TABLE_READS,   // Lookups that had to read the inode table
+    DEXT2_COUNTER_DIRECTORY_BLOCKS,    // Directory blocks scanned
+    DEXT2_COUNTER_READAHEAD_BLOCKS,    // Blocks read ahead into the block cache
+    DEXT2_COUNTER_COUNT
+} DEXT2_COUNTER;
+
+typedef enum {
+    DEXT2_LATENCY_RESOLVE_PATH,
+    DEXT2_LATENCY_GET_CHILDS,
+    DEXT2_LATENCY_READ_DATA,
+    DEXT2_LATENCY_LIST_DIRECTORY,
+    DEXT2_LATENCY_COUNT
+} DEXT2_LATENCY;
+
+// Bucket i counts calls that took [2^i, 2^(i+1)) nanoseconds, the last
+// one everything longer
+#define DEXT2_LATENCY_BUCKETS 40
+
+typedef struct {
+    ULONGLONG count;
+    ULONGLONG totalNs;
+    ULONGLONG maxNs;
+    ULONGLONG buckets[DEXT2_LATENCY_BUCKETS];
+} dext2_latency_histogram;
+
+typedef struct {
+    ULONGLONG counters[DEXT2_COUNTER_COUNT];
+    dext2_latency_histogram latency[DEXT2_LATENCY_COUNT];
+} dext2_stats;
+
+LPCSTR GetCounterName(DEXT2_COUNTER counter) {
+    static const LPCSTR names[DEXT2_COUNTER_COUNT] = {
+        "read_calls", "read_bytes", "device_reads", "device_batches", "device_bytes",
+        "inode_lookups", "inode_table_reads", "directory_blocks", "readahead_blocks"
+    };
+    return counter < DEXT2_COUNTER_COUNT ? names[counter] : "unknown";
+}
+
+LPCSTR GetLatencyName(DEXT2_LATENCY latency) {
+    static const LPCSTR names[DEXT2_LATENCY_COUNT] = { "ResolvePath", "GetChilds", "ReadDataFromInode", "ListDirectory" };
+    return latency < DEXT2_LATENCY_COUNT ? names[latency] : "unknown";
+}
+
+void AddCounter(dext2_stats* stats, DEXT2_COUNTER counter, ULONGLONG value) {
+#ifndef DEXT2_NO_STATS
+    AtomicAdd(&stats->counters[counter], value);
+#else
+    (void) stats;
+    (void) counter;
+    (void) value;
+#endif // DEXT2_NO_STATS
+}
+
+// Start time of a call for RecordLatency
+ULONGLONG StartLatency(void) {
+#ifndef DEXT2_NO_STATS
+    return GetMonotonicNanoseconds();
+#else
+    return 0;
+#endif // DEXT2_NO_STATS
+}
+
+void RecordLatency(dext2_stats* stats, DEXT2_LATENCY latency, ULONGLONG started) {
+#ifndef DEXT2_NO_STATS
+    ULONGLONG elapsed = GetMonotonicNanoseconds() - started;
+    dext2_latency_histogram* histogram = &stats->latency[latency];
+    DWORD bucket = 0;
+    while (bucket + 1 < DEXT2_LATENCY_BUCKETS && (elapsed >> (bucket + 1)) != 0) {
+        bucket++;
+    }
+    AtomicAdd(&histogram->buckets[bucket], 1);
+    AtomicAdd(&histogram->count, 1);
+    AtomicAdd(&histogram->totalNs, elapsed);
+    AtomicMax(&histogram->maxNs, elapsed);
+#else
+    (void) stats;
+    (void) latency;
+    (void) started;
+#endif // DEXT2_NO_STATS
+}
+
+// Copy taken while other threads keep counting. Each value is exact, the
+// set of them is not one instant
+void SnapshotStats(dext2_stats* stats, OUT dext2_stats* snapshot) {
+    PULONGLONG source = (PULONGLONG) stats;
+    PULONGLONG destination = (PULONGLONG) snapshot;
+    for (size_t i = 0; i < sizeof(dext2_stats) / sizeof(ULONGLONG); i++) {
+        destination[i] = AtomicLoad(&source[i]);
+    }
+}
+
+void ClearStats(dext2_stats* stats) {
+    PULONGLONG values = (PULONGLONG) stats;
+    for (size_t i = 0; i < sizeof(dext2_stats) / sizeof(ULONGLONG); i++) {
+        AtomicStore(&values[i], 0);
+    }
+}
+
+// Upper bound of the bucket holding the given percentile, 0 without calls
+ULONGLONG GetLatencyPercentile(const dext2_latency_histogram* histogram, DWORD percent) {
+    if (histogram->count == 0) {
+        return 0;
+    }
+    ULONGLONG rank = (histogram->count * percent + 99) / 100;
+    ULONGLONG seen = 0;
+    for (DWORD i = 0; i < DEXT2_LATENCY_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank && seen > 0) {
+            ULONGLONG bound = i + 1 < 64 ? (1ULL << (i + 1)) : ~0ULL;
+            return bound < histogram->maxNs ? bound : histogram->maxNs;
+        }
+    }
+    return histogram->maxNs;
+}
+
+/***********************************************************
+* TRACING
+*
+* Optional record of nested spans, one per public API call
+* and per read issued, with the thread, start, duration and
+* bytes moved. Spans land in a fixed array claimed with one
+* atomic add, and are written out as Chrome trace event JSON
+* (chrome://tracing, Perfetto) where spans of one thread nest
+* by time. While tracing is off a span costs one pointer test.
+* Define DEXT2_NO_TRACE to compile spans out entirely
+************************************************************/
+
+#define DEXT2_DEFAULT_TRACE_EVENTS ( 1 << 20 )
+
+typedef struct {
+    LPCSTR name;                   // Static string
+    DWORD threadId;
+    ULONGLONG startNs;
+    ULONGLONG durationNs;
+    ULONGLONG bytes;
+} dext2_trace_event;
+
+typedef struct {
+    dext2_trace_event* events;
+    ULONGLONG capacity;
+    ULONGLONG next;                // Slots claimed, keeps counting past capacity
+    ULONGLONG originNs;            // Start of the trace, timestamps are relative to it
+} dext2_trace;
+
+typedef struct {
+    dext2_trace* trace;            // NULL when the span is not recorded
+    LPCSTR name;
+    ULONGLONG startNs;
+} dext2_trace_span;
+
+dext2_trace* CreateTrace(ULONGLONG capacity) {
+    dext2_trace* trace = (dext2_trace*) calloc(1, sizeof(dext2_trace));
+    if (trace == NULL) {
+        return NULL;
+    }
+    trace->events = (dext2_trace_event*) malloc((size_t) capacity * sizeof(dext2_trace_event));
+    if (trace->events == NULL) {
+        free(trace);
+        return NULL;
+    }
+    trace->capacity = capacity;
+    trace->originNs = GetMonotonicNanoseconds();
+    return trace;
+}
+
+void FreeTrace(dext2_trace* trace) {
+    if (trace == NULL) {
+        return;
+    }
+    free(trace->events);
+    free(trace);
+}
+
+dext2_trace_span BeginTraceSpan(dext2_trace* trace, LPCSTR name) {
+    dext2_trace_span span = { NULL, NULL, 0 };
+#ifndef DEXT2_NO_TRACE
+    if (trace != NULL) {
+        span.trace = trace;
+        span.name = name;
+        span.startNs = GetMonotonicNanoseconds();
+    }
+#else
+    (void) trace;
+    (void) name;
+#endif // DEXT2_NO_TRACE
+    return span;
+}
+
+void EndTraceSpan(const dext2_trace_span* span, ULONGLONG bytes) {
+#ifndef DEXT2_NO_TRACE
+    if (span->trace == NULL) {
+        return;
+    }
+    ULONGLONG endNs = GetMonotonicNanoseconds();
+    ULONGLONG slot = AtomicAdd(&span->trace->next, 1) - 1;
+    if (slot >= span->trace->capacity) {
+        return;
+    }
+    dext2_trace_event* event = &span->trace->events[slot];
+    event->name = span->name;
+    event->threadId = GetCurrentThreadId();
+    event->startNs = span->startNs;
+    event->durationNs = endNs - span->startNs;
+    event->bytes = bytes;
+#else
+    (void) span;
+    (void) bytes;
+#endif // DEXT2_NO_TRACE
+}
+
+ULONGLONG GetTraceDroppedEvents(dext2_trace* trace) {
+    ULONGLONG claimed = AtomicLoad(&trace->next);
+    return claimed > trace->capacity ? claimed - trace->capacity : 0;
+}
+
+// Complete ("X") events in microseconds. Spans still open are not in it,
+// so write only when no call on the filesystem is in flight
+BOOL WriteTraceJson(dext2_trace* trace, LPCSTR path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        return FALSE;
+    }
+    ULONGLONG count = AtomicLoad(&trace->next);
+    if (count > trace->capacity) {
+        count = trace->capacity;
+    }
+    DWORD processId = GetCurrentProcessId();
+    fprintf(file, "{\"traceEvents\":[\n");
+    for (ULONGLONG i = 0; i < count; i++) {
+        dext2_trace_event* event = &trace->events[i];
+        ULONGLONG start = event->startNs > trace->originNs ? event->startNs - trace->originNs : 0;
+        fprintf(file, "{\"name\":\"%s\",\"cat\":\"dext2\",\"ph\":\"X\",\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,"
+                      "\"pid\":%lu,\"tid\":%lu,\"args\":{\"bytes\":%llu}},\n",
+                event->name, (unsigned long long) (start / 1000), (unsigned long long) (start % 1000),
+                (unsigned long long) (event->durationNs / 1000), (unsigned long long) (event->durationNs % 1000),
+                (unsigned long) processId, (unsigned long) event->threadId, (unsigned long long) event->bytes);
+    }
+    // Process name metadata closes the array without a dangling comma
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%lu,\"args\":{\"name\":\"dext2\"}}\n],\n",
+            (unsigned long) processId);
+    fprintf(file, "\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped_events\":%llu}}\n",
+            (unsigned long long) GetTraceDroppedEvents(trace));
+    BOOL success = ferror(file) == 0;
+    return fclose(file) == 0 && success;
+}
+
+/***********************************************************
+* FILESYSTEM CONTEXT
+*
+* Everything that belongs to one mounted partition: the device,
+* the superblock, the group descriptor table and all caches.
+* Every API takes it explicitly, so any number of images can be
+* open in one process. After InitSuperblock succeeds, reads may
+* be issued from several threads at once. Mounting and the
+* Set* functions must not run concurrently with anything else
+* on the same context
+************************************************************/
+
+typedef struct dext2_dentry_cache dext2_dentry_cache;
+typedef struct dext2_path_cache dext2_path_cache;
+typedef struct dext2_run_cache dext2_run_cache;
+typedef struct dext2_readahead dext2_readahead;
+
+typedef struct {
+    dext2_device* device;              // Owned, closed by FreeFilesystem
+    LONGLONG partitionStart;           // Byte offset of the partition on the device
+    ext2_super_block superBlock;
+    ext2_group_desc* groupDescriptors; // Loaded once by InitSuperblock
+    DWORD groupCount;
+    DWORD inodeSize;                   // Bytes per inode table slot
+    DWORD descriptorSize;              // Bytes per group descriptor on disk
+    DWORD maxIoSize;
+    DWORD pipelineDepth;               // Buffers in flight when copying a file out
+    dext2_cache* blockCache;
+    ULONGLONG blockCacheSize;
+    dext2_cache* inodeCache;
+    ULONGLONG inodeCacheSize;
+    dext2_dentry_cache* dentryCache;
+    dext2_path_cache* pathCache;
+    dext2_run_cache* runCache;
+    dext2_readahead* readAhead;
+    DWORD readAheadSize;               // Largest read-ahead window in bytes, 0 for none
+    dext2_buffer_pool blockPool;       // Block sized scratch buffers
+    dext2_buffer_pool chunkPool;       // Maximum I/O sized buffers for copying files out
+    dext2_stats stats;
+    dext2_trace* trace;                // NULL unless tracing
+} dext2_fs;
+
+#define llBlockSize(hExt2) ( (LONGLONG) (1024 << (hExt2)->superBlock.s_log_block_size) )
+#define dwBlockSize(hExt2) ( (DWORD) (1024 << (hExt2)->superBlock.s_log_block_size) )
+
+// Idle buffers kept per filesystem. Block buffers are held by every
+// lookup and block map walk in flight, chunk buffers by file copies
+#define DEXT2_BLOCK_POOL_LIMIT 256
+#define DEXT2_CHUNK_POOL_LIMIT 8
+
+PBYTE AcquireBlockBuffer(dext2_fs* hExt2) {
+    return AcquireBuffer(&hExt2->blockPool, dwBlockSize(hExt2));
+}
+
+void ReleaseBlockBuffer(dext2_fs* hExt2, PBYTE buffer) {
+    ReleaseBuffer(&hExt2->blockPool, buffer, dwBlockSize(hExt2));
+}
+
+BOOL GetDataBlocks(dext2_fs* hExt2, ext2_inode* pInode, OUT PDWORD* dataBlocks, OUT PULONGLONG dataBlocksSize);
+BOOL GetInodeByNumber(dext2_fs* hExt2, DWORD inodeNumber, OUT ext2_inode* lpInode);
+
+ext2_group_desc* GetGroupDescriptor(dext2_fs* hExt2, DWORD groupNumber) {
+    if (groupNumber >= hExt2->groupCount) {
+        return NULL;
+    }
+    return &hExt2->groupDescriptors[groupNumber];
+}
+
+// flag is DEXT2_BG_INODE_UNINIT or DEXT2_BG_BLOCK_UNINIT. The flags are
+// only trusted on filesystems with checksummed group descriptors
+BOOL IsGroupUninitialized(dext2_fs* hExt2, const ext2_group_desc* descriptor, WORD flag) {
+    return (hExt2->superBlock.s_feature_ro_compat & (DEXT2_FEATURE_RO_COMPAT_GDT_CSUM | DEXT2_FEATURE_RO_COMPAT_METADATA_CSUM)) != 0
+        && hExt2->superBlock.s_rev_level >= 1
+        && (descriptor->bg_flags & flag) != 0;
+}
+
+// Block cache
+//
+// Sits underneath ReadBytes and holds whole filesystem blocks keyed by
+// their block number inside the mounted partition. It is rebuilt by
+// InitSuperblock, because the block size and partition may change
+#define DEXT2_DEFAULT_BLOCK_CACHE_SIZE ( 32*MiB )
+// Larger reads are file contents streamed once, caching them would only
+// push metadata out
+#define DEXT2_BLOCK_CACHE_MAX_READ_BLOCKS 4
+
+void StopReadAhead(dext2_readahead* readAhead);
+
+void ResetBlockCache(dext2_fs* hExt2) {
+    StopReadAhead(hExt2->readAhead);
+    FreeCache(hExt2->blockCache);
+    hExt2->blockCache = NULL;
+    if (hExt2->blockCacheSize != 0 && hExt2->superBlock.s_magic == DEXT2_SUPER_MAGIC) {
+        hExt2->blockCache = CreateCache(dwBlockSize(hExt2), hExt2->blockCacheSize);
+    }
+}
+
+// 0 disables the cache
+void SetBlockCacheSize(dext2_fs* hExt2, ULONGLONG byteBudget) {
+    hExt2->blockCacheSize = byteBudget;
+    ResetBlockCache(hExt2);
+}
+
+void GetBlockCacheStats(dext2_fs* hExt2, OUT dext2_cache_stats* stats) {
+    GetCacheStats(hExt2->blockCache, stats);
+}
+
+// Inode cache
+//
+// Decoded inodes keyed by inode number, filled a whole inode table
+// block at a time by GetInodeByNumber
+#define DEXT2_DEFAULT_INODE_CACHE_SIZE ( 4*MiB )
+
+void ResetInodeCache(dext2_fs* hExt2) {
+    FreeCache(hExt2->inodeCache);
+    hExt2->inodeCache = NULL;
+    if (hExt2->inodeCacheSize != 0 && hExt2->superBlock.s_magic == DEXT2_SUPER_MAGIC) {
+        hExt2->inodeCache = CreateCache(sizeof(ext2_inode), hExt2->inodeCacheSize);
+    }
+}
+
+// 0 disables the cache
+void SetInodeCacheSize(dext2_fs* hExt2, ULONGLONG byteBudget) {
+    hExt2->inodeCacheSize = byteBudget;
+    ResetInodeCache(hExt2);
+}
+
+void GetInodeCacheStats(dext2_fs* hExt2, OUT dext2_cache_stats* stats) {
+    GetCacheStats(hExt2->inodeCache, stats);
+}
+
+// Upper bound for a single read of file contents, contiguous blocks are
+// coalesced into requests of up to this size
+#define DEXT2_DEFAULT_MAX_IO_SIZE ( 4*MiB )
+
+void SetMaxIoSize(dext2_fs* hExt2, DWORD maxIoSize) {
+    hExt2->maxIoSize = maxIoSize;
+}
+
+// Number of maximum I/O sized buffers that ReadDataFromInode keeps in
+// flight between reading the image and writing the output. 0 or 1 copies
+// without a writer thread
+#define DEXT2_DEFAULT_PIPELINE_DEPTH 4
+
+void SetPipelineDepth(dext2_fs* hExt2, DWORD depth) {
+    hExt2->pipelineDepth = depth;
+}
+
+// Rounded down to whole blocks and capped by the maximum I/O size when
+// used. 0 disables read-ahead
+void SetReadAheadSize(dext2_fs* hExt2, DWORD byteBudget) {
+    StopReadAhead(hExt2->readAhead);
+    hExt2->readAheadSize = byteBudget;
+}
+
+void GetFilesystemStats(dext2_fs* hExt2, OUT dext2_stats* stats) {
+    SnapshotStats(&hExt2->stats, stats);
+}
+
+// Zeroes the counters and histograms, the caches keep their own
+void ResetFilesystemStats(dext2_fs* hExt2) {
+    ClearStats(&hExt2->stats);
+}
+
+// Starts recording spans into room for capacity events, 0 for the
+// default. A trace already running is discarded. Like the Set*
+// functions, neither this nor StopTracing may overlap other calls
+BOOL StartTracing(dext2_fs* hExt2, ULONGLONG capacity) {
+    // The read-ahead thread records spans of its own
+    StopReadAhead(hExt2->readAhead);
+    FreeTrace(hExt2->trace);
+    hExt2->trace = CreateTrace(capacity != 0 ? capacity : DEXT2_DEFAULT_TRACE_EVENTS);
+    return hExt2->trace != NULL;
+}
+
+// Stops tracing and writes what was recorded to path, unless it is NULL
+BOOL StopTracing(dext2_fs* hExt2, LPCSTR path) {
+    StopReadAhead(hExt2->readAhead);
+    dext2_trace* trace = hExt2->trace;
+    hExt2->trace = NULL;
+    if (trace == NULL) {
+        return FALSE;
+    }
+    BOOL success = path == NULL || WriteTraceJson(trace, path);
+    FreeTrace(trace);
+    return success;
+}
+
+// Bypasses the block cache, for data that is read once
+BOOL ReadBytesDirect(dext2_fs* hExt2, LONGLONG fromWhereToRead, DWORD nBytesToRead, OUT LPVOID destination) {
+    dext2_trace_span span = BeginTraceSpan(hExt2->trace, "DeviceRead");
+    AddCounter(&hExt2->stats, DEXT2_COUNTER_DEVICE_READS, 1);
+    AddCounter(&hExt2->stats, DEXT2_COUNTER_DEVICE_BYTES, nBytesToRead);
+    BOOL success = hExt2->device->read(hExt2->device, fromWhereToRead, nBytesToRead, destination);
+    EndTraceSpan(&span, nBytesToRead);
+    return success;
+}
+
+BOOL ReadBatchDirect(dext2_fs* hExt2, dext2_io_request* requests, DWORD count) {
+    ULONGLONG bytes = 0;
+    for (DWORD i = 0; i < count; i++) {
+        bytes += requests[i].length;
+    }
+    dext2_trace_span span = BeginTraceSpan(hExt2->trace, "DeviceReadBatch");
+    AddCounter(&hExt2->stats, DEXT2_COUNTER_DEVICE_BATCHES, 1);
+    AddCounter(&hExt2->stats, DEXT2_COUNTER_DEVICE_BYTES, bytes);
+    BOOL success = ReadDeviceBatch(hExt2->device, requests, count);
+    EndTraceSpan(&span, bytes);
+    return success;
+}
+
+// Points sources[i] at the bytes of request i, straight into the mapping
+// when every request lies inside it, otherwise the whole batch is read
+// into the request buffers
+BOOL MapOrReadBatch(dext2_fs* hExt2, dext2_io_request* requests, DWORD count, OUT const BYTE** sources) {
+    BOOL mapped = TRUE;
+    for (DWORD i = 0; i < count && mapped; i++) {
+        sources[i] = GetMappedBytes(hExt2->device, requests[i].offset, requests[i].length);
+        mapped = sources[i] != NULL;
+    }
+    if (mapped) {
+        return TRUE;
+    }
+    for (DWORD i = 0; i < count; i++) {
+        sources[i] = (const BYTE*) requests[i].buffer;
+    }
+    return ReadBatchDirect(hExt2, requests, count);
+}
+
+/***********************************************************
+* READ-AHEAD
+*
+* Directory walks, block map walks and inode table lookups
+* touch blocks in ascending order, one block per call. Every
+* block read through the block cache is noted in a small
+* table of streams; a block following the last one of a
+* stream continues it, anything else starts a new stream in
+* the least recently used slot. Once a stream is confirmed,
+* the blocks ahead of it are queued for a background thread
+* that reads them in one request into the block cache. The
+* next window is queued when the reader is half way through
+* the current one, and each window is twice the previous,
+* up to the read-ahead size, so a long scan stays ahead of
+* the device while short ones cost at most a few blocks
+************************************************************/
+
+#define DEXT2_READAHEAD_STREAMS 16
+#define DEXT2_READAHEAD_QUEUE 32
+#define DEXT2_READAHEAD_MIN_BLOCKS 4
+// Largest window, 0 disables read-ahead
+#define DEXT2_DEFAULT_READAHEAD_SIZE ( 512*KiB )
+
+typedef struct {
+    ULONGLONG nextBlock;           // Block that continues the stream
+    ULONGLONG aheadBlock;          // First block not queued yet
+    DWORD window;                  // Blocks in the last window queued, 0 for none yet
+    ULONGLONG lastUse;
+} dext2_readahead_stream;
+
+typedef struct {
+    ULONGLONG firstBlock;
+    DWORD blockCount;
+} dext2_readahead_request;
+
+struct dext2_readahead {
+    dext2_fs* hExt2;
+    dext2_readahead_stream streams[DEXT2_READAHEAD_STREAMS];
+    ULONGLONG clock;
+    dext2_readahead_request queue[DEXT2_READAHEAD_QUEUE];
+    DWORD head;
+    DWORD queued;
+    dext2_readahead_request busy;  // Being read, blockCount 0 if none
+    BOOL started;
+    BOOL stopping;
+    dext2_thread thread;
+    dext2_mutex lock;
+    dext2_cond wake;               // Work queued or stopping
+    dext2_cond done;               // busy finished, or stopping
+};
+
+dext2_readahead* CreateReadAhead(dext2_fs* hExt2) {
+    dext2_readahead* readAhead = (dext2_readahead*) calloc(1, sizeof(dext2_readahead));
+    if (readAhead == NULL) {
+        return NULL;
+    }
+    readAhead->hExt2 = hExt2;
+    InitMutex(&readAhead->lock);
+    InitCondition(&readAhead->wake);
+    InitCondition(&readAhead->done);
+    return readAhead;
+}
+
+// Stops the thread and forgets every stream and queued window. Must run
+// before the block cache goes away, the thread fills it
+void StopReadAhead(dext2_readahead* readAhead) {
+    if (readAhead == NULL) {
+        return;
+    }
+    LockMutex(&readAhead->lock);
+    BOOL started = readAhead->started;
+    readAhead->stopping = TRUE;
+    BroadcastCondition(&readAhead->wake);
+    BroadcastCondition(&readAhead->done);
+    UnlockMutex(&readAhead->lock);
+    if (started) {
+        JoinThread(readAhead->thread);
+    }
+    memset(readAhead->streams, 0, sizeof(readAhead->streams));
+    readAhead->head = 0;
+    readAhead->queued = 0;
+    readAhead->busy.blockCount = 0;
+    readAhead->started = FALSE;
+    readAhead->stopping = FALSE;
+}
+
+void FreeReadAhead(dext2_readahead* readAhead) {
+    if (readAhead == NULL) {
+        return;
+    }
+    StopReadAhead(readAhead);
+    DestroyCondition(&readAhead->done);
+    DestroyCondition(&readAhead->wake);
+    DestroyMutex(&readAhead->lock);
+    free(readAhead);
+}
+
+// Blocks of the window already cached at either end are left out, the
+// rest is read in one go even if some blocks in between are cached
+void PrefetchBlocks(dext2_fs* hExt2, dext2_readahead_request request, PBYTE buffer) {
+    ULONGLONG first = request.firstBlock;
+    ULONGLONG end = request.firstBlock + request.blockCount;
+    while (first < end && CacheContains(hExt2->blockCache, first)) {
+        first++;
+    }
+    while (end > first && CacheContains(hExt2->blockCache, end - 1)) {
+        end--;
+    }
+    if (first == end) {
+        return;
+    }
+    dext2_trace_span span = BeginTraceSpan(hExt2->trace, "ReadAhead");
+    DWORD length = (DWORD) (end - first) * dwBlockSize(hExt2);
+    if (ReadBytesDirect(hExt2, hExt2->partitionStart + (LONGLONG) first * llBlockSize(hExt2), length, buffer)) {
+        for (ULONGLONG block = first; block < end; block++) {
+            CacheInsert(hExt2->blockCache, block, buffer + (size_t) (block - first) * dwBlockSize(hExt2));
+        }
+        AddCounter(&hExt2->stats, DEXT2_COUNTER_READAHEAD_BLOCKS, end - first);
+    }
+    // A failed window is dropped, the reader will hit the error itself
+    EndTraceSpan(&span, length);
+}
+
+DEXT2_THREAD_PROC(ReadAheadWorker) {
+    dext2_readahead* readAhead = (dext2_readahead*) parameter;
+    dext2_fs* hExt2 = readAhead->hExt2;
+    // Held for the life of the thread, its size differs from the pooled ones
+    PBYTE buffer = (PBYTE) AllocAligned(hExt2->readAheadSize);
+    LockMutex(&readAhead->lock);
+    if (buffer == NULL) {
+        // Nothing queued would ever be read, refuse more until the next stop
+        readAhead->stopping = TRUE;
+        BroadcastCondition(&readAhead->done);
+    }
+    while (buffer != NULL) {
+        while (readAhead->queued == 0 && !readAhead->stopping) {
+            WaitCondition(&readAhead->wake, &readAhead->lock);
+        }
+        if (readAhead->stopping) {
+            break;
+        }
+        readAhead->busy = readAhead->queue[readAhead->head];
+        readAhead->head = (readAhead->head + 1) % DEXT2_READAHEAD_QUEUE;
+        readAhead->queued--;
+        UnlockMutex(&readAhead->lock);
+        PrefetchBlocks(hExt2, readAhead->busy, buffer);
+        LockMutex(&readAhead->lock);
+        readAhead->busy.blockCount = 0;
+        BroadcastCondition(&readAhead->done);
+    }
+    UnlockMutex(&readAhead->lock);
+    FreeAligned(buffer);
+    return 0;
+}
+
+// Called with the lock held. The thread is started on first use, a full
+// queue or a thread that fails to start just means no read-ahead
+BOOL QueueReadAhead(dext2_readahead* readAhead, ULONGLONG firstBlock, DWORD blockCount) {
+    if (readAhead->stopping || readAhead->queued == DEXT2_READAHEAD_QUEUE) {
+        return FALSE;
+    }
+    if (!readAhead->started) {
+        if (!StartThread(&readAhead->thread, ReadAheadWorker, readAhead)) {
+            return FALSE;
+        }
+        readAhead->started = TRUE;
+    }
+    dext2_readahead_request* request = &readAhead->queue[(readAhead->head + readAhead->queued) % DEXT2_READAHEAD_QUEUE];
+    request->firstBlock = firstBlock;
+    request->blockCount = blockCount;
+    readAhead->queued++;
+    SignalCondition(&readAhead->wake);
+    return TRUE;
+}
+
+// Notes a read of blockNumber and queues the window ahead of its stream
+// when that stream is far enough into the previous one
+void NoteBlockAccess(dext2_fs* hExt2, ULONGLONG blockNumber) {
+    dext2_readahead* readAhead = hExt2->readAhead;
+    DWORD maxWindow = (hExt2->readAheadSize < hExt2->maxIoSize ? hExt2->readAheadSize : hExt2->maxIoSize) / dwBlockSize(hExt2);
+    if (readAhead == NULL || maxWindow == 0) {
+        return;
+    }
+    LockMutex(&readAhead->lock);
+    readAhead->clock++;
+    dext2_readahead_stream* stream = NULL;
+    dext2_readahead_stream* oldest = &readAhead->streams[0];
+    for (DWORD i = 0; i < DEXT2_READAHEAD_STREAMS; i++) {
+        dext2_readahead_stream* candidate = &readAhead->streams[i];
+        if (candidate->lastUse != 0 && candidate->nextBlock == blockNumber + 1) {
+            // The same block again, as when several entries of one block are looked up
+            candidate->lastUse = readAhead->clock;
+            UnlockMutex(&readAhead->lock);
+            return;
+        }
+        if (candidate->lastUse != 0 && candidate->nextBlock == blockNumber) {
+            stream = candidate;
+            break;
+        }
+        if (candidate->lastUse < oldest->lastUse) {
+            oldest = candidate;
+        }
+    }
+    if (stream == NULL) {
+        oldest->nextBlock = blockNumber + 1;
+        oldest->aheadBlock = blockNumber + 1;
+        oldest->window = 0;
+        oldest->lastUse = readAhead->clock;
+        UnlockMutex(&readAhead->lock);
+        return;
+    }
+
+    stream->nextBlock = blockNumber + 1;
+    stream->lastUse = readAhead->clock;
+    if (stream->aheadBlock < stream->nextBlock) {
+        // The reader overtook the queued windows
+        stream->aheadBlock = stream->nextBlock;
+    }
+    ULONGLONG blocksCount = hExt2->superBlock.s_blocks_count;
+    if ((stream->window == 0 || stream->aheadBlock - stream->nextBlock <= stream->window / 2) && stream->aheadBlock < blocksCount) {
+        DWORD count = stream->window == 0 ? DEXT2_READAHEAD_MIN_BLOCKS : stream->window * 2;
+        if (count > maxWindow) {
+            count = maxWindow;
+        }
+        if (count > blocksCount - stream->aheadBlock) {
+            count = (DWORD) (blocksCount - stream->aheadBlock);
+        }
+        if (QueueReadAhead(readAhead, stream->aheadBlock, count)) {
+            stream->aheadBlock += count;
+            stream->window = count;
+        }
+    }
+    UnlockMutex(&readAhead->lock);
+}
+
+BOOL IsReadAheadPending(dext2_readahead* readAhead, ULONGLONG blockNumber) {
+    if (readAhead->busy.blockCount != 0
+        && blockNumber >= readAhead->busy.firstBlock && blockNumber < readAhead->busy.firstBlock + readAhead->busy.blockCount) {
+        return TRUE;
+    }
+    for (DWORD i = 0; i < readAhead->queued; i++) {
+        dext2_readahead_request* request = &readAhead->queue[(readAhead->head + i) % DEXT2_READAHEAD_QUEUE];
+        if (blockNumber >= request->firstBlock && blockNumber < request->firstBlock + request->blockCount) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// A block queued or being read ahead is waited for rather than read a
+// second time on its own. TRUE if there was something to wait for
+BOOL WaitForReadAhead(dext2_fs* hExt2, ULONGLONG blockNumber) {
+    dext2_readahead* readAhead = hExt2->readAhead;
+    if (readAhead == NULL) {
+        return FALSE;
+    }
+    BOOL waited = FALSE;
+    LockMutex(&readAhead->lock);
+    while (!readAhead->stopping && IsReadAheadPending(readAhead, blockNumber)) {
+        WaitCondition(&readAhead->done, &readAhead->lock);
+        waited = TRUE;
+    }
+    UnlockMutex(&readAhead->lock);
+    return waited;
+}
+
+// Reads one block of the partition through the block cache, feeding
+// read-ahead. With keep FALSE a block that had to be read stays out of
+// the cache, for callers that cache it in another form
+BOOL ReadBlockAhead(dext2_fs* hExt2, ULONGLONG blockNumber, OUT PBYTE block, BOOL keep) {
+    if (hExt2->blockCache == NULL) {
+        return ReadBytesDirect(hExt2, hExt2->partitionStart + (LONGLONG) blockNumber * llBlockSize(hExt2), dwBlockSize(hExt2), block);
+    }
+    NoteBlockAccess(hExt2, blockNumber);
+    if (CacheLookup(hExt2->blockCache, blockNumber, block)) {
+        return TRUE;
+    }
+    if (WaitForReadAhead(hExt2, blockNumber) && CacheLookup(hExt2->blockCache, blockNumber, block)) {
+        return TRUE;
+    }
+    if (!ReadBytesDirect(hExt2, hExt2->partitionStart + (LONGLONG) blockNumber * llBlockSize(hExt2), dwBlockSize(hExt2), block)) {
+        return FALSE;
+    }
+    if (keep) {
+        CacheInsert(hExt2->blockCache, blockNumber, block);
+    }
+    return TRUE;
+}
+
+BOOL ReadBytes(dext2_fs* hExt2, LONGLONG fromWhereToRead, DWORD nBytesToRead, OUT LPVOID destination) {
+    AddCounter(&hExt2->stats, DEXT2_COUNTER_READ_CALLS, 1);
+    AddCounter(&hExt2->stats, DEXT2_COUNTER_READ_BYTES, nBytesToRead);
+    dext2_trace_span span = BeginTraceSpan(hExt2->trace, "ReadBytes");
+    if (hExt2->blockCache == NULL
+        || hExt2->device->mappedBase != NULL
+        || fromWhereToRead < hExt2->partitionStart
+        || nBytesToRead > DEXT2_BLOCK_CACHE_MAX_READ_BLOCKS * dwBlockSize(hExt2)
+    ) {
+        BOOL success = ReadBytesDirect(hExt2, fromWhereToRead, nBytesToRead, destination);
+        EndTraceSpan(&span, nBytesToRead);
+        return success;
+    }
+
+    LONGLONG relativeOffset = fromWhereToRead - hExt2->partitionStart;
+    ULONGLONG firstBlock = (ULONGLONG) relativeOffset / dwBlockSize(hExt2);
+    ULONGLONG lastBlock = (ULONGLONG) (relativeOffset + nBytesToRead - 1) / dwBlockSize(hExt2);
+    PBYTE block = AcquireBlockBuffer(hExt2);
+    BOOL success = block != NULL;
+
+    PBYTE output = (PBYTE) destination;
+    for (ULONGLONG blockNumber = firstBlock; success && blockNumber <= lastBlock; blockNumber++) {
+        if (!ReadBlockAhead(hExt2, blockNumber, block, TRUE)) {
+            success = FALSE;
+            break;
+        }
+        LONGLONG blockStart = (LONGLONG) blockNumber * llBlockSize(hExt2);
+        LONGLONG copyFrom = relativeOffset > blockStart ? relativeOffset : blockStart;
+        LONGLONG copyTo = relativeOffset + nBytesToRead < blockStart + llBlockSize(hExt2) ?
+            relativeOffset + nBytesToRead :
+            blockStart + llBlockSize(hExt2);
+        memcpy(output + (copyFrom - relativeOffset), block + (copyFrom - blockStart), (size_t) (copyTo - copyFrom));
+    }
+    ReleaseBlockBuffer(hExt2, block);
+    EndTraceSpan(&span, nBytesToRead);
+    return success;
+}
+
+/***********************************************************
+* BLOCK MAP ITERATOR
+*
+* Walks the block map of an inode lazily and yields runs of
+* blocks that are consecutive on disk. The map is either the
+* direct, indirect, doubly and trebly indirect pointers of
+* ext2 or, for ext4 inodes with DEXT2_EXTENTS_FL, an extent
+* tree whose leaves describe whole runs at once. Only one
+* map block per level is held at a time, so memory use does
+* not depend on the file size. Zero pointers and ranges no
+* extent covers are holes: they are yielded as runs with
+* physicalBlock 0 and the subtree below them is never read
+************************************************************/
+
+#define DEXT2_DIRECT_BLOCKS 12
+#define DEXT2_INDIRECT_LEVELS 3
+
+// ext4 extent tree, all of it little-endian on disk
+#define DEXT2_EXTENT_MAGIC 0xF30A
+#define DEXT2_EXTENT_MAX_DEPTH 5
+// Longer ee_len values mark preallocated, unwritten extents that read as zeros
+#define DEXT2_EXTENT_MAX_INIT_LENGTH 32768
+
+typedef struct {
+    WORD eh_magic;                 // DEXT2_EXTENT_MAGIC
+    WORD eh_entries;               // Valid entries following the header
+    WORD eh_max;                   // Capacity of the node
+    WORD eh_depth;                 // 0 for a leaf
+    DWORD eh_generation;
+} ext4_extent_header;
+
+typedef struct {
+    DWORD ei_block;                // First file block covered by the subtree
+    DWORD ei_leaf_lo;              // Block of the next level node
+    WORD ei_leaf_hi;
+    WORD ei_unused;
+} ext4_extent_idx;
+
+typedef struct {
+    DWORD ee_block;                // First file block of the extent
+    WORD ee_len;
+    WORD ee_start_hi;
+    DWORD ee_start_lo;             // First block on disk
+} ext4_extent;
+
+// Map blocks held per level: indirect blocks, or extent tree nodes below the root
+#define DEXT2_MAP_LEVELS DEXT2_EXTENT_MAX_DEPTH
+
+typedef struct {
+    ULONGLONG logicalBlock;        // First block of the run inside the file
+    DWORD physicalBlock;           // First block of the run on disk, 0 for a hole
+    DWORD length;                  // Run length in blocks, 0 once the file is exhausted
+} dext2_block_run;
+
+typedef struct {
+    dext2_fs* hExt2;
+    DWORD i_block[DEXT2_N_BLOCKS];
+    BOOL extents;                  // i_block is the root of an extent tree
+    ULONGLONG blockCount;          // Blocks covered by the file size
+    ULONGLONG nextLogicalBlock;
+    DWORD maxRunLength;
+    DWORD addressesPerBlock;
+    PBYTE buffer[DEXT2_MAP_LEVELS];        // Read buffer per level, taken on first use, unused when mapped
+    const BYTE* node[DEXT2_MAP_LEVELS];    // Loaded map block per level
+    DWORD nodeNumber[DEXT2_MAP_LEVELS];    // Its block number, 0 if none
+    BOOL prefetch;                 // Batch read the indirect blocks below a freshly loaded table
+} dext2_block_map_iterator;
+
+// Sizes above 4 GiB keep their high half in i_dir_acl
+ULONGLONG GetInodeFileSize(const ext2_inode* pInode) {
+    if ((pInode->i_mode & DEXT2_INODE_FORMAT_MASK) == DEXT2_INODE_IS_FILE) {
+        return (ULONGLONG) pInode->i_size | ((ULONGLONG) pInode->i_dir_acl << 32);
+    }
+    return pInode->i_size;
+}
+
+BOOL HasExtentMap(dext2_fs* hExt2, const ext2_inode* pInode) {
+    return (pInode->i_flags & DEXT2_EXTENTS_FL) != 0
+        && hExt2->superBlock.s_rev_level >= 1
+        && (hExt2->superBlock.s_feature_incompat & DEXT2_FEATURE_INCOMPAT_EXTENTS) != 0;
+}
+
+BOOL InitBlockMapIterator(dext2_fs* hExt2, ext2_inode* pInode, OUT dext2_block_map_iterator* iterator) {
+    memset(iterator, 0, sizeof(dext2_block_map_iterator));
+    iterator->hExt2 = hExt2;
+    memcpy(iterator->i_block, pInode->i_block, sizeof(iterator->i_block));
+    iterator->extents = HasExtentMap(hExt2, pInode);
+    ULONGLONG fileSize = GetInodeFileSize(pInode);
+    iterator->blockCount = fileSize / dwBlockSize(hExt2) + ((fileSize % dwBlockSize(hExt2)) != 0);
+    iterator->maxRunLength = 0xFFFFFFFF;
+    iterator->addressesPerBlock = dwBlockSize(hExt2) / sizeof(DWORD);
+    return TRUE;
+}
+
+void FreeBlockMapIterator(dext2_block_map_iterator* iterator) {
+    for (DWORD level = 0; level < DEXT2_MAP_LEVELS; level++) {
+        ReleaseBlockBuffer(iterator->hExt2, iterator->buffer[level]);
+        iterator->buffer[level] = NULL;
+    }
+}
+
+// Makes blockNumber the map block held for level, reading it unless it is
+// already there. Blocks held for deeper levels are dropped on a change,
+// they belonged to the previous parent
+const BYTE* LoadMapBlock(dext2_block_map_iterator* iterator, DWORD level, DWORD blockNumber) {
+    if (iterator->nodeNumber[level] == blockNumber) {
+        return iterator->node[level];
+    }
+    dext2_fs* hExt2 = iterator->hExt2;
+    LONGLONG location = hExt2->partitionStart + (LONGLONG) blockNumber * llBlockSize(hExt2);
+    const BYTE* mapped = GetMappedBytes(hExt2->device, location, dwBlockSize(hExt2));
+    if (mapped != NULL) {
+        iterator->node[level] = mapped;
+    } else {
+        if (iterator->buffer[level] == NULL) {
+            iterator->buffer[level] = AcquireBlockBuffer(hExt2);
+        }
+        if (iterator->buffer[level] == NULL
+            || !ReadBytes(hExt2, location, dwBlockSize(hExt2), iterator->buffer[level])) {
+            iterator->nodeNumber[level] = 0;
+            return NULL;
+        }
+        iterator->node[level] = iterator->buffer[level];
+    }
+    iterator->nodeNumber[level] = blockNumber;
+    for (DWORD deeper = level + 1; deeper < DEXT2_MAP_LEVELS; deeper++) {
+        iterator->nodeNumber[deeper] = 0;
+    }
+    return iterator->node[level];
+}
+
+// Indirect blocks fetched by one batch
+#define DEXT2_PREFETCH_BATCH_BLOCKS 64
+
+// table lists indirect blocks (it sits two or more levels above the data).
+// The ones not cached yet are read as batches into the block cache, so the
+// walk below finds them there instead of reading one block per lookup.
+// Failures are ignored, the walk reads the block again and reports it
+void PrefetchIndirectBlocks(dext2_block_map_iterator* iterator, const DWORD* table) {
+    dext2_fs* hExt2 = iterator->hExt2;
+    if (hExt2->blockCache == NULL || hExt2->device->mappedBase != NULL) {
+        return;
+    }
+    dext2_io_request requests[DEXT2_PREFETCH_BATCH_BLOCKS];
+    DWORD blockNumbers[DEXT2_PREFETCH_BATCH_BLOCKS];
+    DWORD count = 0;
+    for (DWORD i = 0; i <= iterator->addressesPerBlock; i++) {
+        if (count == DEXT2_PREFETCH_BATCH_BLOCKS || (i == iterator->addressesPerBlock && count > 0)) {
+            ReadBatchDirect(hExt2, requests, count);
+            for (DWORD j = 0; j < count; j++) {
+                if (requests[j].success) {
+                    CacheInsert(hExt2->blockCache, blockNumbers[j], requests[j].buffer);
+                }
+                ReleaseBlockBuffer(hExt2, (PBYTE) requests[j].buffer);
+            }
+            count = 0;
+        }
+        if (i == iterator->addressesPerBlock) {
+            break;
+        }
+        DWORD pointer = table[i];
+        if (pointer == 0 || CacheContains(hExt2->blockCache, pointer)) {
+            continue;
+        }
+        requests[count].buffer = AcquireBlockBuffer(hExt2);
+        if (requests[count].buffer == NULL) {
+            continue;
+        }
+        blockNumbers[count] = pointer;
+        requests[count].offset = hExt2->partitionStart + (LONGLONG) pointer * llBlockSize(hExt2);
+        requests[count].length = dwBlockSize(hExt2);
+        count++;
+    }
+}
+
+// Indirect block map. Data blocks are looked up one by one, so *knownLength
+// is 1 for them; for a hole it covers the whole unmapped subtree
+BOOL IndirectMapLookup(dext2_block_map_iterator* iterator, ULONGLONG logicalBlock, OUT PDWORD physicalBlock, OUT PULONGLONG knownLength) {
+    ULONGLONG perBlock = iterator->addressesPerBlock;
+    *knownLength = 1;
+    if (logicalBlock < DEXT2_DIRECT_BLOCKS) {
+        *physicalBlock = iterator->i_block[logicalBlock];
+        return TRUE;
+    }
+
+    ULONGLONG offset = logicalBlock - DEXT2_DIRECT_BLOCKS;
+    ULONGLONG span = perBlock;     // Blocks addressed by the current pointer
+    DWORD depth = 1;
+    while (offset >= span) {
+        offset -= span;
+        span *= perBlock;
+        depth++;
+        if (depth > DEXT2_INDIRECT_LEVELS) {
+            DEXT2_LOG_DEBUG("Block %llu is out of the addressable range", (unsigned long long) logicalBlock);
+            return FALSE;
+        }
+    }
+
+    DWORD pointer = iterator->i_block[DEXT2_DIRECT_BLOCKS + depth - 1];
+    for (DWORD level = 0; level < depth; level++) {
+        if (pointer == 0) {
+            *physicalBlock = 0;
+            *knownLength = span - offset % span;
+            return TRUE;
+        }
+        BOOL loaded = iterator->nodeNumber[level] == pointer;
+        const DWORD* table = (const DWORD*) LoadMapBlock(iterator, level, pointer);
+        if (table == NULL) {
+            return FALSE;
+        }
+        if (!loaded && iterator->prefetch && depth - level >= 2) {
+            PrefetchIndirectBlocks(iterator, table);
+        }
+        span /= perBlock;
+        pointer = table[(offset / span) % perBlock];
+    }
+    *physicalBlock = pointer;
+    return TRUE;
+}
+
+// Extent tree. Each node is searched for the last entry starting at or
+// before logicalBlock; *knownLength runs to the end of the extent, or for
+// a hole up to the next extent or subtree
+BOOL ExtentMapLookup(dext2_block_map_iterator* iterator, ULONGLONG logicalBlock, OUT PDWORD physicalBlock, OUT PULONGLONG knownLength) {
+    dext2_fs* hExt2 = iterator->hExt2;
+    // Nothing is known past the end of the file or the subtree being searched
+    ULONGLONG boundary = iterator->blockCount - logicalBlock;
+    const BYTE* node = (const BYTE*) iterator->i_block;
+    DWORD nodeSize = sizeof(iterator->i_block);
+    DWORD expectedDepth = DEXT2_EXTENT_MAX_DEPTH;
+
+    for (DWORD level = 0; ; level++) {
+        const ext4_extent_header* header = (const ext4_extent_header*) node;
+        // Below the root every node is exactly one level shallower than its parent
+        if (header->eh_magic != DEXT2_EXTENT_MAGIC
+            || sizeof(ext4_extent_header) + (size_t) header->eh_entries * sizeof(ext4_extent) > nodeSize
+            || header->eh_depth > expectedDepth
+            || (level > 0 && header->eh_depth != expectedDepth)) {
+            DEXT2_LOG_DEBUG("Corrupted extent node at level %u", level);
+            return FALSE;
+        }
+        // Entries are sorted by their first block
+        DWORD count = header->eh_entries;
+        DWORD low = 0;
+        DWORD high = count;
+        while (low < high) {
+            DWORD middle = low + (high - low) / 2;
+            // Both entry kinds start with their first block
+            DWORD firstBlock = *(const DWORD*) (node + sizeof(ext4_extent_header) + (size_t) middle * sizeof(ext4_extent));
+            if (firstBlock <= logicalBlock) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        // low entries start at or before logicalBlock, the next one after it
+        if (low < count) {
+            DWORD nextStart = *(const DWORD*) (node + sizeof(ext4_extent_header) + (size_t) low * sizeof(ext4_extent));
+            if (nextStart - logicalBlock < boundary) {
+                boundary = nextStart - logicalBlock;
+            }
+        }
+
+        if (header->eh_depth == 0) {
+            const ext4_extent* extents = (const ext4_extent*) (header + 1);
+            *physicalBlock = 0;
+            *knownLength = boundary;
+            if (low == 0) {
+                return TRUE;
+            }
+            const ext4_extent* extent = &extents[low - 1];
+            BOOL unwritten = extent->ee_len > DEXT2_EXTENT_MAX_INIT_LENGTH;
+            DWORD length = unwritten ? extent->ee_len - DEXT2_EXTENT_MAX_INIT_LENGTH : extent->ee_len;
+            ULONGLONG offset = logicalBlock - extent->ee_block;
+            if (offset >= length) {
+                return TRUE;
+            }
+            if (length - offset < *knownLength) {
+                *knownLength = length - offset;
+            }
+            if (unwritten) {
+                return TRUE;
+            }
+            ULONGLONG start = ((ULONGLONG) extent->ee_start_hi << 32) | extent->ee_start_lo;
+            if (start == 0 || start + length > 0xFFFFFFFF) {
+                DEXT2_LOG_DEBUG("Extent at block %llu is out of the supported range", (unsigned long long) start);
+                return FALSE;
+            }
+            *physicalBlock = (DWORD) (start + offset);
+            return TRUE;
+        }
+
+        if (low == 0) {
+            // Before the first subtree
+            *physicalBlock = 0;
+            *knownLength = boundary;
+            return TRUE;
+        }
+        const ext4_extent_idx* index = (const ext4_extent_idx*) (header + 1) + (low - 1);
+        expectedDepth = header->eh_depth - 1;
+        if (index->ei_leaf_hi != 0 || index->ei_leaf_lo == 0 || level >= DEXT2_MAP_LEVELS) {
+            DEXT2_LOG_DEBUG("Extent index at level %u is out of the supported range", level);
+            return FALSE;
+        }
+        node = LoadMapBlock(iterator, level, index->ei_leaf_lo);
+        if (node == NULL) {
+            return FALSE;
+        }
+        nodeSize = dwBlockSize(hExt2);
+    }
+}
+
+// Translates one file block. *knownLength tells how many blocks starting
+// at logicalBlock are known to follow on disk, or to be unmapped for a hole
+BOOL BlockMapLookup(dext2_block_map_iterator* iterator, ULONGLONG logicalBlock, OUT PDWORD physicalBlock, OUT PULONGLONG knownLength) {
+    if (iterator->extents) {
+        return ExtentMapLookup(iterator, logicalBlock, physicalBlock, knownLength);
+    }
+    return IndirectMapLookup(iterator, logicalBlock, physicalBlock, knownLength);
+}
+
+// Returns FALSE on a read error. run->length is 0 once every block
+// covered by the file size has been yielded
+BOOL NextBlockRun(dext2_block_map_iterator* iterator, OUT dext2_block_run* run) {
+    ULONGLONG first = iterator->nextLogicalBlock;
+    run->logicalBlock = first;
+    run->physicalBlock = 0;
+    run->length = 0;
+    if (first >= iterator->blockCount) {
+        return TRUE;
+    }
+
+    ULONGLONG limit = iterator->blockCount - first;
+    if (limit > iterator->maxRunLength) {
+        limit = iterator->maxRunLength;
+    }
+
+    DWORD physicalBlock;
+    ULONGLONG length;
+    if (!BlockMapLookup(iterator, first, &physicalBlock, &length)) {
+        return FALSE;
+    }
+    while (length < limit) {
+        DWORD nextPhysicalBlock;
+        ULONGLONG nextLength;
+        if (!BlockMapLookup(iterator, first + length, &nextPhysicalBlock, &nextLength)) {
+            return FALSE;
+        }
+        if ((physicalBlock == 0 && nextPhysicalBlock == 0)
+            || (physicalBlock != 0 && (ULONGLONG) nextPhysicalBlock == physicalBlock + length)) {
+            length += nextLength;
+        } else {
+            break;
+        }
+    }
+    if (length > limit) {
+        length = limit;
+    }
+
+    run->physicalBlock = physicalBlock;
+    run->length = (DWORD) length;
+    iterator->nextLogicalBlock = first + length;
+    return TRUE;
+}
+
+BOOL _GetInodeByNumberInner(dext2_fs* hExt2, DWORD inodeNumber, OUT ext2_inode* lpInode) {
+    AddCounter(&hExt2->stats, DEXT2_COUNTER_INODE_LOOKUPS, 1);
+    if (hExt2->inodeCache != NULL && hExt2->device->mappedBase == NULL && CacheLookup(hExt2->inodeCache, inodeNumber, lpInode)) {
+        return TRUE;
+    }
+    AddCounter(&hExt2->stats, DEXT2_COUNTER_INODE_TABLE_READS, 1);
+    DWORD inodesPerGroup = hExt2->superBlock.s_inodes_per_group;
+    DWORD blockGroupNumber = (inodeNumber - 1) / inodesPerGroup;
+    ext2_group_desc* descriptor = GetGroupDescriptor(hExt2, blockGroupNumber);
+    if (inodeNumber == 0 || descriptor == NULL) {
+        DEXT2_LOG_DEBUG("GetInodeByNumber fail");
+        return FALSE;
+    }
+    LONGLONG inodeTableLocation = (LONGLONG) descriptor->bg_inode_table * llBlockSize(hExt2);
+    DWORD inodeIndex = (inodeNumber - 1) % inodesPerGroup;
+    // A mapped inode table is read in place, nothing to cache
+    const BYTE* mappedInode = GetMappedBytes(hExt2->device, hExt2->partitionStart + inodeTableLocation + hExt2->inodeSize*((LONGLONG) inodeIndex),
+                                             sizeof(ext2_inode));
+    if (mappedInode != NULL) {
+        memcpy(lpInode, mappedInode, sizeof(ext2_inode));
+        return TRUE;
+    }
+    if (hExt2->inodeCache == NULL) {
+        LONGLONG inodePhysicalLocation = inodeTableLocation + hExt2->inodeSize*((LONGLONG) inodeIndex);
+        if(!ReadBytes(hExt2, hExt2->partitionStart + inodePhysicalLocation, sizeof(ext2_inode), lpInode)) {
+            DEXT2_LOG_DEBUG("GetInodeByNumber fail");
+            return FALSE;
+        }
+        return TRUE;
+    }
+
+    // Decode the whole inode table block: entries of one directory
+    // usually sit in neighbouring slots and will be asked for next.
+    // The inode cache keeps them, so a raw block that had to be read stays
+    // out of the block cache. Table blocks read ahead are taken from it
+    DWORD inodesPerBlock = dwBlockSize(hExt2) / hExt2->inodeSize;
+    DWORD firstIndex = inodeIndex - inodeIndex % inodesPerBlock;
+    DWORD firstInodeNumber = blockGroupNumber * inodesPerGroup + firstIndex + 1;
+    LONGLONG blockLocation = inodeTableLocation + hExt2->inodeSize*((LONGLONG) firstIndex);
+    PBYTE block = AcquireBlockBuffer(hExt2);
+    if (block == NULL) {
+        return FALSE;
+    }
+    if (!ReadBlockAhead(hExt2, (ULONGLONG) blockLocation / dwBlockSize(hExt2), block, FALSE)) {
+        DEXT2_LOG_DEBUG("GetInodeByNumber fail");
+        ReleaseBlockBuffer(hExt2, block);
+        return FALSE;
+    }
+    for (DWORD i = 0; i < inodesPerBlock && firstIndex + i < inodesPerGroup; i++) {
+        ext2_inode decoded;
+        memcpy(&decoded, block + (size_t) i * hExt2->inodeSize, sizeof(ext2_inode));
+        CacheInsert(hExt2->inodeCache, firstInodeNumber + i, &decoded);
+    }
+    memcpy(lpInode, block + (size_t) (inodeIndex - firstIndex) * hExt2->inodeSize, sizeof(ext2_inode));
+    ReleaseBlockBuffer(hExt2, block);
+    return TRUE;
+}
+
+BOOL GetInodeByNumber(dext2_fs* hExt2, DWORD inodeNumber, OUT ext2_inode* lpInode) {
+    dext2_trace_span span = BeginTraceSpan(hExt2->trace, "GetInodeByNumber");
+    BOOL success = _GetInodeByNumberInner(hExt2, inodeNumber, lpInode);
+    EndTraceSpan(&span, 0);
+    return success;
+}
+
+// Metadata blocks are parsed in place: straight out of the mapping when
+// the device is mapped, otherwise out of buffer after reading into it
+const BYTE* GetMetadataBlock(dext2_fs* hExt2, DWORD blockNumber, PBYTE buffer) {
+    LONGLONG location = hExt2->partitionStart + (LONGLONG) blockNumber * llBlockSize(hExt2);
+    const BYTE* mapped = GetMappedBytes(hExt2->device, location, dwBlockSize(hExt2));
+    if (mapped != NULL) {
+        return mapped;
+    }
+    if (buffer == NULL || !ReadBytes(hExt2, location, dwBlockSize(hExt2), buffer)) {
+        return NULL;
+    }
+    return buffer;
+}
+
+// Only the header and name_len bytes of the name are valid
+BOOL IsValidDirEntry(const ext2_dir_entry* de, DWORD position, DWORD blockSize) {
+    return de->rec_len >= 8 && position + de->rec_len <= blockSize && de->name_len + 8 <= de->rec_len;
+}
+
+typedef BOOL (*DEXT2_DIR_ENTRY_CALLBACK)(const ext2_dir_entry* de, LPVOID context);
+
+// Calls callback for every used record of the directory in on-disk order,
+// until it returns FALSE. Records are handed out in place, only the header
+// and the first name_len bytes of the name are valid
+DEXT2_ERROR WalkDirectory(dext2_fs* hExt2, ext2_inode* pInode, DEXT2_DIR_ENTRY_CALLBACK callback, LPVOID context) {
+    if ((pInode->i_mode & DEXT2_INODE_IS_DIR) == 0) {
+        return DEXT2_ERROR_FILE_MISSING;
+    }
+    dext2_block_map_iterator iterator;
+    if (!InitBlockMapIterator(hExt2, pInode, &iterator)) {
+        return DEXT2_ERROR_INTERNAL;
+    }
+    PBYTE buffer = NULL;
+    if (hExt2->device->mappedBase == NULL) {
+        buffer = AcquireBlockBuffer(hExt2);
+        if (buffer == NULL) {
+            FreeBlockMapIterator(&iterator);
+            return DEXT2_ERROR_INTERNAL;
+        }
+    }
+
+    dext2_trace_span span = BeginTraceSpan(hExt2->trace, "WalkDirectory");
+    ULONGLONG blocksScanned = 0;
+    DEXT2_ERROR status = DEXT2_NO_ERROR;
+    BOOL stopped = FALSE;
+    dext2_block_run run;
+    while (!stopped) {
+        if (!NextBlockRun(&iterator, &run)) {
+            status = DEXT2_ERROR_READING_DISK;
+            break;
+        }
+        if (run.length == 0) {
+            break;
+        }
+        if (run.physicalBlock == 0) {
+            continue;
+        }
+        for (DWORD i = 0; i < run.length && !stopped; i++) {
+            const BYTE* block = GetMetadataBlock(hExt2, run.physicalBlock + i, buffer);
+            if (block == NULL) {
+                status = DEXT2_ERROR_READING_DISK;
+                stopped = TRUE;
+                break;
+            }
+            AddCounter(&hExt2->stats, DEXT2_COUNTER_DIRECTORY_BLOCKS, 1);
+            blocksScanned++;
+            DWORD position = 0;
+            while (position < dwBlockSize(hExt2)) {
+                const ext2_dir_entry* de = (const ext2_dir_entry*) (block + position);
+                if (!IsValidDirEntry(de, position, dwBlockSize(hExt2))) {
+                    status = DEXT2_ERROR_FILE_MISSING;
+                    stopped = TRUE;
+                    break;
+                }
+                position += de->rec_len;
+                // Unused record, e.g. left by a deleted file
+                if (de->inode == 0) {
+                    continue;
+                }
+                if (!callback(de, context)) {
+                    stopped = TRUE;
+                    break;
+                }
+            }
+        }
+    }
+
+    ReleaseBlockBuffer(hExt2, buffer);
+    FreeBlockMapIterator(&iterator);
+    EndTraceSpan(&span, blocksScanned * dwBlockSize(hExt2));
+    return status;
+}
+
+/***********************************************************
+* DENTRY CACHE
+*
+* The first lookup in a directory reads all of it and builds
+* a hash index of name -> inode number, keyed by the inode
+* number of the directory. Further lookups there are a hash
+* probe without any I/O. Indexes live until InitSuperblock
+* or until evicted to stay within the byte budget. A
+* directory whose index would not fit in the budget is
+* remembered and scanned instead, without building it again
+************************************************************/
+
+#define DEXT2_DEFAULT_DENTRY_CACHE_SIZE ( 16*MiB )
+#define DEXT2_DENTRY_CACHE_DIRECTORIES 64
+
+typedef struct {
+    DWORD inode;                   // 0 marks an empty slot
+    DWORD nameHash;
+    DWORD nameOffset;              // Into the names buffer of the index
+    DWORD nameLength;
+} dext2_dentry_slot;
+
+typedef struct {
+    DWORD directoryNumber;
+    ULONGLONG lastUse;
+    dext2_dentry_slot* slots;
+    DWORD slotMask;                // Slot count is a power of two
+    LPSTR names;
+    DWORD namesSize;
+    DWORD namesCapacity;
+    DWORD entryCount;
+    ULONGLONG byteSize;
+} dext2_dentry_index;
+
+struct dext2_dentry_cache {
+    dext2_dentry_index* indexes[DEXT2_DENTRY_CACHE_DIRECTORIES];
+    DWORD oversized[DEXT2_DENTRY_CACHE_DIRECTORIES];  // Ring of directory numbers, 0 is empty
+    DWORD nextOversized;
+    ULONGLONG byteBudget;
+    ULONGLONG used;
+    ULONGLONG clock;
+    ULONGLONG hits;
+    ULONGLONG misses;
+    dext2_mutex lock;
+};
+
+DWORD HashName(const CHAR* name, DWORD nameLength) {
+    DWORD hash = 2166136261u;
+    for (DWORD i = 0; i < nameLength; i++) {
+        hash = (hash ^ (BYTE) name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+void FreeDentryIndex(dext2_dentry_index* index) {
+    if (index == NULL) {
+        return;
+    }
+    free(index->slots);
+    free(index->names);
+    free(index);
+}
+
+void ResetDentryCache(dext2_dentry_cache* cache) {
+    LockMutex(&cache->lock);
+    for (DWORD i = 0; i < DEXT2_DENTRY_CACHE_DIRECTORIES; i++) {
+        FreeDentryIndex(cache->indexes[i]);
+        cache->indexes[i] = NULL;
+        cache->oversized[i] = 0;
+    }
+    cache->used = 0;
+    UnlockMutex(&cache->lock);
+}
+
+dext2_dentry_cache* CreateDentryCache(ULONGLONG byteBudget) {
+    dext2_dentry_cache* cache = (dext2_dentry_cache*) calloc(1, sizeof(dext2_dentry_cache));
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache->byteBudget = byteBudget;
+    InitMutex(&cache->lock);
+    return cache;
+}
+
+void FreeDentryCache(dext2_dentry_cache* cache) {
+    if (cache == NULL) {
+        return;
+    }
+    ResetDentryCache(cache);
+    DestroyMutex(&cache->lock);
+    free(cache);
+}
+
+// 0 disables the cache, lookups then scan the directory every time
+void SetDentryCacheSize(dext2_fs* hExt2, ULONGLONG byteBudget) {
+    hExt2->dentryCache->byteBudget = byteBudget;
+    ResetDentryCache(hExt2->dentryCache);
+}
+
+void GetDentryCacheStats(dext2_fs* hExt2, OUT dext2_cache_stats* stats) {
+    dext2_dentry_cache* cache = hExt2->dentryCache;
+    memset(stats, 0, sizeof(dext2_cache_stats));
+    LockMutex(&cache->lock);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    for (DWORD i = 0; i < DEXT2_DENTRY_CACHE_DIRECTORIES; i++) {
+        if (cache->indexes[i] != NULL) {
+            stats->entryCount += cache->indexes[i]->entryCount;
+        }
+    }
+    stats->capacity = cache->byteBudget;
+    UnlockMutex(&cache->lock);
+}
+
+// Returns FALSE when out of memory. Duplicate names keep the first record,
+// as a linear scan would
+BOOL DentryIndexInsert(dext2_dentry_index* index, DWORD inode, DWORD nameHash, DWORD nameOffset, DWORD nameLength) {
+    DWORD slot = nameHash & index->slotMask;
+    while (index->slots[slot].inode != 0) {
+        dext2_dentry_slot* existing = &index->slots[slot];
+        if (existing->nameHash == nameHash && existing->nameLength == nameLength
+            && memcmp(index->names + existing->nameOffset, index->names + nameOffset, nameLength) == 0) {
+            return TRUE;
+        }
+        slot = (slot + 1) & index->slotMask;
+    }
+    index->slots[slot].inode = inode;
+    index->slots[slot].nameHash = nameHash;
+    index->slots[slot].nameOffset = nameOffset;
+    index->slots[slot].nameLength = nameLength;
+    index->entryCount++;
+    return TRUE;
+}
+
+BOOL DentryIndexGrow(dext2_dentry_index* index) {
+    DWORD oldSlotCount = index->slotMask + 1;
+    dext2_dentry_slot* oldSlots = index->slots;
+    dext2_dentry_slot* slots = (dext2_dentry_slot*) calloc((size_t) oldSlotCount * 2, sizeof(dext2_dentry_slot));
+    if (slots == NULL) {
+        return FALSE;
+    }
+    index->slots = slots;
+    index->slotMask = oldSlotCount * 2 - 1;
+    index->entryCount = 0;
+    for (DWORD i = 0; i < oldSlotCount; i++) {
+        if (oldSlots[i].inode != 0) {
+            DentryIndexInsert(index, oldSlots[i].inode, oldSlots[i].nameHash, oldSlots[i].nameOffset, oldSlots[i].nameLength);
+        }
+    }
+    free(oldSlots);
+    return TRUE;
+}
+
+BOOL DentryIndexAddRecord(const ext2_dir_entry* de, LPVOID context) {
+    dext2_dentry_index* index = (dext2_dentry_index*) context;
+    DWORD nameLength = de->name_len;
+    // Keep the load factor under one half
+    if ((index->entryCount + 1) * 2 > index->slotMask + 1 && !DentryIndexGrow(index)) {
+        return FALSE;
+    }
+    if (index->namesSize + nameLength > index->namesCapacity) {
+        DWORD newCapacity = index->namesCapacity * 2 + nameLength;
+        LPSTR temp = (LPSTR) realloc(index->names, newCapacity);
+        if (temp == NULL) {
+            return FALSE;
+        }
+        index->names = temp;
+        index->namesCapacity = newCapacity;
+    }
+    DWORD nameOffset = index->namesSize;
+    memcpy(index->names + nameOffset, de->name, nameLength);
+    index->namesSize += nameLength;
+    return DentryIndexInsert(index, de->inode, HashName(de->name, nameLength), nameOffset, nameLength);
+}
+
+DEXT2_ERROR BuildDentryIndex(dext2_fs* hExt2, ext2_inode* pInode, DWORD directoryNumber, OUT dext2_dentry_index** pIndex) {
+    dext2_dentry_index* index = (dext2_dentry_index*) calloc(1, sizeof(dext2_dentry_index));
+    if (index == NULL) {
+        return DEXT2_ERROR_INTERNAL;
+    }
+    index->directoryNumber = directoryNumber;
+    index->slotMask = 15;
+    index->slots = (dext2_dentry_slot*) calloc(index->slotMask + 1, sizeof(dext2_dentry_slot));
+    index->namesCapacity = 256;
+    index->names = (LPSTR) malloc(index->namesCapacity);
+    if (index->slots == NULL || index->names == NULL) {
+        FreeDentryIndex(index);
+        return DEXT2_ERROR_INTERNAL;
+    }
+
+    // The walk only stops early when the index runs out of memory
+    DEXT2_ERROR status = WalkDirectory(hExt2, pInode, DentryIndexAddRecord, index);
+    if (status != DEXT2_NO_ERROR) {
+        FreeDentryIndex(index);
+        return status;
+    }
+    index->byteSize = sizeof(dext2_dentry_index)
+                      + (ULONGLONG) (index->slotMask + 1) * sizeof(dext2_dentry_slot)
+                      + index->namesCapacity;
+    *pIndex = index;
+    return DEXT2_NO_ERROR;
+}
+
+// Caller holds cache->lock
+dext2_dentry_index* FindDentryIndex(dext2_dentry_cache* cache, DWORD directoryNumber) {
+    for (DWORD i = 0; i < DEXT2_DENTRY_CACHE_DIRECTORIES; i++) {
+        if (cache->indexes[i] != NULL && cache->indexes[i]->directoryNumber == directoryNumber) {
+            cache->indexes[i]->lastUse = ++cache->clock;
+            return cache->indexes[i];
+        }
+    }
+    return NULL;
+}
+
+// Caller holds cache->lock
+BOOL IsOversizedDirectory(dext2_dentry_cache* cache, DWORD directoryNumber) {
+    for (DWORD i = 0; i < DEXT2_DENTRY_CACHE_DIRECTORIES; i++) {
+        if (cache->oversized[i] == directoryNumber) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// Caller holds cache->lock
+void RememberOversizedDirectory(dext2_dentry_cache* cache, DWORD directoryNumber) {
+    if (IsOversizedDirectory(cache, directoryNumber)) {
+        return;
+    }
+    cache->oversized[cache->nextOversized] = directoryNumber;
+    cache->nextOversized = (cache->nextOversized + 1) % DEXT2_DENTRY_CACHE_DIRECTORIES;
+}
+
+// Caller holds cache->lock. Takes ownership of the index
+void StoreDentryIndex(dext2_dentry_cache* cache, dext2_dentry_index* index) {
+    if (index->byteSize > cache->byteBudget) {
+        RememberOversizedDirectory(cache, index->directoryNumber);
+        FreeDentryIndex(index);
+        return;
+    }
+    if (FindDentryIndex(cache, index->directoryNumber) != NULL) {
+        FreeDentryIndex(index);
+        return;
+    }
+    while (TRUE) {
+        DWORD freeSlot = DEXT2_DENTRY_CACHE_DIRECTORIES;
+        DWORD victim = DEXT2_DENTRY_CACHE_DIRECTORIES;
+        for (DWORD i = 0; i < DEXT2_DENTRY_CACHE_DIRECTORIES; i++) {
+            if (cache->indexes[i] == NULL) {
+                freeSlot = i;
+            } else if (victim == DEXT2_DENTRY_CACHE_DIRECTORIES || cache->indexes[i]->lastUse < cache->indexes[victim]->lastUse) {
+                victim = i;
+            }
+        }
+        if (freeSlot != DEXT2_DENTRY_CACHE_DIRECTORIES && cache->used + index->byteSize <= cache->byteBudget) {
+            index->lastUse = ++cache->clock;
+            cache->indexes[freeSlot] = index;
+            cache->used += index->byteSize;
+            return;
+        }
+        cache->used -= cache->indexes[victim]->byteSize;
+        FreeDentryIndex(cache->indexes[victim]);
+        cache->indexes[victim] = NULL;
+    }
+}
+
+DWORD DentryIndexLookup(dext2_dentry_index* index, LPCSTR fileName, DWORD nameLength) {
+    DWORD nameHash = HashName(fileName, nameLength);
+    DWORD slot = nameHash & index->slotMask;
+    while (index->slots[slot].inode != 0) {
+        dext2_dentry_slot* candidate = &index->slots[slot];
+        if (candidate->nameHash == nameHash && candidate->nameLength == nameLength
+            && memcmp(index->names + candidate->nameOffset, fileName, nameLength) == 0) {
+            return candidate->inode;
+        }
+        slot = (slot + 1) & index->slotMask;
+    }
+    return 0;
+}
+
+typedef struct {
+    LPCSTR fileName;
+    DWORD nameLength;
+    DWORD inodeNumber;
+} dext2_name_search;
+
+BOOL MatchDirEntryName(const ext2_dir_entry* de, LPVOID context) {
+    dext2_name_search* search = (dext2_name_search*) context;
+    // Names are not NUL-terminated on disk
+    if ((DWORD) de->name_len == search->nameLength && memcmp(de->name, search->fileName, search->nameLength) == 0) {
+        search->inodeNumber = de->inode;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+DEXT2_ERROR ScanDirectoryForName(dext2_fs* hExt2, ext2_inode* pInode, LPCSTR fileName, DWORD nameLength, OUT PDWORD pInodeNumber) {
+    dext2_name_search search = { fileName, nameLength, 0 };
+    DEXT2_ERROR status = WalkDirectory(hExt2, pInode, MatchDirEntryName, &search);
+    if (status != DEXT2_NO_ERROR) {
+        return status;
+    }
+    *pInodeNumber = search.inodeNumber;
+    return search.inodeNumber != 0 ? DEXT2_NO_ERROR : DEXT2_ERROR_FILE_MISSING;
+}
+
+// Builds the index of a directory missing from the cache and stores it
+DEXT2_ERROR LookupInDentryIndex(dext2_fs* hExt2, DWORD directoryNumber, ext2_inode* pInode, LPCSTR fileName, DWORD nameLength,
+                                OUT PDWORD pInodeNumber) {
+    dext2_dentry_cache* cache = hExt2->dentryCache;
+    dext2_dentry_index* index;
+    DEXT2_ERROR status = BuildDentryIndex(hExt2, pInode, directoryNumber, &index);
+    if (status != DEXT2_NO_ERROR) {
+        return status;
+    }
+    *pInodeNumber = DentryIndexLookup(index, fileName, nameLength);
+    LockMutex(&cache->lock);
+    StoreDentryIndex(cache, index);
+    UnlockMutex(&cache->lock);
+    return *pInodeNumber != 0 ? DEXT2_NO_ERROR : DEXT2_ERROR_FILE_MISSING;
+}
+
+// directoryNumber may be 0 when unknown, the directory is then scanned
+DEXT2_ERROR LookupDirectoryEntry(dext2_fs* hExt2, DWORD directoryNumber, ext2_inode* pInode, LPCSTR fileName, OUT PDWORD pInodeNumber) {
+    size_t nameLength = strlen(fileName);
+    if (nameLength == 0 || nameLength > DEXT2_MAX_NAME_LEN) {
+        return DEXT2_ERROR_FILE_MISSING;
+    }
+
+    dext2_dentry_cache* cache = hExt2->dentryCache;
+    if (directoryNumber != 0 && cache->byteBudget != 0) {
+        LockMutex(&cache->lock);
+        dext2_dentry_index* index = FindDentryIndex(cache, directoryNumber);
+        if (index != NULL) {
+            cache->hits++;
+            *pInodeNumber = DentryIndexLookup(index, fileName, (DWORD) nameLength);
+            UnlockMutex(&cache->lock);
+            return *pInodeNumber != 0 ? DEXT2_NO_ERROR : DEXT2_ERROR_FILE_MISSING;
+        }
+        cache->misses++;
+        // The index grows with the directory, one that ends up over the
+        // budget would be built and thrown away on every lookup
+        BOOL useIndex = !IsOversizedDirectory(cache, directoryNumber);
+        if (useIndex && GetInodeFileSize(pInode) > cache->byteBudget) {
+            RememberOversizedDirectory(cache, directoryNumber);
+            useIndex = FALSE;
+        }
+        UnlockMutex(&cache->lock);
+        return useIndex ? LookupInDentryIndex(hExt2, directoryNumber, pInode, fileName, (DWORD) nameLength, pInodeNumber)
+                        : ScanDirectoryForName(hExt2, pInode, fileName, (DWORD) nameLength, pInodeNumber);
+    }
+    return ScanDirectoryForName(hExt2, pInode, fileName, (DWORD) nameLength, pInodeNumber);
+}
+
+// directoryNumber is the inode number of pInode, 0 if unknown.
+// pNewInodeNumber may be NULL
+DEXT2_ERROR SeekInodeByFileName(dext2_fs* hExt2, LPCSTR fileName, DWORD directoryNumber, ext2_inode* pInode,
+                                OUT PDWORD pNewInodeNumber, OUT ext2_inode* pNewInode) {
+    if ((pInode->i_mode & DEXT2_INODE_IS_DIR) == 0) {
+        return DEXT2_ERROR_FILE_MISSING;
+    }
+    DWORD inodeNumber;
+    DEXT2_ERROR status = LookupDirectoryEntry(hExt2, directoryNumber, pInode, fileName, &inodeNumber);
+    if (status != DEXT2_NO_ERROR) {
+        return status;
+    }
+    if (!GetInodeByNumber(hExt2, inodeNumber, pNewInode)) {
+        return DEXT2_ERROR_READING_DISK;
+    }
+    if (pNewInodeNumber != NULL) {
+        *pNewInodeNumber = inodeNumber;
+    }
+    return DEXT2_NO_ERROR;
+}
+
+typedef struct {
+    ext2_dir_entry* entries;
+    ULONGLONG count;
+    ULONGLONG capacity;
+    BOOL outOfMemory;
+} dext2_child_list;
+
+BOOL AppendChild(const ext2_dir_entry* de, LPVOID context) {
+    dext2_child_list* list = (dext2_child_list*) context;
+    if (list->count >= list->capacity) {
+        ext2_dir_entry* temp = (ext2_dir_entry*) realloc(list->entries, list->capacity * 2 * sizeof(ext2_dir_entry));
+        if (temp == NULL) {
+            list->outOfMemory = TRUE;
+            return FALSE;
+        }
+        list->entries = temp;
+        list->capacity *= 2;
+    }
+    // Copy only the valid part of the record and terminate the name
+    ext2_dir_entry* entry = &list->entries[list->count];
+    DWORD nameLength = de->name_len;
+    entry->inode = de->inode;
+    entry->rec_len = de->rec_len;
+    entry->name_len = de->name_len;
+    entry->file_type = de->file_type;
+    memcpy(entry->name, de->name, nameLength);
+    if (nameLength < DEXT2_MAX_NAME_LEN) {
+        entry->name[nameLength] = '\0';
+    }
+    list->count++;
+    return TRUE;
+}
+
+DEXT2_ERROR GetChilds(dext2_fs* hExt2, ext2_inode* pInode, OUT ext2_dir_entry** directoryEntries, OUT PULONGLONG arraySize) {
+    dext2_child_list list = { NULL, 0, 32, FALSE };
+    list.entries = (ext2_dir_entry*) malloc(list.capacity * sizeof(ext2_dir_entry));
+    if (list.entries == NULL) {
+        return DEXT2_ERROR_INTERNAL;
+    }
+
+    ULONGLONG started = StartLatency();
+    dext2_trace_span span = BeginTraceSpan(hExt2->trace, "GetChilds");
+    DEXT2_ERROR status = WalkDirectory(hExt2, pInode, AppendChild, &list);
+    if (status == DEXT2_NO_ERROR && list.outOfMemory) {
+        status = DEXT2_ERROR_INTERNAL;
+    }
+    EndTraceSpan(&span, 0);
+    RecordLatency(&hExt2->stats, DEXT2_LATENCY_GET_CHILDS, started);
+    if (status != DEXT2_NO_ERROR) {
+        free(list.entries);
+        return status;
+    }
+    *directoryEntries = list.entries;
+    *arraySize = list.count;
+    return DEXT2_NO_ERROR;
+}
+
+// Directory records carry the entry type only with the filetype feature,
+// on other filesystems the byte is part of a 16-bit name_len
+BOOL HasDirEntryFileTypes(dext2_fs* hExt2) {
+    return hExt2->superBlock.s_rev_level >= 1
+        && (hExt2->superBlock.s_feature_incompat & DEXT2_FEATURE_INCOMPAT_FILETYPE) != 0;
+}
+
+BYTE FileTypeFromMode(WORD mode) {
+    switch (mode & DEXT2_INODE_FORMAT_MASK) {
+        case DEXT2_INODE_IS_FILE: return DEXT2_FT_REG_FILE;
+        case DEXT2_INODE_IS_DIR: return DEXT2_FT_DIR;
+        case DEXT2_INODE_IS_CHAR_DEVICE: return DEXT2_FT_CHRDEV;
+        case DEXT2_INODE_IS_BLOCK_DEVICE: return DEXT2_FT_BLKDEV;
+        case DEXT2_INODE_IS_FIFO: return DEXT2_FT_FIFO;
+        case DEXT2_INODE_IS_SOCKET: return DEXT2_FT_SOCK;
+        case DEXT2_INODE_IS_SYMLINK: return DEXT2_FT_SYMLINK;
+        default: return DEXT2_FT_UNKNOWN;
+    }
+}
+
+// Type of the entry as DEXT2_FT_*. Taken from the record itself when the
+// filesystem has the filetype feature, so listings need no inode reads;
+// otherwise the inode is read
+DEXT2_ERROR GetDirEntryType(dext2_fs* hExt2, const ext2_dir_entry* de, OUT PBYTE fileType) {
+    if (HasDirEntryFileTypes(hExt2) && de->file_type != DEXT2_FT_UNKNOWN) {
+        *fileType = de->file_type;
+        return DEXT2_NO_ERROR;
+    }
+    ext2_inode inode;
+    if (!GetInodeByNumber(hExt2, de->inode, &inode)) {
+        return DEXT2_ERROR_READING_DISK;
+    }
+    *fileType = FileTypeFromMode(inode.i_mode);
+    return DEXT2_NO_ERROR;
+}
+
+// Compact directory listing
+//
+// One allocation holds the header, the entry array and every name, so a
+// listing costs a few bytes over its names and is released with a single
+// FreeDirectoryListing. Names are stored back to back, each followed by a
+// NUL, and located through nameOffset. The layout has no implicit padding,
+// so foreign function interfaces can read it directly
+typedef struct {
+    DWORD inode;
+    DWORD nameOffset;              // Into names
+    BYTE nameLength;
+    BYTE fileType;                 // DEXT2_FT_*
+    WORD reserved;
+} dext2_listing_entry;
+
+typedef struct {
+    ULONGLONG count;
+    ULONGLONG namesSize;           // Bytes in names, NULs included
+    dext2_listing_entry* entries;
+    LPSTR names;
+} dext2_directory_listing;
+
+typedef struct {
+    dext2_listing_entry* entries;
+    ULONGLONG count;
+    ULONGLONG capacity;
+    LPSTR names;
+    ULONGLONG namesSize;
+    ULONGLONG namesCapacity;
+    BOOL outOfMemory;
+} dext2_listing_builder;
+
+BOOL AppendListingEntry(const ext2_dir_entry* de, LPVOID context) {
+    dext2_listing_builder* builder = (dext2_listing_builder*) context;
+    if (builder->count >= builder->capacity) {
+        dext2_listing_entry* temp = (dext2_listing_entry*) realloc(builder->entries, builder->capacity * 2 * sizeof(dext2_listing_entry));
+        if (temp == NULL) {
+            builder->outOfMemory = TRUE;
+            return FALSE;
+        }
+        builder->entries = temp;
+        builder->capacity *= 2;
+    }
+    if (builder->namesSize + de->name_len + 1 > builder->namesCapacity) {
+        ULONGLONG newCapacity = builder->namesCapacity * 2 + de->name_len + 1;
+        LPSTR temp = (LPSTR) realloc(builder->names, (size_t) newCapacity);
+        if (temp == NULL) {
+            builder->outOfMemory = TRUE;
+            return FALSE;
+        }
+        builder->names = temp;
+        builder->namesCapacity = newCapacity;
+    }
+    dext2_listing_entry* entry = &builder->entries[builder->count];
+    entry->inode = de->inode;
+    entry->nameOffset = (DWORD) builder->namesSize;
+    entry->nameLength = de->name_len;
+    entry->fileType = de->file_type;
+    entry->reserved = 0;
+    memcpy(builder->names + builder->namesSize, de->name, de->name_len);
+    builder->names[builder->namesSize + de->name_len] = '\0';
+    builder->namesSize += de->name_len + 1;
+    builder->count++;
+    return TRUE;
+}
+
+// Lists the directory in on-disk order. Entry types come from the records
+// on filesystems with the filetype feature, other filesystems and records
+// of unknown type pay one inode read per entry. Release the result with FreeDirectoryListing
+DEXT2_ERROR ListDirectory(dext2_fs* hExt2, ext2_inode* pInode, OUT dext2_directory_listing** listing) {
+    ULONGLONG started = StartLatency();
+    dext2_trace_span span = BeginTraceSpan(hExt2->trace, "ListDirectory");
+    dext2_listing_builder builder;
+    memset(&builder, 0, sizeof(builder));
+    builder.capacity = 32;
+    builder.namesCapacity = 32 * 16;
+    builder.entries = (dext2_listing_entry*) malloc(builder.capacity * sizeof(dext2_listing_entry));
+    builder.names = (LPSTR) malloc((size_t) builder.namesCapacity);
+    DEXT2_ERROR status = builder.entries == NULL || builder.names == NULL ? DEXT2_ERROR_INTERNAL : DEXT2_NO_ERROR;
+    if (status == DEXT2_NO_ERROR) {
+        status = WalkDirectory(hExt2, pInode, AppendListingEntry, &builder);
+    }
+    if (status == DEXT2_NO_ERROR && builder.outOfMemory) {
+        status = DEXT2_ERROR_INTERNAL;
+    }
+    // Same rule as GetDirEntryType, records of unknown type are resolved
+    // through their inode as well
+    BOOL recordTypes = HasDirEntryFileTypes(hExt2);
+    for (ULONGLONG i = 0; i < builder.count && status == DEXT2_NO_ERROR; i++) {
+        if (!recordTypes || builder.entries[i].fileType == DEXT2_FT_UNKNOWN) {
+            ext2_inode inode;
+            if (!GetInodeByNumber(hExt2, builder.entries[i].inode, &inode)) {
+                status = DEXT2_ERROR_READING_DISK;
+            } else {
+                builder.entries[i].fileType = FileTypeFromMode(inode.i_mode);
+            }
+        }
+    }
+
+    dext2_directory_listing* result = NULL;
+    size_t entriesSize = (size_t) builder.count * sizeof(dext2_listing_entry);
+    if (status == DEXT2_NO_ERROR) {
+        result = (dext2_directory_listing*) malloc(sizeof(dext2_directory_listing) + entriesSize + (size_t) builder.namesSize);
+        if (result == NULL) {
+            status = DEXT2_ERROR_INTERNAL;
+        }
+    }
+    if (result != NULL) {
+        result->count = builder.count;
+        result->namesSize = builder.namesSize;
+        result->entries = (dext2_listing_entry*) (result + 1);
+        result->names = (LPSTR) result->entries + entriesSize;
+        memcpy(result->entries, builder.entries, entriesSize);
+        memcpy(result->names, builder.names, (size_t) builder.namesSize);
+        *listing = result;
+    }
+    free(builder.entries);
+    free(builder.names);
+    EndTraceSpan(&span, 0);
+    RecordLatency(&hExt2->stats, DEXT2_LATENCY_LIST_DIRECTORY, started);
+    return status;
+}
+
+void FreeDirectoryListing(dext2_directory_listing* listing) {
+    free(listing);
+}
+
+
+/***********************************************************
+* PATH CACHE
+*
+* Maps a normalized path, relative to some directory, to the
+* inode number it resolves to. Every resolved prefix is stored,
+* so resolving several files of one directory only looks up
+* the last component after the first one. Absolute paths are
+* stored relative to the root, so /a/b and a/b from the root
+* share entries
+************************************************************/
+
+#define DEXT2_PATH_CACHE_SETS 256
+#define DEXT2_PATH_CACHE_WAYS 4
+#define DEXT2_PATH_CACHE_MAX_LENGTH 4096 // Longer prefixes are not cached
+
+typedef struct {
+    LPSTR path;                    // NULL marks an empty entry
+    DWORD pathLength;
+    DWORD pathHash;
+    DWORD baseNumber;              // Directory the path is relative to
+    DWORD inodeNumber;
+    ULONGLONG lastUse;
+} dext2_path_cache_entry;
+
+struct dext2_path_cache {
+    dext2_path_cache_entry entries[DEXT2_PATH_CACHE_SETS][DEXT2_PATH_CACHE_WAYS];
+    ULONGLONG clock;
+    ULONGLONG hits;
+    ULONGLONG misses;
+    dext2_mutex lock;
+};
+
+void ResetPathCache(dext2_path_cache* cache) {
+    LockMutex(&cache->lock);
+    for (DWORD set = 0; set < DEXT2_PATH_CACHE_SETS; set++) {
+        for (DWORD way = 0; way < DEXT2_PATH_CACHE_WAYS; way++) {
+            free(cache->entries[set][way].path);
+            cache->entries[set][way].path = NULL;
+        }
+    }
+    UnlockMutex(&cache->lock);
+}
+
+dext2_path_cache* CreatePathCache(void) {
+    dext2_path_cache* cache = (dext2_path_cache*) calloc(1, sizeof(dext2_path_cache));
+    if (cache == NULL) {
+        return NULL;
+    }
+    InitMutex(&cache->lock);
+    return cache;
+}
+
+void FreePathCache(dext2_path_cache* cache) {
+    if (cache == NULL) {
+        return;
+    }
+    ResetPathCache(cache);
+    DestroyMutex(&cache->lock);
+    free(cache);
+}
+
+void GetPathCacheStats(dext2_fs* hExt2, OUT dext2_cache_stats* stats) {
+    dext2_path_cache* cache = hExt2->pathCache;
+    memset(stats, 0, sizeof(dext2_cache_stats));
+    LockMutex(&cache->lock);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    for (DWORD set = 0; set < DEXT2_PATH_CACHE_SETS; set++) {
+        for (DWORD way = 0; way < DEXT2_PATH_CACHE_WAYS; way++) {
+            if (cache->entries[set][way].path != NULL) {
+                stats->entryCount++;
+            }
+        }
+    }
+    stats->capacity = DEXT2_PATH_CACHE_SETS * DEXT2_PATH_CACHE_WAYS;
+    UnlockMutex(&cache->lock);
+}
+
+DWORD PathCacheHash(DWORD baseNumber, LPCSTR path, DWORD pathLength) {
+    return HashName(path, pathLength) ^ (baseNumber * 2654435761u);
+}
+
+BOOL PathCacheLookup(dext2_path_cache* cache, DWORD baseNumber, LPCSTR path, DWORD pathLength, OUT PDWORD pInodeNumber) {
+    if (pathLength > DEXT2_PATH_CACHE_MAX_LENGTH) {
+        return FALSE;
+    }
+    DWORD pathHash = PathCacheHash(baseNumber, path, pathLength);
+    dext2_path_cache_entry* set = cache->entries[pathHash % DEXT2_PATH_CACHE_SETS];
+    BOOL found = FALSE;
+    LockMutex(&cache->lock);
+    for (DWORD way = 0; way < DEXT2_PATH_CACHE_WAYS; way++) {
+        dext2_path_cache_entry* entry = &set[way];
+        if (entry->path != NULL && entry->pathHash == pathHash && entry->baseNumber == baseNumber
+            && entry->pathLength == pathLength && memcmp(entry->path, path, pathLength) == 0) {
+            entry->lastUse = ++cache->clock;
+            *pInodeNumber = entry->inodeNumber;
+            found = TRUE;
+            break;
+        }
+    }
+    if (found) {
+        cache->hits++;
+    } else {
+        cache->misses++;
+    }
+    UnlockMutex(&cache->lock);
+    return found;
+}
+
+void PathCacheInsert(dext2_path_cache* cache, DWORD baseNumber, LPCSTR path, DWORD pathLength, DWORD inodeNumber) {
+    if (pathLength > DEXT2_PATH_CACHE_MAX_LENGTH) {
+        return;
+    }
+    DWORD pathHash = PathCacheHash(baseNumber, path, pathLength);
+    dext2_path_cache_entry* set = cache->entries[pathHash % DEXT2_PATH_CACHE_SETS];
+    LPSTR copy = (LPSTR) malloc(pathLength);
+    if (copy == NULL) {
+        return;
+    }
+    memcpy(copy, path, pathLength);
+
+    LockMutex(&cache->lock);
+    // Replace an entry for the same path, else an empty or the least recently used one
+    DWORD victim = 0;
+    for (DWORD way = 0; way < DEXT2_PATH_CACHE_WAYS; way++) {
+        dext2_path_cache_entry* entry = &set[way];
+        if (entry->path != NULL && entry->pathHash == pathHash && entry->baseNumber == baseNumber
+            && entry->pathLength == pathLength && memcmp(entry->path, path, pathLength) == 0) {
+            victim = way;
+            break;
+        }
+        if (entry->path == NULL || (set[victim].path != NULL && entry->lastUse < set[victim].lastUse)) {
+            victim = way;
+        }
+    }
+    free(set[victim].path);
+    set[victim].path = copy;
+    set[victim].pathLength = pathLength;
+    set[victim].pathHash = pathHash;
+    set[victim].baseNumber = baseNumber;
+    set[victim].inodeNumber = inodeNumber;
+    set[victim].lastUse = ++cache->clock;
+    UnlockMutex(&cache->lock);
+}
+
+// Resolves path relative to the directory *pInodeNumber / *pInode.
+// Empty components are ignored, so a//b and a/b/ are the same as a/b.
+// Both outputs are only updated on success
+DEXT2_ERROR _ResolvePathInner(dext2_fs* hExt2, LPCSTR path, PDWORD pInodeNumber, ext2_inode* pInode) {
+    size_t fullLength = strlen(path);
+    if (fullLength >= 0xFFFFFFFF) {
+        return DEXT2_ERROR_FILE_MISSING;
+    }
+    // Normalized copy, components separated by a single slash. Usual
+    // paths fit on the stack
+    CHAR shortPath[256];
+    LPSTR normalized = fullLength < sizeof(shortPath) ? shortPath : (LPSTR) malloc(fullLength + 1);
+    if (normalized == NULL) {
+        return DEXT2_ERROR_INTERNAL;
+    }
+    DWORD length = 0;
+    for (DWORD i = 0; i < fullLength; i++) {
+        if (path[i] == '/' && (length == 0 || normalized[length - 1] == '/')) {
+            continue;
+        }
+        normalized[length++] = path[i];
+    }
+    if (length > 0 && normalized[length - 1] == '/') {
+        length--;
+    }
+    normalized[length] = '\0';
+
+    DWORD baseNumber = *pInodeNumber;
+    DWORD inodeNumber = baseNumber;
+    ext2_inode inode = *pInode;
+    DWORD position = 0;
+    DEXT2_ERROR status = DEXT2_NO_ERROR;
+
+    // Start after the longest prefix that is already known
+    if (baseNumber != 0 && length > 0) {
+        DWORD end = length;
+        while (TRUE) {
+            DWORD cachedNumber;
+            if (PathCacheLookup(hExt2->pathCache, baseNumber, normalized, end, &cachedNumber)) {
+                if (!GetInodeByNumber(hExt2, cachedNumber, &inode)) {
+                    status = DEXT2_ERROR_READING_DISK;
+                }
+                inodeNumber = cachedNumber;
+                position = end < length ? end + 1 : end;
+                break;
+            }
+            while (end > 0 && normalized[end - 1] != '/') {
+                end--;
+            }
+            if (end == 0) {
+                break;
+            }
+            end--;
+        }
+    }
+
+    while (status == DEXT2_NO_ERROR && position < length) {
+        DWORD end = position;
+        while (end < length && normalized[end] != '/') {
+            end++;
+        }
+        if (end - position > DEXT2_MAX_NAME_LEN) {
+            status = DEXT2_ERROR_FILE_MISSING;
+            break;
+        }
+        // Terminate the component in place for the lookup
+        CHAR separator = normalized[end];
+        normalized[end] = '\0';
+        DWORD newInodeNumber;
+        ext2_inode newInode;
+        status = SeekInodeByFileName(hExt2, normalized + position, inodeNumber, &inode, &newInodeNumber, &newInode);
+        normalized[end] = separator;
+        if (status != DEXT2_NO_ERROR) {
+            break;
+        }
+        inodeNumber = newInodeNumber;
+        inode = newInode;
+        if (baseNumber != 0) {
+            PathCacheInsert(hExt2->pathCache, baseNumber, normalized, end, inodeNumber);
+        }
+        position = end + 1;
+    }
+
+    if (normalized != shortPath) {
+        free(normalized);
+    }
+    if (status != DEXT2_NO_ERROR) {
+        return status;
+    }
+    *pInodeNumber = inodeNumber;
+    *pInode = inode;
+    return DEXT2_NO_ERROR;
+}
+
+// Same as ResolvePath, also returns the inode number
+DEXT2_ERROR ResolvePathEx(dext2_fs* hExt2, LPCSTR path, OUT PDWORD pInodeNumber, OUT ext2_inode* pInode) {
+    if (path[0] != '/') {
+        return DEXT2_ERROR_FILE_MISSING;
+    }
+    ULONGLONG started = StartLatency();
+    dext2_trace_span span = BeginTraceSpan(hExt2->trace, "ResolvePath");
+    ext2_inode root;
+    DWORD inodeNumber = 2;
+    DEXT2_ERROR status = GetInodeByNumber(hExt2, 2, &root) ?
+        _ResolvePathInner(hExt2, path, &inodeNumber, &root) :
+        DEXT2_ERROR_READING_DISK;
+    if (status == DEXT2_NO_ERROR) {
+        *pInodeNumber = inodeNumber;
+        *pInode = root;
+    }
+    EndTraceSpan(&span, 0);
+    RecordLatency(&hExt2->stats, DEXT2_LATENCY_RESOLVE_PATH, started);
+    return status;
+}
+
+// Resolves path relative to the directory *pInodeNumber, *pInode, leaving
+// the result in both. Timed like ResolvePathEx
+DEXT2_ERROR ResolveRelativePath(dext2_fs* hExt2, LPCSTR path, PDWORD pInodeNumber, ext2_inode* pInode) {
+    ULONGLONG started = StartLatency();
+    dext2_trace_span span = BeginTraceSpan(hExt2->trace, "ResolvePath");
+    DEXT2_ERROR status = _ResolvePathInner(hExt2, path, pInodeNumber, pInode);
+    EndTraceSpan(&span, 0);
+    RecordLatency(&hExt2->stats, DEXT2_LATENCY_RESOLVE_PATH, started);
+    return status;
+}
+
+DEXT2_ERROR ResolvePath(dext2_fs* hExt2, LPCSTR path, OUT ext2_inode* pInode) {
+    DWORD inodeNumber;
+    return ResolvePathEx(hExt2, path, &inodeNumber, pInode);
+}
+
+#ifdef _WIN32
+BOOL GetPartitions(HANDLE hDisk, OUT PPARTITION_INFORMATION_EX* partitions, OUT PDWORD arrayLength) {
+    DWORD bytesReturned;
+    size_t bufferSize = sizeof(DRIVE_LAYOUT_INFORMATION_EX) 
+        + DEXT2_MAX_PARTITION_COUNT * sizeof(PARTITION_INFORMATION_EX);
+    PDRIVE_LAYOUT_INFORMATION_EX driveLayout = (PDRIVE_LAYOUT_INFORMATION_EX) malloc(bufferSize);
+
+    if (!DeviceIoControl(
+            hDisk,
+            IOCTL_DISK_GET_DRIVE_LAYOUT_EX,
+            NULL,
+            0,
+            driveLayout,
+            (DWORD) bufferSize,
+            &bytesReturned,
+            NULL)
+    ) {
+        free(driveLayout);
+        return FALSE;
+    }
+
+    if (
+        driveLayout->PartitionStyle != PARTITION_STYLE_GPT
+        && driveLayout->PartitionStyle != PARTITION_STYLE_MBR
+    ) {
+        free(driveLayout);
+        return FALSE;
+    }
+
+    *arrayLength = driveLayout->PartitionCount;
+    size_t partitionsSize = *arrayLength * sizeof(PARTITION_INFORMATION_EX);
+    *partitions = (PPARTITION_INFORMATION_EX) malloc(partitionsSize);
+    memcpy(*partitions, driveLayout->PartitionEntry, partitionsSize);
+    free(driveLayout);
+    return TRUE;
+}
+
+BOOL IsPartitionEmpty(PPARTITION_INFORMATION_EX partition) {
+    if (partition->PartitionStyle == PARTITION_STYLE_MBR) {
+        return partition->Mbr.PartitionType == PARTITION_ENTRY_UNUSED; 
+    } 
+    else if (partition->PartitionStyle == PARTITION_STYLE_GPT) {
+        GUID emptyGuid = {0};
+        return memcmp(&partition->Gpt.PartitionType, &emptyGuid, sizeof(GUID)) == 0;
+    }
+    return FALSE;
+}
+#endif // _WIN32
+
+// Materializes the whole block map, holes are stored as 0.
+// Prefer the block map iterator, which needs no per-block memory
+BOOL _GetDataBlocksInner(dext2_fs* hExt2, ext2_inode* pInode, OUT PDWORD* dataBlocks, OUT PULONGLONG dataBlocksSize) {
+    dext2_block_map_iterator iterator;
+    if (!InitBlockMapIterator(hExt2, pInode, &iterator)) {
+        return FALSE;
+    }
+    // Every block is wanted, so whole levels can be read ahead
+    iterator.prefetch = TRUE;
+    *dataBlocksSize = iterator.blockCount;
+    *dataBlocks = (PDWORD) malloc((size_t) iterator.blockCount * sizeof(DWORD));
+    if (*dataBlocks == NULL && iterator.blockCount != 0) {
+        FreeBlockMapIterator(&iterator);
+        return FALSE;
+    }
+
+    dext2_block_run run;
+    while (TRUE) {
+        if (!NextBlockRun(&iterator, &run)) {
+            FreeBlockMapIterator(&iterator);
+            return FALSE;
+        }
+        if (run.length == 0) {
+            break;
+        }
+        for (DWORD i = 0; i < run.length; i++) {
+            (*dataBlocks)[run.logicalBlock + i] = run.physicalBlock == 0 ? 0 : run.physicalBlock + i;
+        }
+    }
+    FreeBlockMapIterator(&iterator);
+    return TRUE;
+}
+
+BOOL GetDataBlocks(dext2_fs* hExt2, ext2_inode* pInode, OUT PDWORD* dataBlocks, OUT PULONGLONG dataBlocksSize) {
+    dext2_trace_span span = BeginTraceSpan(hExt2->trace, "GetDataBlocks");
+    BOOL success = _GetDataBlocksInner(hExt2, pInode, dataBlocks, dataBlocksSize);
+    EndTraceSpan(&span, 0);
+    return success;
+}
+
+#ifdef _WIN32
+BOOL GetAvailableDisks(LPSTR** disks, PDWORD* disksNumbers, PDWORD arraySize) {
+    DWORD drives = GetLogicalDrives();
+    if (drives == 0) {
+        DEXT2_LOG_DEBUG("GetLogicalDrives failed with error: %lu\n", GetLastError());
+        return FALSE;
+    }
+
+    DWORD count = 0;
+    for (int i = 0; i < 26; i++) {
+        if (drives & (1 << i)) {
+            count++;
+        }
+    }
+
+    if (count == 0) {
+        return FALSE;
+    }
+
+    *disks = (LPSTR*) malloc(count * sizeof(LPSTR));
+    *disksNumbers = (PDWORD) malloc(count * sizeof(DWORD));
+
+    DWORD index = 0;
+    for (int i = 0; i < 26; i++) {
+        if (drives & (1 << i)) {
+            char* driveName = (char*)malloc(4 * sizeof(char)); // "C:\0"
+            snprintf(driveName, 4, "%c:\\", 'A' + i);
+            (*disks)[index] = driveName;
+            (*disksNumbers)[index] = index;
+            index++;
+        }
+    }
+
+    *arraySize = count;
+    return TRUE;
+}
+
+void FreeDiskArray(LPSTR* disks, PDWORD disksNumbers, DWORD arraySize) {
+    for (DWORD i = 0; i < arraySize; i++) {
+        free((void*)disks[i]);
+    }
+    free(disks);
+    free(disksNumbers);
+}
+#endif // _WIN32
+
+// Runs gathered into one chunk of a fragmented file
+#define DEXT2_CHUNK_MAX_RUNS 64
+
+// Produces the next piece of file contents, at most one maximum I/O size
+// (iterator->maxRunLength blocks, the size of buffer). source points either
+// into buffer or into the mapped image. *nBytes is 0 once the file is done.
+// Without a mapping, the runs of a fragmented file are gathered until the
+// chunk is full and read as one batch
+BOOL ReadNextFileChunk(dext2_fs* hExt2, dext2_block_map_iterator* iterator, PULONGLONG bytesLeft, PBYTE buffer,
+                       OUT const BYTE** source, OUT PDWORD nBytes) {
+    *nBytes = 0;
+    if (*bytesLeft == 0) {
+        return TRUE;
+    }
+    DWORD chunkBlocks = iterator->maxRunLength;
+    dext2_block_run run;
+    if (!NextBlockRun(iterator, &run)) {
+        DEXT2_LOG_DEBUG("Error reading block map");
+        return FALSE;
+    }
+    if (run.length == 0) {
+        return TRUE;
+    }
+    DWORD runBytes = run.length * dwBlockSize(hExt2);
+
+    LONGLONG dataLocation = hExt2->partitionStart + (LONGLONG) run.physicalBlock * llBlockSize(hExt2);
+    *source = run.physicalBlock == 0 ? NULL : GetMappedBytes(hExt2->device, dataLocation, runBytes);
+    if (*source != NULL) {
+        // Written straight out of the mapping
+        AdviseDeviceRange(hExt2->device, dataLocation, runBytes, DEXT2_ADVICE_SEQUENTIAL);
+        *nBytes = *bytesLeft < runBytes ? (DWORD) *bytesLeft : runBytes;
+        *bytesLeft -= *nBytes;
+        return TRUE;
+    }
+
+    dext2_io_request requests[DEXT2_CHUNK_MAX_RUNS];
+    DWORD requestCount = 0;
+    DWORD filled = 0;              // Blocks of the chunk accounted for
+    BOOL success = TRUE;
+    while (TRUE) {
+        if (run.physicalBlock == 0) {
+            memset(buffer + (size_t) filled * dwBlockSize(hExt2), 0, (size_t) run.length * dwBlockSize(hExt2));
+        } else {
+            requests[requestCount].offset = hExt2->partitionStart + (LONGLONG) run.physicalBlock * llBlockSize(hExt2);
+            requests[requestCount].length = run.length * dwBlockSize(hExt2);
+            requests[requestCount].buffer = buffer + (size_t) filled * dwBlockSize(hExt2);
+            requestCount++;
+        }
+        filled += run.length;
+        if (filled >= chunkBlocks
+            || (ULONGLONG) filled * dwBlockSize(hExt2) >= *bytesLeft
+            || requestCount == DEXT2_CHUNK_MAX_RUNS
+            || hExt2->device->mappedBase != NULL) {
+            break;
+        }
+        // The next run must fit in what is left of the buffer
+        iterator->maxRunLength = chunkBlocks - filled;
+        success = NextBlockRun(iterator, &run);
+        iterator->maxRunLength = chunkBlocks;
+        if (!success) {
+            DEXT2_LOG_DEBUG("Error reading block map");
+            return FALSE;
+        }
+        if (run.length == 0) {
+            break;
+        }
+    }
+
+    if (requestCount == 1) {
+        success = ReadBytesDirect(hExt2, requests[0].offset, requests[0].length, requests[0].buffer);
+    } else if (requestCount > 1) {
+        success = ReadBatchDirect(hExt2, requests, requestCount);
+    }
+    if (!success) {
+        DEXT2_LOG_DEBUG("Error reading data blocks");
+        return FALSE;
+    }
+    *source = buffer;
+    DWORD chunkBytes = filled * dwBlockSize(hExt2);
+    *nBytes = *bytesLeft < chunkBytes ? (DWORD) *bytesLeft : chunkBytes;
+    *bytesLeft -= *nBytes;
+    return TRUE;
+}
+
+// Read/write pipeline
+//
+// The calling thread reads chunks into a ring of buffers while a writer
+// thread drains them to the destination, so reading the image and writing
+// the output overlap instead of taking turns
+typedef struct {
+    PBYTE buffer;
+    const BYTE* source;
+    DWORD length;
+} dext2_pipeline_slot;
+
+typedef struct {
+    HANDLE hWinFile;
+    dext2_pipeline_slot* slots;
+    DWORD depth;
+    DWORD head;                    // Next slot the reader fills
+    DWORD tail;                    // Next slot the writer drains
+    DWORD count;
+    BOOL readerDone;
+    BOOL cancelled;                // Reader failed, queued chunks are dropped
+    BOOL writerFailed;
+    dext2_mutex lock;
+    dext2_cond notEmpty;
+    dext2_cond notFull;
+} dext2_copy_pipeline;
+
+DEXT2_THREAD_PROC(PipelineWriter) {
+    dext2_copy_pipeline* pipeline = (dext2_copy_pipeline*) parameter;
+    while (TRUE) {
+        LockMutex(&pipeline->lock);
+        while (pipeline->count == 0 && !pipeline->readerDone) {
+            WaitCondition(&pipeline->notEmpty, &pipeline->lock);
+        }
+        if (pipeline->count == 0 || pipeline->cancelled) {
+            UnlockMutex(&pipeline->lock);
+            break;
+        }
+        dext2_pipeline_slot* slot = &pipeline->slots[pipeline->tail];
+        UnlockMutex(&pipeline->lock);
+
+        DWORD written;
+        BOOL success = WriteFile(pipeline->hWinFile, slot->source, slot->length, &written, NULL) && written == slot->length;
+
+        LockMutex(&pipeline->lock);
+        pipeline->tail = (pipeline->tail + 1) % pipeline->depth;
+        pipeline->count--;
+        if (!success) {
+            DEXT2_LOG_DEBUG("Error writing to file");
+            pipeline->writerFailed = TRUE;
+        }
+        SignalCondition(&pipeline->notFull);
+        UnlockMutex(&pipeline->lock);
+        if (!success) {
+            break;
+        }
+    }
+    return 0;
+}
+
+// Reads a chunk, writes it, and so on, with a single buffer
+BOOL SerialCopy(dext2_fs* hExt2, HANDLE hWinFile, dext2_block_map_iterator* iterator, ULONGLONG bytesLeft, PBYTE buffer) {
+    while (TRUE) {
+        const BYTE* source;
+        DWORD nBytesToWrite;
+        if (!ReadNextFileChunk(hExt2, iterator, &bytesLeft, buffer, &source, &nBytesToWrite)) {
+            return FALSE;
+        }
+        if (nBytesToWrite == 0) {
+            return TRUE;
+        }
+        DWORD written;
+        if (!WriteFile(hWinFile, source, nBytesToWrite, &written, NULL) || written < nBytesToWrite) {
+            DEXT2_LOG_DEBUG("Error writing to file");
+            return FALSE;
+        }
+    }
+}
+
+BOOL PipelinedCopy(dext2_fs* hExt2, HANDLE hWinFile, dext2_block_map_iterator* iterator, ULONGLONG bytesLeft, DWORD chunkSize, DWORD depth) {
+    dext2_copy_pipeline pipeline;
+    memset(&pipeline, 0, sizeof(pipeline));
+    pipeline.hWinFile = hWinFile;
+    pipeline.depth = depth;
+    pipeline.slots = (dext2_pipeline_slot*) calloc(depth, sizeof(dext2_pipeline_slot));
+    if (pipeline.slots == NULL) {
+        return FALSE;
+    }
+    for (DWORD i = 0; i < depth; i++) {
+        pipeline.slots[i].buffer = AcquireBuffer(&hExt2->chunkPool, chunkSize);
+        if (pipeline.slots[i].buffer == NULL) {
+            for (DWORD j = 0; j < i; j++) ReleaseBuffer(&hExt2->chunkPool, pipeline.slots[j].buffer, chunkSize);
+            free(pipeline.slots);
+            return FALSE;
+        }
+    }
+    InitMutex(&pipeline.lock);
+    InitCondition(&pipeline.notEmpty);
+    InitCondition(&pipeline.notFull);
+
+    // Without a writer thread the copy goes on serially, as with depth 1,
+    // and the other buffers go back to the pool for the whole copy
+    dext2_thread writer;
+    if (!StartThread(&writer, PipelineWriter, &pipeline)) {
+        DestroyCondition(&pipeline.notFull);
+        DestroyCondition(&pipeline.notEmpty);
+        DestroyMutex(&pipeline.lock);
+        PBYTE buffer = pipeline.slots[0].buffer;
+        for (DWORD i = 1; i < depth; i++) {
+            ReleaseBuffer(&hExt2->chunkPool, pipeline.slots[i].buffer, chunkSize);
+        }
+        free(pipeline.slots);
+        BOOL success = SerialCopy(hExt2, hWinFile, iterator, bytesLeft, buffer);
+        ReleaseBuffer(&hExt2->chunkPool, buffer, chunkSize);
+        return success;
+    }
+    BOOL success = TRUE;
+    while (success) {
+        LockMutex(&pipeline.lock);
+        while (pipeline.count == pipeline.depth && !pipeline.writerFailed) {
+            WaitCondition(&pipeline.notFull, &pipeline.lock);
+        }
+        success = !pipeline.writerFailed;
+        dext2_pipeline_slot* slot = &pipeline.slots[pipeline.head];
+        UnlockMutex(&pipeline.lock);
+        if (!success) {
+            break;
+        }
+
+        // The slot stays invisible to the writer until it is published
+        if (!ReadNextFileChunk(hExt2, iterator, &bytesLeft, slot->buffer, &slot->source, &slot->length)) {
+            success = FALSE;
+            break;
+        }
+        if (slot->length == 0) {
+            break;
+        }
+        LockMutex(&pipeline.lock);
+        pipeline.head = (pipeline.head + 1) % pipeline.depth;
+        pipeline.count++;
+        SignalCondition(&pipeline.notEmpty);
+        UnlockMutex(&pipeline.lock);
+    }
+
+    LockMutex(&pipeline.lock);
+    pipeline.readerDone = TRUE;
+    pipeline.cancelled = !success;
+    SignalCondition(&pipeline.notEmpty);
+    UnlockMutex(&pipeline.lock);
+    JoinThread(writer);
+    success = success && !pipeline.writerFailed;
+
+    DestroyCondition(&pipeline.notFull);
+    DestroyCondition(&pipeline.notEmpty);
+    DestroyMutex(&pipeline.lock);
+    for (DWORD i = 0; i < depth; i++) {
+        ReleaseBuffer(&hExt2->chunkPool, pipeline.slots[i].buffer, chunkSize);
+    }
+    free(pipeline.slots);
+    return success;
+}
+
+BOOL _ReadDataFromInodeInner(dext2_fs* hExt2, HANDLE hWinFile, ext2_inode* pInode) {
+    dext2_block_map_iterator iterator;
+    if (!InitBlockMapIterator(hExt2, pInode, &iterator)) {
+        return FALSE;
+    }
+    // Files are mostly laid out contiguously, so runs of the block map
+    // become large sequential reads, capped by the maximum I/O size
+    iterator.maxRunLength = hExt2->maxIoSize / dwBlockSize(hExt2);
+    if (iterator.maxRunLength == 0) {
+        iterator.maxRunLength = 1;
+    }
+    iterator.prefetch = TRUE;
+    DWORD chunkSize = iterator.maxRunLength * dwBlockSize(hExt2);
+    ULONGLONG bytesLeft = GetInodeFileSize(pInode);
+
+    // A file that fits in one chunk has nothing to overlap
+    if (hExt2->pipelineDepth >= 2 && bytesLeft > chunkSize) {
+        ULONGLONG chunkCount = (bytesLeft + chunkSize - 1) / chunkSize;
+        DWORD depth = chunkCount < hExt2->pipelineDepth ? (DWORD) chunkCount : hExt2->pipelineDepth;
+        BOOL success = PipelinedCopy(hExt2, hWinFile, &iterator, bytesLeft, chunkSize, depth);
+        FreeBlockMapIterator(&iterator);
+        return success;
+    }
+
+    PBYTE buffer = AcquireBuffer(&hExt2->chunkPool, chunkSize);
+    if (buffer == NULL) {
+        FreeBlockMapIterator(&iterator);
+        return FALSE;
+    }
+    BOOL success = SerialCopy(hExt2, hWinFile, &iterator, bytesLeft, buffer);
+    FreeBlockMapIterator(&iterator);
+    ReleaseBuffer(&hExt2->chunkPool, buffer, chunkSize);
+    return success;
+}
+
+BOOL ReadDataFromInode(dext2_fs* hExt2, HANDLE hWinFile, ext2_inode* pInode) {
+    ULONGLONG started = StartLatency();
+    dext2_trace_span span = BeginTraceSpan(hExt2->trace, "ReadDataFromInode");
+    BOOL success = _ReadDataFromInodeInner(hExt2, hWinFile, pInode);
+    EndTraceSpan(&span, success ? GetInodeFileSize(pInode) : 0);
+    RecordLatency(&hExt2->stats, DEXT2_LATENCY_READ_DATA, started);
+    return success;
+}
+
+DEXT2_ERROR CopyFileToWindows(dext2_fs* hExt2, LPCSTR ext2FilePath, LPCSTR winFilePath) {
+    DEXT2_ERROR status;
+    ext2_inode inode;
+    status = ResolvePath(hExt2, ext2FilePath, &inode);
+    if (status != DEXT2_NO_ERROR) {
+        return status;
+    }
+
+    HANDLE hWinFile = CreateFileA(
+        winFilePath, 
+        GENERIC_WRITE, 
+        0, // no sharing
+        NULL,
+        CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL
+    );
+
+    if (hWinFile == INVALID_HANDLE_VALUE) {
+        return DEXT2_ERROR_INTERNAL;
+    }
+
+    if (!ReadDataFromInode(hExt2, hWinFile, &inode)) {
+        CloseHandle(hWinFile);
+        return DEXT2_ERROR_INTERNAL;
+    }
+
+    if (!CloseHandle(hWinFile)) {
+        return DEXT2_ERROR_INTERNAL;
+    }
+
+    return DEXT2_NO_ERROR;
+}
+
+DEXT2_ERROR CopyInodeDataToWindows(dext2_fs* hExt2, ext2_inode* pInode, LPCSTR winFilePath) {
+    HANDLE hWinFile = CreateFileA(
+        winFilePath, 
+        GENERIC_WRITE, 
+        0, // no sharing
+        NULL,
+        CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL
+    );
+
+    if (hWinFile == INVALID_HANDLE_VALUE) {
+        return DEXT2_ERROR_INTERNAL;
+    }
+
+    if (!ReadDataFromInode(hExt2, hWinFile, pInode)) {
+        CloseHandle(hWinFile);
+        return DEXT2_ERROR_INTERNAL;
+    }
+
+    if (!CloseHandle(hWinFile)) {
+        return DEXT2_ERROR_INTERNAL;
+    }
+
+    return DEXT2_NO_ERROR;
+}
+
+/***********************************************************
+* RANGED READS
+*
+* ReadInodeRange maps only the file blocks it needs, going
+* straight to the indirect blocks that cover the range.
+* The runs it finds are remembered per inode, so reading
+* the same file again skips the mapping altogether
+************************************************************/
+
+#define DEXT2_RUN_CACHE_INODES 64
+#define DEXT2_RUN_CACHE_MAX_RUNS 4096
+
+typedef struct {
+    DWORD inodeNumber;             // 0 marks a free slot
+    ULONGLONG lastUse;
+    dext2_block_run* runs;         // Sorted by logicalBlock, never overlapping
+    DWORD runCount;
+    DWORD runCapacity;
+} dext2_run_map;
+
+struct dext2_run_cache {
+    dext2_run_map maps[DEXT2_RUN_CACHE_INODES];
+    ULONGLONG clock;
+    dext2_mutex lock;
+};
+
+void ResetRunCache(dext2_run_cache* cache) {
+    LockMutex(&cache->lock);
+    for (DWORD i = 0; i < DEXT2_RUN_CACHE_INODES; i++) {
+        free(cache->maps[i].runs);
+        memset(&cache->maps[i], 0, sizeof(dext2_run_map));
+    }
+    UnlockMutex(&cache->lock);
+}
+
+dext2_run_cache* CreateRunCache(void) {
+    dext2_run_cache* cache = (dext2_run_cache*) calloc(1, sizeof(dext2_run_cache));
+    if (cache == NULL) {
+        return NULL;
+    }
+    InitMutex(&cache->lock);
+    return cache;
+}
+
+void FreeRunCache(dext2_run_cache* cache) {
+    if (cache == NULL) {
+        return;
+    }
+    ResetRunCache(cache);
+    DestroyMutex(&cache->lock);
+    free(cache);
+}
+
+// Caller holds cache->lock
+dext2_run_map* FindRunMap(dext2_run_cache* cache, DWORD inodeNumber, BOOL create) {
+    dext2_run_map* victim = &cache->maps[0];
+    for (DWORD i = 0; i < DEXT2_RUN_CACHE_INODES; i++) {
+        if (cache->maps[i].inodeNumber == inodeNumber) {
+            cache->maps[i].lastUse = ++cache->clock;
+            return &cache->maps[i];
+        }
+        if (cache->maps[i].lastUse < victim->lastUse) {
+            victim = &cache->maps[i];
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    victim->inodeNumber = inodeNumber;
+    victim->lastUse = ++cache->clock;
+    victim->runCount = 0;
+    return victim;
+}
+
+// Index of the first run ending after logicalBlock
+DWORD RunMapSearch(dext2_run_map* map, ULONGLONG logicalBlock) {
+    DWORD low = 0;
+    DWORD high = map->runCount;
+    while (low < high) {
+        DWORD middle = low + (high - low) / 2;
+        if (map->runs[middle].logicalBlock + map->runs[middle].length <= logicalBlock) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+BOOL RunsAreAdjacent(dext2_block_run* left, dext2_block_run* right) {
+    if (left->logicalBlock + left->length != right->logicalBlock) {
+        return FALSE;
+    }
+    if (left->physicalBlock == 0 || right->physicalBlock == 0) {
+        return left->physicalBlock == right->physicalBlock;
+    }
+    return left->physicalBlock + left->length == right->physicalBlock;
+}
+
+// Caller holds cache->lock. The run must not overlap stored ones
+void RunMapInsert(dext2_run_map* map, dext2_block_run* run) {
+    DWORD index = RunMapSearch(map, run->logicalBlock);
+    if (index > 0 && RunsAreAdjacent(&map->runs[index - 1], run)) {
+        map->runs[index - 1].length += run->length;
+        if (index < map->runCount && RunsAreAdjacent(&map->runs[index - 1], &map->runs[index])) {
+            map->runs[index - 1].length += map->runs[index].length;
+            memmove(&map->runs[index], &map->runs[index + 1], (map->runCount - index - 1) * sizeof(dext2_block_run));
+            map->runCount--;
+        }
+        return;
+    }
+    if (index < map->runCount && RunsAreAdjacent(run, &map->runs[index])) {
+        map->runs[index].logicalBlock = run->logicalBlock;
+        map->runs[index].physicalBlock = run->physicalBlock;
+        map->runs[index].length += run->length;
+        return;
+    }
+
+    if (map->runCount >= DEXT2_RUN_CACHE_MAX_RUNS) {
+        // Badly fragmented file, start over rather than grow without bound
+        map->runCount = 0;
+        index = 0;
+    }
+    if (map->runCount == map->runCapacity) {
+        DWORD newCapacity = map->runCapacity == 0 ? 16 : map->runCapacity * 2;
+        dext2_block_run* temp = (dext2_block_run*) realloc(map->runs, newCapacity * sizeof(dext2_block_run));
+        if (temp == NULL) {
+            return;
+        }
+        map->runs = temp;
+        map->runCapacity = newCapacity;
+    }
+    memmove(&map->runs[index + 1], &map->runs[index], (map->runCount - index) * sizeof(dext2_block_run));
+    map->runs[index] = *run;
+    map->runCount++;
+}
+
+BOOL LookupCachedRun(dext2_run_cache* cache, DWORD inodeNumber, ULONGLONG logicalBlock, OUT dext2_block_run* run) {
+    BOOL found = FALSE;
+    LockMutex(&cache->lock);
+    dext2_run_map* map = FindRunMap(cache, inodeNumber, FALSE);
+    if (map != NULL) {
+        DWORD index = RunMapSearch(map, logicalBlock);
+        if (index < map->runCount && map->runs[index].logicalBlock <= logicalBlock) {
+            *run = map->runs[index];
+            found = TRUE;
+        }
+    }
+    UnlockMutex(&cache->lock);
+    return found;
+}
+
+void StoreCachedRun(dext2_run_cache* cache, DWORD inodeNumber, dext2_block_run* run) {
+    LockMutex(&cache->lock);
+    dext2_run_map* map = FindRunMap(cache, inodeNumber, TRUE);
+    RunMapInsert(map, run);
+    UnlockMutex(&cache->lock);
+}
+
+// Reads up to length bytes starting at offset of the file. Reading past
+// the end of file is not an error, *bytesRead tells how much was read
+DEXT2_ERROR ReadInodeRange(dext2_fs* hExt2, DWORD inodeNumber, ULONGLONG offset, DWORD length, OUT LPVOID buffer, OUT PDWORD bytesRead) {
+    *bytesRead = 0;
+    ext2_inode inode;
+    if (!GetInodeByNumber(hExt2, inodeNumber, &inode)) {
+        return DEXT2_ERROR_READING_DISK;
+    }
+    ULONGLONG fileSize = GetInodeFileSize(&inode);
+    if (offset >= fileSize || length == 0) {
+        return DEXT2_NO_ERROR;
+    }
+    if (length > fileSize - offset) {
+        length = (DWORD) (fileSize - offset);
+    }
+
+    ULONGLONG endOffset = offset + length;
+    ULONGLONG lastBlock = (endOffset - 1) / dwBlockSize(hExt2);
+    ULONGLONG position = offset;
+    PBYTE output = (PBYTE) buffer;
+    dext2_block_map_iterator iterator;
+    BOOL iteratorReady = FALSE;
+
+    while (position < endOffset) {
+        ULONGLONG logicalBlock = position / dwBlockSize(hExt2);
+        dext2_block_run run;
+        if (!LookupCachedRun(hExt2->runCache, inodeNumber, logicalBlock, &run)) {
+            if (!iteratorReady) {
+                if (!InitBlockMapIterator(hExt2, &inode, &iterator)) {
+                    return DEXT2_ERROR_INTERNAL;
+                }
+                iteratorReady = TRUE;
+            }
+            // Map no further than the range, so untouched indirect blocks stay unread
+            iterator.nextLogicalBlock = logicalBlock;
+            iterator.maxRunLength = (DWORD) (lastBlock - logicalBlock + 1);
+            if (!NextBlockRun(&iterator, &run) || run.length == 0) {
+                FreeBlockMapIterator(&iterator);
+                return DEXT2_ERROR_READING_DISK;
+            }
+            StoreCachedRun(hExt2->runCache, inodeNumber, &run);
+        }
+
+        ULONGLONG runEnd = (run.logicalBlock + run.length) * dwBlockSize(hExt2);
+        DWORD chunk = (DWORD) ((runEnd < endOffset ? runEnd : endOffset) - position);
+        if (run.physicalBlock == 0) {
+            memset(output, 0, chunk);
+        } else {
+            LONGLONG diskLocation = ((LONGLONG) run.physicalBlock + (LONGLONG) (logicalBlock - run.logicalBlock)) * llBlockSize(hExt2)
+                                    + (LONGLONG) (position % dwBlockSize(hExt2));
+            if (!ReadBytes(hExt2, hExt2->partitionStart + diskLocation, chunk, output)) {
+                if (iteratorReady) FreeBlockMapIterator(&iterator);
+                return DEXT2_ERROR_READING_DISK;
+            }
+        }
+        output += chunk;
+        position += chunk;
+        *bytesRead += chunk;
+    }
+
+    if (iteratorReady) {
+        FreeBlockMapIterator(&iterator);
+    }
+    return DEXT2_NO_ERROR;
+}
+
+/***********************************************************
+* TREE EXTRACTION
+*
+* Copies a whole directory tree to the host with a pool of
+* worker threads. Each worker owns a deque of tasks: it pushes
+* the entries of the directories it expands and pops them
+* from the same end, so it works depth first on its part of
+* the tree. Idle workers steal from the other end of someone
+* else's deque, which takes the oldest and usually biggest
+* subtrees. A file or directory that fails is counted and
+* skipped, the rest of the tree is still copied
+************************************************************/
+
+#ifdef _WIN32
+#define DEXT2_HOST_PATH_SEPARATOR '\\'
+#else
+#define DEXT2_HOST_PATH_SEPARATOR '/'
+#endif // _WIN32
+
+typedef struct {
+    ULONGLONG files;
+    ULONGLONG directories;
+    ULONGLONG bytes;
+    ULONGLONG skipped;             // Neither a file nor a directory, e.g. symlinks, or a name the host cannot hold
+    ULONGLONG failed;
+} dext2_extract_stats;
+
+typedef struct {
+    DWORD inodeNumber;
+    LPSTR hostPath;                // Owned by the task
+} dext2_extract_task;
+
+typedef struct {
+    dext2_extract_task* tasks;     // Ring buffer
+    DWORD capacity;
+    DWORD head;
+    DWORD count;
+    dext2_mutex lock;
+} dext2_task_deque;
+
+typedef struct dext2_extract_job dext2_extract_job;
+
+typedef struct {
+    dext2_extract_job* job;
+    DWORD index;
+    dext2_extract_stats stats;
+} dext2_extract_worker;
+
+struct dext2_extract_job {
+    dext2_fs* hExt2;
+    DWORD workerCount;
+    dext2_task_deque* deques;
+    dext2_extract_worker* workers;
+    dext2_mutex lock;
+    dext2_cond wake;
+    ULONGLONG pending;             // Queued or running tasks
+    ULONGLONG generation;          // Bumped on every push, to not miss a wakeup
+    DWORD sleeping;
+};
+
+BOOL PushTask(dext2_task_deque* deque, dext2_extract_task* task) {
+    LockMutex(&deque->lock);
+    if (deque->count == deque->capacity) {
+        DWORD newCapacity = deque->capacity == 0 ? 64 : deque->capacity * 2;
+        dext2_extract_task* tasks = (dext2_extract_task*) malloc(newCapacity * sizeof(dext2_extract_task));
+        if (tasks == NULL) {
+            UnlockMutex(&deque->lock);
+            return FALSE;
+        }
+        for (DWORD i = 0; i < deque->count; i++) {
+            tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->capacity = newCapacity;
+        deque->head = 0;
+    }
+    deque->tasks[(deque->head + deque->count) % deque->capacity] = *task;
+    deque->count++;
+    UnlockMutex(&deque->lock);
+    return TRUE;
+}
+
+// The owner takes the newest task
+BOOL PopTask(dext2_task_deque* deque, OUT dext2_extract_task* task) {
+    BOOL found = FALSE;
+    LockMutex(&deque->lock);
+    if (deque->count != 0) {
+        deque->count--;
+        *task = deque->tasks[(deque->head + deque->count) % deque->capacity];
+        found = TRUE;
+    }
+    UnlockMutex(&deque->lock);
+    return found;
+}
+
+// Thieves take the oldest one
+BOOL StealTask(dext2_task_deque* deque, OUT dext2_extract_task* task) {
+    BOOL found = FALSE;
+    LockMutex(&deque->lock);
+    if (deque->count != 0) {
+        *task = deque->tasks[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+        deque->count--;
+        found = TRUE;
+    }
+    UnlockMutex(&deque->lock);
+    return found;
+}
+
+BOOL SubmitTask(dext2_extract_job* job, DWORD workerIndex, DWORD inodeNumber, LPSTR hostPath) {
+    dext2_extract_task task = { inodeNumber, hostPath };
+    LockMutex(&job->lock);
+    job->pending++;
+    UnlockMutex(&job->lock);
+    if (!PushTask(&job->deques[workerIndex], &task)) {
+        LockMutex(&job->lock);
+        job->pending--;
+        UnlockMutex(&job->lock);
+        return FALSE;
+    }
+    LockMutex(&job->lock);
+    job->generation++;
+    if (job->sleeping != 0) {
+        SignalCondition(&job->wake);
+    }
+    UnlockMutex(&job->lock);
+    return TRUE;
+}
+
+// An entry name becomes one host path component. "." and "..", and
+// anything holding a separator or, on Windows, a drive or stream colon
+// or another reserved character, could leave the output directory or
+// name a different file, so such entries are not copied
+BOOL IsSafeHostName(LPCSTR name, DWORD nameLength) {
+    if (nameLength == 0 || (nameLength == 1 && name[0] == '.') || (nameLength == 2 && name[0] == '.' && name[1] == '.')) {
+        return FALSE;
+    }
+    for (DWORD i = 0; i < nameLength; i++) {
+        CHAR c = name[i];
+        if (c == '/' || c == '\0') {
+            return FALSE;
+        }
+#ifdef _WIN32
+        if (c == '\\' || c == ':' || c == '<' || c == '>' || c == '"' || c == '|' || c == '?' || c == '*' || (BYTE) c < 32) {
+            return FALSE;
+        }
+#endif // _WIN32
+    }
+    return TRUE;
+}
+
+LPSTR JoinHostPath(LPCSTR directory, LPCSTR name, DWORD nameLength) {
+    size_t directoryLength = strlen(directory);
+    LPSTR path = (LPSTR) malloc(directoryLength + nameLength + 2);
+    if (path == NULL) {
+        return NULL;
+    }
+    memcpy(path, directory, directoryLength);
+    path[directoryLength] = DEXT2_HOST_PATH_SEPARATOR;
+    memcpy(path + directoryLength + 1, name, nameLength);
+    path[directoryLength + 1 + nameLength] = '\0';
+    return path;
+}
+
+BOOL CreateHostDirectory(LPCSTR path) {
+    if (CreateDirectoryA(path, NULL)) {
+        return TRUE;
+    }
+#ifdef _WIN32
+    return GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+    return errno == EEXIST;
+#endif // _WIN32
+}
+
+typedef struct {
+    dext2_extract_worker* worker;
+    LPCSTR hostDirectory;
+} dext2_expand_context;
+
+BOOL QueueDirectoryChild(const ext2_dir_entry* de, LPVOID context) {
+    dext2_expand_context* expand = (dext2_expand_context*) context;
+    DWORD nameLength = de->name_len;
+    if ((nameLength == 1 && de->name[0] == '.') || (nameLength == 2 && de->name[0] == '.' && de->name[1] == '.')) {
+        return TRUE;
+    }
+    if (!IsSafeHostName(de->name, nameLength)) {
+        DEXT2_LOG_DEBUG("Skipping %.*s, not a valid host name", (int) nameLength, de->name);
+        expand->worker->stats.skipped++;
+        return TRUE;
+    }
+    LPSTR hostPath = JoinHostPath(expand->hostDirectory, de->name, nameLength);
+    if (hostPath == NULL || !SubmitTask(expand->worker->job, expand->worker->index, de->inode, hostPath)) {
+        free(hostPath);
+        expand->worker->stats.failed++;
+    }
+    return TRUE;
+}
+
+void RunExtractTask(dext2_extract_worker* worker, dext2_extract_task* task) {
+    dext2_fs* hExt2 = worker->job->hExt2;
+    ext2_inode inode;
+    if (!GetInodeByNumber(hExt2, task->inodeNumber, &inode)) {
+        DEXT2_LOG_DEBUG("Could not read inode %u for %s", task->inodeNumber, task->hostPath);
+        worker->stats.failed++;
+        return;
+    }
+    if (inode.i_mode & DEXT2_INODE_IS_DIR) {
+        if (!CreateHostDirectory(task->hostPath)) {
+            DEXT2_LOG_DEBUG("Could not create %s", task->hostPath);
+            worker->stats.failed++;
+            return;
+        }
+        dext2_expand_context expand = { worker, task->hostPath };
+        if (WalkDirectory(hExt2, &inode, QueueDirectoryChild, &expand) != DEXT2_NO_ERROR) {
+            // Entries queued before the error are still copied
+            worker->stats.failed++;
+            return;
+        }
+        worker->stats.directories++;
+    } else if ((inode.i_mode & 0xF000) == DEXT2_INODE_IS_FILE) {
+        if (CopyInodeDataToWindows(hExt2, &inode, task->hostPath) != DEXT2_NO_ERROR) {
+            DEXT2_LOG_DEBUG("Could not copy %s", task->hostPath);
+            worker->stats.failed++;
+            return;
+        }
+        worker->stats.files++;
+        worker->stats.bytes += GetInodeFileSize(&inode);
+    } else {
+        worker->stats.skipped++;
+    }
+}
+
+BOOL FindTask(dext2_extract_worker* worker, OUT dext2_extract_task* task) {
+    dext2_extract_job* job = worker->job;
+    if (PopTask(&job->deques[worker->index], task)) {
+        return TRUE;
+    }
+    for (DWORD i = 1; i < job->workerCount; i++) {
+        if (StealTask(&job->deques[(worker->index + i) % job->workerCount], task)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+DEXT2_THREAD_PROC(ExtractWorker) {
+    dext2_extract_worker* worker = (dext2_extract_worker*) parameter;
+    dext2_extract_job* job = worker->job;
+    while (TRUE) {
+        LockMutex(&job->lock);
+        ULONGLONG generation = job->generation;
+        UnlockMutex(&job->lock);
+
+        dext2_extract_task task;
+        if (FindTask(worker, &task)) {
+            RunExtractTask(worker, &task);
+            free(task.hostPath);
+            LockMutex(&job->lock);
+            job->pending--;
+            if (job->pending == 0) {
+                BroadcastCondition(&job->wake);
+            }
+            UnlockMutex(&job->lock);
+            continue;
+        }
+
+        LockMutex(&job->lock);
+        if (job->pending == 0) {
+            UnlockMutex(&job->lock);
+            break;
+        }
+        // Someone is still expanding a directory, wait for a push or the end
+        if (job->generation == generation) {
+            job->sleeping++;
+            WaitCondition(&job->wake, &job->lock);
+            job->sleeping--;
+        }
+        UnlockMutex(&job->lock);
+    }
+    return 0;
+}
+
+// Copies the file or directory tree with the given inode number to hostPath.
+// threadCount 0 uses one thread per processor. Failures of single entries
+// do not stop the job, they are counted in stats->failed
+DEXT2_ERROR ExtractTreeFromInode(dext2_fs* hExt2, DWORD inodeNumber, LPCSTR hostPath, DWORD threadCount, OUT dext2_extract_stats* stats) {
+    memset(stats, 0, sizeof(dext2_extract_stats));
+    if (threadCount == 0) {
+        threadCount = GetProcessorCount();
+    }
+
+    dext2_extract_job job;
+    memset(&job, 0, sizeof(job));
+    job.hExt2 = hExt2;
+    job.workerCount = threadCount;
+    job.deques = (dext2_task_deque*) calloc(threadCount, sizeof(dext2_task_deque));
+    job.workers = (dext2_extract_worker*) calloc(threadCount, sizeof(dext2_extract_worker));
+    dext2_thread* threads = (dext2_thread*) calloc(threadCount, sizeof(dext2_thread));
+    LPSTR rootPath = (LPSTR) malloc(strlen(hostPath) + 1);
+    if (job.deques == NULL || job.workers == NULL || threads == NULL || rootPath == NULL) {
+        free(job.deques);
+        free(job.workers);
+        free(threads);
+        free(rootPath);
+        return DEXT2_ERROR_INTERNAL;
+    }
+    strcpy(rootPath, hostPath);
+    // Every worker may hold a full copy pipeline of chunk buffers. Keeping
+    // that many idle saves reallocating them file after file
+    ReserveBufferPool(&hExt2->chunkPool, threadCount * (hExt2->pipelineDepth > 1 ? hExt2->pipelineDepth : 1));
+    InitMutex(&job.lock);
+    InitCondition(&job.wake);
+    for (DWORD i = 0; i < threadCount; i++) {
+        InitMutex(&job.deques[i].lock);
+        job.workers[i].job = &job;
+        job.workers[i].index = i;
+    }
+
+    dext2_trace_span span = BeginTraceSpan(hExt2->trace, "ExtractTree");
+    DEXT2_ERROR status = DEXT2_NO_ERROR;
+    if (!SubmitTask(&job, 0, inodeNumber, rootPath)) {
+        free(rootPath);
+        status = DEXT2_ERROR_INTERNAL;
+    }
+    // The calling thread is worker 0
+    DWORD started = 1;
+    while (status == DEXT2_NO_ERROR && started < threadCount && StartThread(&threads[started], ExtractWorker, &job.workers[started])) {
+        started++;
+    }
+    if (status == DEXT2_NO_ERROR) {
+        ExtractWorker(&job.workers[0]);
+    }
+    for (DWORD i = 1; i < started; i++) {
+        JoinThread(threads[i]);
+    }
+
+    for (DWORD i = 0; i < threadCount; i++) {
+        stats->files += job.workers[i].stats.files;
+        stats->directories += job.workers[i].stats.directories;
+        stats->bytes += job.workers[i].stats.bytes;
+        stats->skipped += job.workers[i].stats.skipped;
+        stats->failed += job.workers[i].stats.failed;
+        free(job.deques[i].tasks);
+        DestroyMutex(&job.deques[i].lock);
+    }
+    DestroyCondition(&job.wake);
+    DestroyMutex(&job.lock);
+    free(job.deques);
+    free(job.workers);
+    free(threads);
+    EndTraceSpan(&span, stats->bytes);
+    return status;
+}
+
+DEXT2_ERROR ExtractTree(dext2_fs* hExt2, LPCSTR ext2Path, LPCSTR hostPath, DWORD threadCount, OUT dext2_extract_stats* stats) {
+    DWORD inodeNumber;
+    ext2_inode inode;
+    DEXT2_ERROR status = ResolvePathEx(hExt2, ext2Path, &inodeNumber, &inode);
+    if (status != DEXT2_NO_ERROR) {
+        memset(stats, 0, sizeof(dext2_extract_stats));
+        return status;
+    }
+    return ExtractTreeFromInode(hExt2, inodeNumber, hostPath, threadCount, stats);
+}
+
+/***********************************************************
+* INODE SCAN
+*
+* Visits every inode in use, in inode number order within a
+* group, without touching directories. Each group's inode
+* bitmap tells which slots are used; the inode table is read
+* in large sequential chunks and table blocks holding no used
+* inode are not read at all. Groups are shared out between
+* worker threads, so the callback runs concurrently and must
+* be thread safe
+************************************************************/
+
+// Return FALSE to stop the scan
+typedef BOOL (*DEXT2_INODE_SCAN_CALLBACK)(DWORD inodeNumber, const ext2_inode* pInode, LPVOID context);
+
+typedef struct {
+    dext2_fs* hExt2;
+    DEXT2_INODE_SCAN_CALLBACK callback;
+    LPVOID context;
+    DWORD nextGroup;
+    volatile ULONGLONG stopped;    // Checked before every callback, set once
+    DEXT2_ERROR status;
+    dext2_mutex lock;
+} dext2_inode_scan;
+
+BOOL IsInodeUsed(const BYTE* bitmap, DWORD index) {
+    return (bitmap[index / 8] >> (index % 8)) & 1;
+}
+
+// Reports the used inodes of the table blocks [firstBlock, firstBlock + blockCount)
+// of one group, table pointing at the first of them. FALSE once the
+// callback asked to stop
+BOOL ScanInodeTableBlocks(dext2_inode_scan* scan, DWORD group, const BYTE* bitmap, DWORD firstBlock, DWORD blockCount, const BYTE* table) {
+    dext2_fs* hExt2 = scan->hExt2;
+    DWORD inodesPerGroup = hExt2->superBlock.s_inodes_per_group;
+    DWORD inodesPerBlock = dwBlockSize(hExt2) / hExt2->inodeSize;
+    DWORD first = firstBlock * inodesPerBlock;
+    DWORD last = (firstBlock + blockCount) * inodesPerBlock;
+    if (last > inodesPerGroup) {
+        last = inodesPerGroup;
+    }
+    for (DWORD index = first; index < last; index++) {
+        if (!IsInodeUsed(bitmap, index)) {
+            continue;
+        }
+        // Another worker's callback may have asked to stop meanwhile
+        if (AtomicLoad(&scan->stopped)) {
+            return FALSE;
+        }
+        ext2_inode inode;
+        memcpy(&inode, table + (size_t) (index - first) * hExt2->inodeSize, sizeof(ext2_inode));
+        if (!scan->callback(group * inodesPerGroup + index + 1, &inode, scan->context)) {
+            AtomicStore(&scan->stopped, TRUE);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// Table blocks holding at least one used inode are read together, up to
+// the maximum I/O size per batch. Runs of them become one request each
+DEXT2_ERROR ScanInodeGroup(dext2_inode_scan* scan, DWORD group, PBYTE buffer, DWORD bufferBlocks, PBYTE bitmap) {
+    dext2_fs* hExt2 = scan->hExt2;
+    ext2_group_desc* descriptor = GetGroupDescriptor(hExt2, group);
+    DWORD inodesPerGroup = hExt2->superBlock.s_inodes_per_group;
+    if (descriptor->bg_free_inodes_count >= inodesPerGroup || IsGroupUninitialized(hExt2, descriptor, DEXT2_BG_INODE_UNINIT)) {
+        return DEXT2_NO_ERROR;
+    }
+    if (!ReadBytesDirect(hExt2, hExt2->partitionStart + (LONGLONG) descriptor->bg_inode_bitmap * llBlockSize(hExt2),
+                         dwBlockSize(hExt2), bitmap)) {
+        return DEXT2_ERROR_READING_DISK;
+    }
+
+    DWORD inodesPerBlock = dwBlockSize(hExt2) / hExt2->inodeSize;
+    DWORD tableBlocks = (inodesPerGroup + inodesPerBlock - 1) / inodesPerBlock;
+    LONGLONG tableLocation = hExt2->partitionStart + (LONGLONG) descriptor->bg_inode_table * llBlockSize(hExt2);
+    const BYTE* mappedTable = GetMappedBytes(hExt2->device, tableLocation, tableBlocks * dwBlockSize(hExt2));
+    if (mappedTable != NULL) {
+        AdviseDeviceRange(hExt2->device, tableLocation, tableBlocks * dwBlockSize(hExt2), DEXT2_ADVICE_SEQUENTIAL);
+        ScanInodeTableBlocks(scan, group, bitmap, 0, tableBlocks, mappedTable);
+        return DEXT2_NO_ERROR;
+    }
+
+    dext2_io_request requests[DEXT2_CHUNK_MAX_RUNS];
+    DWORD block = 0;
+    while (block < tableBlocks) {
+        // One chunk starts at the next block with a used inode
+        DWORD chunkStart = tableBlocks;
+        DWORD requestCount = 0;
+        DWORD chunkEnd = block;
+        BOOL inRun = FALSE;
+        for (; chunkEnd < tableBlocks; chunkEnd++) {
+            if (chunkStart != tableBlocks && chunkEnd - chunkStart >= bufferBlocks) {
+                break;
+            }
+            BOOL used = FALSE;
+            for (DWORD index = chunkEnd * inodesPerBlock; index < (chunkEnd + 1) * inodesPerBlock && index < inodesPerGroup; index++) {
+                if (IsInodeUsed(bitmap, index)) {
+                    used = TRUE;
+                    break;
+                }
+            }
+            if (!used) {
+                inRun = FALSE;
+                continue;
+            }
+            if (chunkStart == tableBlocks) {
+                chunkStart = chunkEnd;
+            }
+            if (inRun) {
+                requests[requestCount - 1].length += dwBlockSize(hExt2);
+                continue;
+            }
+            if (requestCount == DEXT2_CHUNK_MAX_RUNS) {
+                break;
+            }
+            requests[requestCount].offset = tableLocation + (LONGLONG) chunkEnd * llBlockSize(hExt2);
+            requests[requestCount].length = dwBlockSize(hExt2);
+            requests[requestCount].buffer = buffer + (size_t) (chunkEnd - chunkStart) * dwBlockSize(hExt2);
+            requestCount++;
+            inRun = TRUE;
+        }
+        if (requestCount == 0) {
+            break;
+        }
+        if (!ReadBatchDirect(hExt2, requests, requestCount)) {
+            return DEXT2_ERROR_READING_DISK;
+        }
+        // Blocks between the runs hold no used inode and are never looked at
+        if (!ScanInodeTableBlocks(scan, group, bitmap, chunkStart, chunkEnd - chunkStart, buffer)) {
+            break;
+        }
+        block = chunkEnd;
+    }
+    return DEXT2_NO_ERROR;
+}
+
+DEXT2_THREAD_PROC(InodeScanWorker) {
+    dext2_inode_scan* scan = (dext2_inode_scan*) parameter;
+    dext2_fs* hExt2 = scan->hExt2;
+    DWORD bufferBlocks = hExt2->maxIoSize / dwBlockSize(hExt2);
+    if (bufferBlocks == 0) {
+        bufferBlocks = 1;
+    }
+    DWORD bufferSize = bufferBlocks * dwBlockSize(hExt2);
+    PBYTE buffer = AcquireBuffer(&hExt2->chunkPool, bufferSize);
+    PBYTE bitmap = AcquireBlockBuffer(hExt2);
+    DEXT2_ERROR status = buffer == NULL || bitmap == NULL ? DEXT2_ERROR_INTERNAL : DEXT2_NO_ERROR;
+    while (status == DEXT2_NO_ERROR) {
+        LockMutex(&scan->lock);
+        DWORD group = scan->nextGroup;
+        scan->nextGroup++;
+        UnlockMutex(&scan->lock);
+        if (AtomicLoad(&scan->stopped) || group >= hExt2->groupCount) {
+            break;
+        }
+        status = ScanInodeGroup(scan, group, buffer, bufferBlocks, bitmap);
+    }
+    if (status != DEXT2_NO_ERROR) {
+        LockMutex(&scan->lock);
+        if (scan->status == DEXT2_NO_ERROR) {
+            scan->status = status;
+        }
+        AtomicStore(&scan->stopped, TRUE);
+        UnlockMutex(&scan->lock);
+    }
+    ReleaseBuffer(&hExt2->chunkPool, buffer, bufferSize);
+    ReleaseBlockBuffer(hExt2, bitmap);
+    return 0;
+}
+
+// Calls callback for every inode marked used in the inode bitmaps.
+// threadCount 0 uses one thread per processor. Returns early, without an
+// error, when the callback returns FALSE
+DEXT2_ERROR ScanInodes(dext2_fs* hExt2, DWORD threadCount, DEXT2_INODE_SCAN_CALLBACK callback, LPVOID context) {
+    if (threadCount == 0) {
+        threadCount = GetProcessorCount();
+    }
+    if (threadCount > hExt2->groupCount) {
+        threadCount = hExt2->groupCount;
+    }
+    if (threadCount == 0) {
+        return DEXT2_NO_ERROR;
+    }
+
+    dext2_inode_scan scan;
+    memset(&scan, 0, sizeof(scan));
+    scan.hExt2 = hExt2;
+    scan.callback = callback;
+    scan.context = context;
+    scan.status = DEXT2_NO_ERROR;
+    dext2_thread* threads = (dext2_thread*) calloc(threadCount, sizeof(dext2_thread));
+    if (threads == NULL) {
+        return DEXT2_ERROR_INTERNAL;
+    }
+    InitMutex(&scan.lock);
+
+    // The calling thread is worker 0
+    dext2_trace_span span = BeginTraceSpan(hExt2->trace, "ScanInodes");
+    DWORD started = 1;
+    while (started < threadCount && StartThread(&threads[started], InodeScanWorker, &scan)) {
+        started++;
+    }
+    InodeScanWorker(&scan);
+    for (DWORD i = 1; i < started; i++) {
+        JoinThread(threads[i]);
+    }
+    EndTraceSpan(&span, 0);
+
+    DestroyMutex(&scan.lock);
+    free(threads);
+    return scan.status;
+}
+
+/***********************************************************
+* SPARSE IMAGE
+*
+* Copies the partition into a host file block for block, but
+* only the blocks the block bitmaps mark in use. The output is
+* created at the full partition size and never written to for
+* free blocks, so on hosts with sparse files those stay holes
+* and imaging time follows used space, not partition size.
+* Groups are shared out between worker threads like the inode
+* scan, each reading its used runs in large batches
+************************************************************/
+
+typedef struct {
+    ULONGLONG totalBlocks;
+    ULONGLONG copiedBlocks;
+    ULONGLONG copiedBytes;
+} dext2_image_stats;
+
+typedef struct {
+    dext2_fs* hExt2;
+    HANDLE hOutput;
+    DWORD nextGroup;
+    BOOL stopped;
+    DEXT2_ERROR status;
+    ULONGLONG copiedBlocks;
+    dext2_mutex lock;
+} dext2_sparse_image;
+
+#ifdef _WIN32
+
+// The handle is synchronous, an explicit offset in the OVERLAPPED keeps
+// concurrent writers from sharing the file pointer
+BOOL WriteHostFileAt(HANDLE hFile, LONGLONG offset, LPCVOID buffer, DWORD nBytes) {
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.Offset = (DWORD) offset;
+    overlapped.OffsetHigh = (DWORD) (offset >> 32);
+    DWORD written = 0;
+    return WriteFile(hFile, buffer, nBytes, &written, &overlapped) && written == nBytes;
+}
+
+// Unwritten ranges of a file only read back as zeros without taking disk
+// space once it is marked sparse. Volumes without sparse files still get
+// a correct, if fully allocated, image
+BOOL SetHostFileSparseSize(HANDLE hFile, LONGLONG size) {
+    DWORD returned;
+    DeviceIoControl(hFile, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &returned, NULL);
+    LARGE_INTEGER end;
+    end.QuadPart = size;
+    return SetFilePointerEx(hFile, end, NULL, FILE_BEGIN) && SetEndOfFile(hFile);
+}
+
+#else
+
+BOOL WriteHostFileAt(HANDLE hFile, LONGLONG offset, LPCVOID buffer, DWORD nBytes) {
+    const BYTE* source = (const BYTE*) buffer;
+    DWORD total = 0;
+    while (total < nBytes) {
+        ssize_t written = pwrite((int) (intptr_t) hFile, source + total, nBytes - total, (off_t) (offset + total));
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return FALSE;
+        }
+        total += (DWORD) written;
+    }
+    return TRUE;
+}
+
+// Extending with ftruncate leaves a hole on every common filesystem
+BOOL SetHostFileSparseSize(HANDLE hFile, LONGLONG size) {
+    return ftruncate((int) (intptr_t) hFile, (off_t) size) == 0;
+}
+
+#endif // _WIN32
+
+BOOL IsBlockAllocated(const BYTE* bitmap, DWORD index) {
+    return (bitmap[index / 8] >> (index % 8)) & 1;
+}
+
+BOOL IsPowerOf(DWORD number, DWORD base) {
+    while (number > 1 && number % base == 0) {
+        number /= base;
+    }
+    return number == 1;
+}
+
+// With sparse_super only groups 0, 1 and powers of 3, 5 and 7 keep a copy
+// of the superblock and the descriptor table
+BOOL GroupHasSuperblock(dext2_fs* hExt2, DWORD group) {
+    if ((hExt2->superBlock.s_feature_ro_compat & DEXT2_FEATURE_RO_COMPAT_SPARSE_SUPER) == 0 || group <= 1) {
         return TRUE;
-    fail:
-        free(indirect);
-        free(doublyIndirect);
-        free(treblyIndirect);
-        return FALSE;
+    }
+    return IsPowerOf(group, 3) || IsPowerOf(group, 5) || IsPowerOf(group, 7);
 }
 
-BOOL GetAvailableDisks(LPSTR** disks, PDWORD* disksNumbers, PDWORD arraySize) {
-    DWORD drives = GetLogicalDrives();
-    if (drives == 0) {
-        DEXT2_LOG_DEBUG("GetLogicalDrives failed with error: %lu\n", GetLastError());
-        return FALSE;
+void MarkGroupBlocks(PBYTE bitmap, DWORD groupStart, DWORD blocksInGroup, DWORD block, DWORD count) {
+    for (DWORD i = 0; i < count; i++) {
+        if (block + i >= groupStart && block + i - groupStart < blocksInGroup) {
+            DWORD index = block + i - groupStart;
+            bitmap[index / 8] |= (BYTE) (1 << (index % 8));
+        }
     }
+}
 
-    DWORD count = 0;
-    for (int i = 0; i < 26; i++) {
-        if (drives & (1 << i)) {
-            count++;
+// A group with BLOCK_UNINIT has no bitmap on disk. Like the kernel, the
+// used blocks are worked out from the layout: the superblock backup with
+// the descriptor table and its reserve, and this group's own bitmaps and
+// inode table. With meta_bg the descriptor blocks are spread differently,
+// so the whole group is taken instead
+void BuildUninitializedBitmap(dext2_fs* hExt2, DWORD group, DWORD groupStart, DWORD blocksInGroup, PBYTE bitmap) {
+    ext2_super_block* superBlock = &hExt2->superBlock;
+    if ((superBlock->s_feature_incompat & DEXT2_FEATURE_INCOMPAT_META_BG) != 0) {
+        memset(bitmap, 0xFF, dwBlockSize(hExt2));
+        return;
+    }
+    memset(bitmap, 0, dwBlockSize(hExt2));
+    if (GroupHasSuperblock(hExt2, group)) {
+        DWORD tableBlocks = (hExt2->groupCount * hExt2->descriptorSize + dwBlockSize(hExt2) - 1) / dwBlockSize(hExt2);
+        MarkGroupBlocks(bitmap, groupStart, blocksInGroup, groupStart, 1 + tableBlocks + superBlock->s_reserved_gdt_blocks);
+    }
+    ext2_group_desc* descriptor = GetGroupDescriptor(hExt2, group);
+    DWORD inodesPerBlock = dwBlockSize(hExt2) / hExt2->inodeSize;
+    MarkGroupBlocks(bitmap, groupStart, blocksInGroup, descriptor->bg_block_bitmap, 1);
+    MarkGroupBlocks(bitmap, groupStart, blocksInGroup, descriptor->bg_inode_bitmap, 1);
+    MarkGroupBlocks(bitmap, groupStart, blocksInGroup, descriptor->bg_inode_table,
+                    (superBlock->s_inodes_per_group + inodesPerBlock - 1) / inodesPerBlock);
+}
+
+// Copies the blocks [block, block + count) to the same offset in the output
+BOOL CopyImageRun(dext2_sparse_image* image, DWORD block, DWORD count, PBYTE buffer) {
+    dext2_fs* hExt2 = image->hExt2;
+    LONGLONG offset = (LONGLONG) block * llBlockSize(hExt2);
+    DWORD length = count * dwBlockSize(hExt2);
+    const BYTE* mapped = GetMappedBytes(hExt2->device, hExt2->partitionStart + offset, length);
+    if (mapped == NULL) {
+        if (!ReadBytesDirect(hExt2, hExt2->partitionStart + offset, length, buffer)) {
+            return FALSE;
         }
+        mapped = buffer;
     }
+    return WriteHostFileAt(image->hOutput, offset, mapped, length);
+}
 
-    if (count == 0) {
-        return FALSE;
+// Runs of used blocks are gathered into one batch until the buffer or the
+// request limit is full, read together and written out run by run
+DEXT2_ERROR ImageGroup(dext2_sparse_image* image, DWORD group, PBYTE buffer, DWORD bufferBlocks, PBYTE bitmap, OUT ULONGLONG* copiedBlocks) {
+    dext2_fs* hExt2 = image->hExt2;
+    ext2_super_block* superBlock = &hExt2->superBlock;
+    ext2_group_desc* descriptor = GetGroupDescriptor(hExt2, group);
+    DWORD groupStart = superBlock->s_first_data_block + group * superBlock->s_blocks_per_group;
+    DWORD blocksInGroup = superBlock->s_blocks_count - groupStart;
+    if (blocksInGroup > superBlock->s_blocks_per_group) {
+        blocksInGroup = superBlock->s_blocks_per_group;
+    }
+    if (IsGroupUninitialized(hExt2, descriptor, DEXT2_BG_BLOCK_UNINIT)) {
+        BuildUninitializedBitmap(hExt2, group, groupStart, blocksInGroup, bitmap);
+    } else if (!ReadBytesDirect(hExt2, hExt2->partitionStart + (LONGLONG) descriptor->bg_block_bitmap * llBlockSize(hExt2),
+                                dwBlockSize(hExt2), bitmap)) {
+        return DEXT2_ERROR_READING_DISK;
     }
 
-    *disks = (LPSTR*) malloc(count * sizeof(LPSTR));
-    *disksNumbers = (PDWORD) malloc(count * sizeof(DWORD));
+    LONGLONG groupLocation = hExt2->partitionStart + (LONGLONG) groupStart * llBlockSize(hExt2);
+    DWORD groupSize = blocksInGroup * dwBlockSize(hExt2);
+    if (GetMappedBytes(hExt2->device, groupLocation, groupSize) != NULL) {
+        AdviseDeviceRange(hExt2->device, groupLocation, groupSize, DEXT2_ADVICE_SEQUENTIAL);
+    }
 
+    // Bit i of the bitmap stands for block groupStart + i
+    dext2_io_request requests[DEXT2_CHUNK_MAX_RUNS];
+    const BYTE* sources[DEXT2_CHUNK_MAX_RUNS];
+    DWORD runBlocks[DEXT2_CHUNK_MAX_RUNS];
     DWORD index = 0;
-    for (int i = 0; i < 26; i++) {
-        if (drives & (1 << i)) {
-            char* driveName = (char*)malloc(4 * sizeof(char)); // "C:\0"
-            snprintf(driveName, 4, "%c:\\", 'A' + i);
-            (*disks)[index] = driveName;
-            (*disksNumbers)[index] = index;
-            index++;
+    while (index < blocksInGroup) {
+        DWORD requestCount = 0;
+        DWORD bufferUsed = 0;
+        while (index < blocksInGroup && requestCount < DEXT2_CHUNK_MAX_RUNS && bufferUsed < bufferBlocks) {
+            if (!IsBlockAllocated(bitmap, index)) {
+                index++;
+                continue;
+            }
+            DWORD runStart = index;
+            while (index < blocksInGroup && index - runStart < bufferBlocks - bufferUsed && IsBlockAllocated(bitmap, index)) {
+                index++;
+            }
+            runBlocks[requestCount] = index - runStart;
+            requests[requestCount].offset = groupLocation + (LONGLONG) runStart * llBlockSize(hExt2);
+            requests[requestCount].length = runBlocks[requestCount] * dwBlockSize(hExt2);
+            requests[requestCount].buffer = buffer + (size_t) bufferUsed * dwBlockSize(hExt2);
+            bufferUsed += runBlocks[requestCount];
+            requestCount++;
+        }
+        if (requestCount == 0) {
+            break;
+        }
+
+        if (!MapOrReadBatch(hExt2, requests, requestCount, sources)) {
+            return DEXT2_ERROR_READING_DISK;
+        }
+        for (DWORD i = 0; i < requestCount; i++) {
+            if (!WriteHostFileAt(image->hOutput, requests[i].offset - hExt2->partitionStart, sources[i], requests[i].length)) {
+                return DEXT2_ERROR_INTERNAL;
+            }
+            *copiedBlocks += runBlocks[i];
         }
     }
+    return DEXT2_NO_ERROR;
+}
 
-    *arraySize = count;
-    return TRUE;
+DEXT2_THREAD_PROC(SparseImageWorker) {
+    dext2_sparse_image* image = (dext2_sparse_image*) parameter;
+    dext2_fs* hExt2 = image->hExt2;
+    DWORD bufferBlocks = hExt2->maxIoSize / dwBlockSize(hExt2);
+    if (bufferBlocks == 0) {
+        bufferBlocks = 1;
+    }
+    DWORD bufferSize = bufferBlocks * dwBlockSize(hExt2);
+    PBYTE buffer = AcquireBuffer(&hExt2->chunkPool, bufferSize);
+    PBYTE bitmap = AcquireBlockBuffer(hExt2);
+    ULONGLONG copiedBlocks = 0;
+    DEXT2_ERROR status = buffer == NULL || bitmap == NULL ? DEXT2_ERROR_INTERNAL : DEXT2_NO_ERROR;
+    while (status == DEXT2_NO_ERROR) {
+        LockMutex(&image->lock);
+        DWORD group = image->nextGroup;
+        BOOL stopped = image->stopped;
+        image->nextGroup++;
+        UnlockMutex(&image->lock);
+        if (stopped || group >= hExt2->groupCount) {
+            break;
+        }
+        status = ImageGroup(image, group, buffer, bufferBlocks, bitmap, &copiedBlocks);
+    }
+    LockMutex(&image->lock);
+    image->copiedBlocks += copiedBlocks;
+    if (status != DEXT2_NO_ERROR) {
+        if (image->status == DEXT2_NO_ERROR) {
+            image->status = status;
+        }
+        image->stopped = TRUE;
+    }
+    UnlockMutex(&image->lock);
+    ReleaseBuffer(&hExt2->chunkPool, buffer, bufferSize);
+    ReleaseBlockBuffer(hExt2, bitmap);
+    return 0;
 }
 
-void FreeDiskArray(LPSTR* disks, PDWORD disksNumbers, DWORD arraySize) {
-    for (DWORD i = 0; i < arraySize; i++) {
-        free((void*)disks[i]);
+// Writes a raw image of the mounted partition to outputPath holding only
+// the blocks in use; free blocks read back as zeros. threadCount 0 uses
+// one thread per processor
+DEXT2_ERROR DumpSparseImage(dext2_fs* hExt2, LPCSTR outputPath, DWORD threadCount, OUT dext2_image_stats* stats) {
+    memset(stats, 0, sizeof(dext2_image_stats));
+    ext2_super_block* superBlock = &hExt2->superBlock;
+    stats->totalBlocks = superBlock->s_blocks_count;
+    if (threadCount == 0) {
+        threadCount = GetProcessorCount();
     }
-    free(disks);
-    free(disksNumbers);
+    if (threadCount > hExt2->groupCount) {
+        threadCount = hExt2->groupCount;
+    }
+    if (threadCount == 0) {
+        threadCount = 1;
+    }
+
+    HANDLE hOutput = CreateFileA(outputPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hOutput == INVALID_HANDLE_VALUE) {
+        return DEXT2_ERROR_INTERNAL;
+    }
+    dext2_thread* threads = (dext2_thread*) calloc(threadCount, sizeof(dext2_thread));
+    if (threads == NULL || !SetHostFileSparseSize(hOutput, (LONGLONG) superBlock->s_blocks_count * llBlockSize(hExt2))) {
+        free(threads);
+        CloseHandle(hOutput);
+        return DEXT2_ERROR_INTERNAL;
+    }
+
+    dext2_sparse_image image;
+    memset(&image, 0, sizeof(image));
+    image.hExt2 = hExt2;
+    image.hOutput = hOutput;
+    image.status = DEXT2_NO_ERROR;
+    InitMutex(&image.lock);
+
+    dext2_trace_span span = BeginTraceSpan(hExt2->trace, "DumpSparseImage");
+    // Blocks ahead of the first group, the boot block with 1KiB blocks,
+    // are outside every bitmap and always copied
+    if (superBlock->s_first_data_block > 0) {
+        PBYTE buffer = AcquireBlockBuffer(hExt2);
+        for (DWORD block = 0; block < superBlock->s_first_data_block && !image.stopped; block++) {
+            if (buffer == NULL || !CopyImageRun(&image, block, 1, buffer)) {
+                image.status = DEXT2_ERROR_READING_DISK;
+                image.stopped = TRUE;
+            } else {
+                image.copiedBlocks++;
+            }
+        }
+        ReleaseBlockBuffer(hExt2, buffer);
+    }
+
+    // The calling thread is worker 0
+    DWORD started = 1;
+    while (started < threadCount && StartThread(&threads[started], SparseImageWorker, &image)) {
+        started++;
+    }
+    SparseImageWorker(&image);
+    for (DWORD i = 1; i < started; i++) {
+        JoinThread(threads[i]);
+    }
+    EndTraceSpan(&span, image.copiedBlocks * llBlockSize(hExt2));
+
+    DestroyMutex(&image.lock);
+    free(threads);
+    if (!CloseHandle(hOutput) && image.status == DEXT2_NO_ERROR) {
+        image.status = DEXT2_ERROR_INTERNAL;
+    }
+    stats->copiedBlocks = image.copiedBlocks;
+    stats->copiedBytes = image.copiedBlocks * llBlockSize(hExt2);
+    return image.status;
 }
 
-BOOL ReadDataFromInode(HANDLE hExt2, HANDLE hWinFile, ext2_inode* pInode) {
-    PDWORD dataBlocks = NULL;
-    ULONGLONG dataBlocksSize = 0;
-    PBYTE buffer = (PBYTE) malloc(llBlockSize);
-    GetDataBlocks(hExt2, pInode, &dataBlocks, &dataBlocksSize);
-    for (ULONGLONG i = 0; i < dataBlocksSize - 1; i++) {
-        LONGLONG dataLocation = (LONGLONG) dataBlocks[i] * llBlockSize;
-        if (!ReadBytes(hExt2, g_partitionStart + dataLocation, llBlockSize, buffer)) {
-            DEXT2_LOG_DEBUG("Error reading data block");
-            free(dataBlocks);
-            free(buffer);
-            return FALSE;
+/***********************************************************
+* BATCH EXPORT
+*
+* Copies many files at once with the disk reads in physical
+* order. Every path is resolved and every block map walked
+* before any data is read; the data runs of all the files
+* are then sorted by disk block and read in one ascending
+* sweep, elevator style, each run written at its own offset
+* in its own destination. Files are taken in windows so the
+* number of open destinations stays bounded
+************************************************************/
+
+#define DEXT2_EXPORT_MAX_OPEN 256
+
+typedef struct {
+    LPCSTR ext2Path;               // Relative paths start at the base directory
+    LPCSTR hostPath;
+    DEXT2_ERROR status;            // Set by ExportFiles
+} dext2_export_item;
+
+typedef struct {
+    ULONGLONG files;
+    ULONGLONG bytes;
+    ULONGLONG failed;
+} dext2_export_stats;
+
+typedef struct {
+    DWORD physicalBlock;
+    DWORD length;
+    ULONGLONG logicalBlock;
+    DWORD file;                    // Index into the current window
+} dext2_export_run;
+
+typedef struct {
+    dext2_export_item* item;
+    HANDLE hOutput;
+    ULONGLONG size;
+} dext2_export_file;
+
+int CompareExportRuns(const void* left, const void* right) {
+    const dext2_export_run* a = (const dext2_export_run*) left;
+    const dext2_export_run* b = (const dext2_export_run*) right;
+    return a->physicalBlock < b->physicalBlock ? -1 : a->physicalBlock > b->physicalBlock;
+}
+
+// Adds the data runs of one file, holes are left out: the destination
+// is sized up front and reads back zeros there
+BOOL CollectExportRuns(dext2_fs* hExt2, ext2_inode* pInode, DWORD file, dext2_export_run** runs, DWORD* runCount, DWORD* runCapacity) {
+    dext2_block_map_iterator iterator;
+    if (!InitBlockMapIterator(hExt2, pInode, &iterator)) {
+        return FALSE;
+    }
+    iterator.maxRunLength = hExt2->maxIoSize / dwBlockSize(hExt2);
+    if (iterator.maxRunLength == 0) {
+        iterator.maxRunLength = 1;
+    }
+    iterator.prefetch = TRUE;
+    BOOL success = TRUE;
+    while (success) {
+        dext2_block_run run;
+        if (!NextBlockRun(&iterator, &run)) {
+            success = FALSE;
+            break;
         }
-        DWORD written;
-        if (!WriteFile(hWinFile, buffer, dwBlockSize, &written, NULL)) {
-            DEXT2_LOG_DEBUG("Error writing to file");
-            free(dataBlocks);
-            free(buffer);
-            return FALSE;
+        if (run.length == 0) {
+            break;
         }
-        if (written < dwBlockSize) {
-            DEXT2_LOG_DEBUG("Error writing to file");
-            free(dataBlocks);
-            free(buffer);
-            return FALSE;
+        if (run.physicalBlock == 0) {
+            continue;
+        }
+        if (*runCount == *runCapacity) {
+            DWORD capacity = *runCapacity == 0 ? 256 : *runCapacity * 2;
+            dext2_export_run* grown = (dext2_export_run*) realloc(*runs, capacity * sizeof(dext2_export_run));
+            if (grown == NULL) {
+                success = FALSE;
+                break;
+            }
+            *runs = grown;
+            *runCapacity = capacity;
         }
+        dext2_export_run* entry = &(*runs)[(*runCount)++];
+        entry->physicalBlock = run.physicalBlock;
+        entry->length = run.length;
+        entry->logicalBlock = run.logicalBlock;
+        entry->file = file;
     }
+    FreeBlockMapIterator(&iterator);
+    return success;
+}
 
-    LONGLONG dataLocation = (LONGLONG) dataBlocks[dataBlocksSize - 1] * llBlockSize;
-    if (!ReadBytes(hExt2, g_partitionStart + dataLocation, llBlockSize, buffer)) {
-        DEXT2_LOG_DEBUG("Error reading data block");
-        free(dataBlocks);
-        free(buffer);
-        return FALSE;
+// Writes a run read from disk to its destination, the last block only up
+// to the file size. A failed destination is closed and its item marked,
+// the sweep goes on for the others
+void WriteExportRun(dext2_fs* hExt2, dext2_export_file* files, const dext2_export_run* run, const BYTE* data) {
+    dext2_export_file* file = &files[run->file];
+    if (file->hOutput == INVALID_HANDLE_VALUE) {
+        return;
     }
-    DWORD written;
-    DWORD nBytesToWrite = pInode->i_size % dwBlockSize;
-    if (!WriteFile(hWinFile, buffer, nBytesToWrite, &written, NULL)) {
-        DEXT2_LOG_DEBUG("Error writing last block to file");
-        free(dataBlocks);
-        free(buffer);
-        return FALSE;
+    ULONGLONG offset = run->logicalBlock * dwBlockSize(hExt2);
+    ULONGLONG length = (ULONGLONG) run->length * dwBlockSize(hExt2);
+    if (offset >= file->size) {
+        return;
     }
-    if (written < nBytesToWrite) {
-        DEXT2_LOG_DEBUG("Error writing last block to file");
-        free(dataBlocks);
-        free(buffer);
-        return FALSE;
+    if (length > file->size - offset) {
+        length = file->size - offset;
+    }
+    if (!WriteHostFileAt(file->hOutput, (LONGLONG) offset, data, (DWORD) length)) {
+        CloseHandle(file->hOutput);
+        file->hOutput = INVALID_HANDLE_VALUE;
+        file->item->status = DEXT2_ERROR_INTERNAL;
     }
-    free(buffer);
-    free(dataBlocks);
-    return TRUE;
 }
 
-DEXT2_ERROR CopyFileToWindows(HANDLE hExt2, LPCSTR ext2FilePath, LPCSTR winFilePath) {
-    DEXT2_ERROR status;
-    ext2_inode inode;
-    status = ResolvePath(hExt2, ext2FilePath, &inode);
-    if (status != DEXT2_NO_ERROR) {
-        return status;
+// One ascending sweep over the sorted runs. Consecutive runs are gathered
+// into a batch until the buffer or the request limit is full
+BOOL SweepExportRuns(dext2_fs* hExt2, dext2_export_file* files, const dext2_export_run* runs, DWORD runCount) {
+    DWORD bufferBlocks = hExt2->maxIoSize / dwBlockSize(hExt2);
+    if (bufferBlocks == 0) {
+        bufferBlocks = 1;
+    }
+    DWORD bufferSize = bufferBlocks * dwBlockSize(hExt2);
+    PBYTE buffer = AcquireBuffer(&hExt2->chunkPool, bufferSize);
+    if (buffer == NULL) {
+        return FALSE;
     }
+    dext2_io_request requests[DEXT2_CHUNK_MAX_RUNS];
+    const BYTE* sources[DEXT2_CHUNK_MAX_RUNS];
+    BOOL success = TRUE;
+    DWORD next = 0;
+    while (success && next < runCount) {
+        DWORD first = next;
+        DWORD bufferUsed = 0;
+        DWORD requestCount = 0;
+        while (next < runCount && requestCount < DEXT2_CHUNK_MAX_RUNS && bufferUsed + runs[next].length <= bufferBlocks) {
+            requests[requestCount].offset = hExt2->partitionStart + (LONGLONG) runs[next].physicalBlock * llBlockSize(hExt2);
+            requests[requestCount].length = runs[next].length * dwBlockSize(hExt2);
+            requests[requestCount].buffer = buffer + (size_t) bufferUsed * dwBlockSize(hExt2);
+            bufferUsed += runs[next].length;
+            requestCount++;
+            next++;
+        }
 
-    HANDLE hWinFile = CreateFileA(
-        winFilePath, 
-        GENERIC_WRITE, 
-        0, // no sharing
-        NULL,
-        CREATE_ALWAYS,
-        FILE_ATTRIBUTE_NORMAL,
-        NULL
-    );
+        if (!MapOrReadBatch(hExt2, requests, requestCount, sources)) {
+            success = FALSE;
+            break;
+        }
+        for (DWORD i = 0; i < requestCount; i++) {
+            WriteExportRun(hExt2, files, &runs[first + i], sources[i]);
+        }
+    }
+    ReleaseBuffer(&hExt2->chunkPool, buffer, bufferSize);
+    return success;
+}
 
-    if (hWinFile == INVALID_HANDLE_VALUE) {
-        return DEXT2_ERROR_INTERNAL;
+// Resolves, maps and opens the files of one window, then sweeps it
+DEXT2_ERROR ExportWindow(dext2_fs* hExt2, DWORD baseInodeNumber, const ext2_inode* pBaseInode,
+                         dext2_export_item* items, DWORD itemCount, dext2_export_file* files) {
+    dext2_export_run* runs = NULL;
+    DWORD runCount = 0;
+    DWORD runCapacity = 0;
+    DEXT2_ERROR status = DEXT2_NO_ERROR;
+    for (DWORD i = 0; i < itemCount; i++) {
+        files[i].item = &items[i];
+        files[i].hOutput = INVALID_HANDLE_VALUE;
+        DWORD inodeNumber = baseInodeNumber;
+        ext2_inode inode = *pBaseInode;
+        items[i].status = items[i].ext2Path[0] != '/' ?
+            ResolveRelativePath(hExt2, items[i].ext2Path, &inodeNumber, &inode) :
+            ResolvePathEx(hExt2, items[i].ext2Path, &inodeNumber, &inode);
+        if (items[i].status == DEXT2_NO_ERROR && (inode.i_mode & DEXT2_INODE_FORMAT_MASK) != DEXT2_INODE_IS_FILE) {
+            items[i].status = DEXT2_ERROR_FILE_MISSING;
+        }
+        if (items[i].status != DEXT2_NO_ERROR) {
+            continue;
+        }
+        files[i].size = GetInodeFileSize(&inode);
+        if (!CollectExportRuns(hExt2, &inode, i, &runs, &runCount, &runCapacity)) {
+            // Runs collected so far are still swept, their writes go nowhere
+            items[i].status = DEXT2_ERROR_READING_DISK;
+            continue;
+        }
+        files[i].hOutput = CreateFileA(items[i].hostPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (files[i].hOutput != INVALID_HANDLE_VALUE && !SetHostFileSparseSize(files[i].hOutput, (LONGLONG) files[i].size)) {
+            CloseHandle(files[i].hOutput);
+            files[i].hOutput = INVALID_HANDLE_VALUE;
+        }
+        if (files[i].hOutput == INVALID_HANDLE_VALUE) {
+            items[i].status = DEXT2_ERROR_INTERNAL;
+        }
     }
 
-    if (!ReadDataFromInode(hExt2, hWinFile, &inode)) {
-        return DEXT2_ERROR_INTERNAL;
+    if (runCount > 0) {
+        qsort(runs, runCount, sizeof(dext2_export_run), CompareExportRuns);
+        if (!SweepExportRuns(hExt2, files, runs, runCount)) {
+            status = DEXT2_ERROR_READING_DISK;
+        }
     }
+    free(runs);
 
-    if (!CloseHandle(hWinFile)) {
+    for (DWORD i = 0; i < itemCount; i++) {
+        if (files[i].hOutput == INVALID_HANDLE_VALUE) {
+            continue;
+        }
+        if (!CloseHandle(files[i].hOutput)) {
+            items[i].status = DEXT2_ERROR_INTERNAL;
+        } else if (status != DEXT2_NO_ERROR) {
+            items[i].status = status;
+        }
+    }
+    return status;
+}
+
+// Copies items[i].ext2Path to items[i].hostPath for every item, relative
+// paths starting at baseInodeNumber. Each item gets its own status; the
+// return value is an error only when the sweep itself failed
+DEXT2_ERROR ExportFiles(dext2_fs* hExt2, DWORD baseInodeNumber, dext2_export_item* items, DWORD itemCount, OUT dext2_export_stats* stats) {
+    memset(stats, 0, sizeof(dext2_export_stats));
+    ext2_inode baseInode;
+    if (!GetInodeByNumber(hExt2, baseInodeNumber, &baseInode)) {
+        return DEXT2_ERROR_READING_DISK;
+    }
+    dext2_export_file* files = (dext2_export_file*) calloc(DEXT2_EXPORT_MAX_OPEN, sizeof(dext2_export_file));
+    if (files == NULL) {
         return DEXT2_ERROR_INTERNAL;
     }
 
-    return DEXT2_NO_ERROR;
+    dext2_trace_span span = BeginTraceSpan(hExt2->trace, "ExportFiles");
+    DEXT2_ERROR status = DEXT2_NO_ERROR;
+    for (DWORD first = 0; first < itemCount; first += DEXT2_EXPORT_MAX_OPEN) {
+        DWORD count = itemCount - first < DEXT2_EXPORT_MAX_OPEN ? itemCount - first : DEXT2_EXPORT_MAX_OPEN;
+        if (status == DEXT2_NO_ERROR) {
+            status = ExportWindow(hExt2, baseInodeNumber, &baseInode, items + first, count, files);
+        } else {
+            // Windows after a failed sweep are not tried
+            for (DWORD i = 0; i < count; i++) {
+                items[first + i].status = status;
+            }
+        }
+        for (DWORD i = 0; i < count; i++) {
+            if (items[first + i].status == DEXT2_NO_ERROR) {
+                stats->files++;
+                stats->bytes += files[i].size;
+            } else {
+                stats->failed++;
+            }
+        }
+    }
+    EndTraceSpan(&span, stats->bytes);
+    free(files);
+    return status;
 }
 
-DEXT2_ERROR CopyInodeDataToWindows(HANDLE hExt2, ext2_inode* pInode, LPCSTR winFilePath) {
-    DEXT2_ERROR status;
-    ext2_inode inode;
+// Reads the whole descriptor table with a single request, inode lookups
+// and per-group queries then never touch the disk for it
+DEXT2_ERROR LoadGroupDescriptors(dext2_fs* hExt2) {
+    free(hExt2->groupDescriptors);
+    hExt2->groupDescriptors = NULL;
+    hExt2->groupCount = 0;
 
-    HANDLE hWinFile = CreateFileA(
-        winFilePath, 
-        GENERIC_WRITE, 
-        0, // no sharing
-        NULL,
-        CREATE_ALWAYS,
-        FILE_ATTRIBUTE_NORMAL,
-        NULL
-    );
+    if (hExt2->superBlock.s_blocks_per_group == 0 || hExt2->superBlock.s_inodes_per_group == 0) {
+        return DEXT2_ERROR_NOT_EXT2;
+    }
+    DWORD groupCount = (hExt2->superBlock.s_blocks_count - hExt2->superBlock.s_first_data_block
+                        + hExt2->superBlock.s_blocks_per_group - 1) / hExt2->superBlock.s_blocks_per_group;
+    // The table starts in the block right after the superblock
+    LONGLONG tableLocation = (LONGLONG) (hExt2->superBlock.s_first_data_block + 1) * llBlockSize(hExt2);
+    DWORD tableSize = groupCount * hExt2->descriptorSize;
 
-    if (hWinFile == INVALID_HANDLE_VALUE) {
+    PBYTE table = (PBYTE) malloc(tableSize);
+    ext2_group_desc* descriptors = (ext2_group_desc*) malloc(groupCount * sizeof(ext2_group_desc));
+    if (table == NULL || descriptors == NULL) {
+        free(table);
+        free(descriptors);
         return DEXT2_ERROR_INTERNAL;
     }
+    if (!ReadBytes(hExt2, hExt2->partitionStart + tableLocation, tableSize, table)) {
+        free(table);
+        free(descriptors);
+        return DEXT2_ERROR_READING_DISK;
+    }
+    for (DWORD i = 0; i < groupCount; i++) {
+        // Only the low halves of 64-bit descriptors are used
+        memcpy(&descriptors[i], table + (size_t) i * hExt2->descriptorSize, sizeof(ext2_group_desc));
+    }
+    free(table);
 
-    if (!ReadDataFromInode(hExt2, hWinFile, &inode)) {
+    hExt2->groupDescriptors = descriptors;
+    hExt2->groupCount = groupCount;
+    return DEXT2_NO_ERROR;
+}
+
+// Checks for an ext2 superblock at partitionStart without mounting it,
+// for listing partitions while another one stays mounted
+DEXT2_ERROR ProbeSuperblock(dext2_device* device, LONGLONG partitionStart) {
+    ext2_super_block superBlock;
+    if (!device->read(device, partitionStart + DEXT2_SUPERBLOCK_OFFSET, sizeof(ext2_super_block), &superBlock)) {
         return DEXT2_ERROR_INTERNAL;
     }
+    return superBlock.s_magic == DEXT2_SUPER_MAGIC ? DEXT2_NO_ERROR : DEXT2_ERROR_NOT_EXT2;
+}
 
-    if (!CloseHandle(hWinFile)) {
+// Mounts the partition at hExt2->partitionStart, dropping everything
+// cached for the previous one
+DEXT2_ERROR InitSuperblock(dext2_fs* hExt2) {
+    StopReadAhead(hExt2->readAhead);
+    FreeCache(hExt2->blockCache);
+    hExt2->blockCache = NULL;
+    FreeCache(hExt2->inodeCache);
+    hExt2->inodeCache = NULL;
+    ResetRunCache(hExt2->runCache);
+    ResetDentryCache(hExt2->dentryCache);
+    ResetPathCache(hExt2->pathCache);
+    DrainBufferPool(&hExt2->blockPool);
+    DrainBufferPool(&hExt2->chunkPool);
+    ClearStats(&hExt2->stats);
+    if (!ReadBytes(hExt2, hExt2->partitionStart + DEXT2_SUPERBLOCK_OFFSET, sizeof(ext2_super_block), &hExt2->superBlock)) {
         return DEXT2_ERROR_INTERNAL;
     }
+    if (hExt2->superBlock.s_magic != DEXT2_SUPER_MAGIC) return DEXT2_ERROR_NOT_EXT2;
+    ext2_super_block* superBlock = &hExt2->superBlock;
+    hExt2->inodeSize = DEXT2_INODE_SIZE;
+    hExt2->descriptorSize = DEXT2_GROUP_DESCRIPTOR_ENTRY_SIZE;
+    if (superBlock->s_rev_level >= 1) {
+        hExt2->inodeSize = superBlock->s_inode_size;
+        if ((superBlock->s_feature_incompat & DEXT2_FEATURE_INCOMPAT_64BIT) != 0) {
+            hExt2->descriptorSize = superBlock->s_desc_size;
+        }
+    }
+    // Both are powers of two no smaller than the revision 0 sizes
+    if (hExt2->inodeSize < DEXT2_INODE_SIZE || hExt2->inodeSize > dwBlockSize(hExt2) || (hExt2->inodeSize & (hExt2->inodeSize - 1)) != 0
+        || hExt2->descriptorSize < DEXT2_GROUP_DESCRIPTOR_ENTRY_SIZE || (hExt2->descriptorSize & (hExt2->descriptorSize - 1)) != 0) {
+        return DEXT2_ERROR_NOT_EXT2;
+    }
+    ResetBlockCache(hExt2);
+    ResetInodeCache(hExt2);
+    return LoadGroupDescriptors(hExt2);
+}
 
-    return DEXT2_NO_ERROR;
+void FreeFilesystem(dext2_fs* hExt2) {
+    if (hExt2 == NULL) {
+        return;
+    }
+    FreeReadAhead(hExt2->readAhead);
+    FreeCache(hExt2->blockCache);
+    FreeCache(hExt2->inodeCache);
+    FreeDentryCache(hExt2->dentryCache);
+    FreePathCache(hExt2->pathCache);
+    FreeRunCache(hExt2->runCache);
+    FreeTrace(hExt2->trace);
+    DestroyBufferPool(&hExt2->blockPool);
+    DestroyBufferPool(&hExt2->chunkPool);
+    free(hExt2->groupDescriptors);
+    CloseDevice(hExt2->device);
+    free(hExt2);
 }
 
-DEXT2_ERROR InitSuperblock(HANDLE hDisk) {
-    if (!ReadBytes(hDisk, g_partitionStart + DEXT2_SUPERBLOCK_OFFSET, sizeof(ext2_super_block), &g_mainSuperBlock)) {
-        return DEXT2_ERROR_INTERNAL;
+// Takes ownership of the device, also on failure. Set partitionStart
+// and call InitSuperblock before using the filesystem
+dext2_fs* CreateFilesystem(dext2_device* device) {
+    if (device == NULL) {
+        return NULL;
     }
-    if (g_mainSuperBlock.s_magic != DEXT2_SUPER_MAGIC) return DEXT2_ERROR_NOT_EXT2;
-    return DEXT2_NO_ERROR;
+    dext2_fs* hExt2 = (dext2_fs*) calloc(1, sizeof(dext2_fs));
+    if (hExt2 == NULL) {
+        CloseDevice(device);
+        return NULL;
+    }
+    hExt2->device = device;
+    BOOL poolsReady = InitBufferPool(&hExt2->blockPool, DEXT2_BLOCK_POOL_LIMIT);
+    poolsReady = InitBufferPool(&hExt2->chunkPool, DEXT2_CHUNK_POOL_LIMIT) && poolsReady;
+    hExt2->maxIoSize = DEXT2_DEFAULT_MAX_IO_SIZE;
+    hExt2->pipelineDepth = DEXT2_DEFAULT_PIPELINE_DEPTH;
+    hExt2->blockCacheSize = DEXT2_DEFAULT_BLOCK_CACHE_SIZE;
+    hExt2->inodeCacheSize = DEXT2_DEFAULT_INODE_CACHE_SIZE;
+    hExt2->dentryCache = CreateDentryCache(DEXT2_DEFAULT_DENTRY_CACHE_SIZE);
+    hExt2->pathCache = CreatePathCache();
+    hExt2->runCache = CreateRunCache();
+    hExt2->readAhead = CreateReadAhead(hExt2);
+    hExt2->readAheadSize = DEXT2_DEFAULT_READAHEAD_SIZE;
+    if (!poolsReady || hExt2->dentryCache == NULL || hExt2->pathCache == NULL || hExt2->runCache == NULL || hExt2->readAhead == NULL) {
+        FreeFilesystem(hExt2);
+        return NULL;
+    }
+    return hExt2;
 }
 
 #endif // DEXT2_IMPLEMENTATION
\ No newline at end of file
@@ -0,0 +1,1154 @@
+/*
+MIT License
+
+Copyright (c) 2025 Vladimir Pirko
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Benchmark of the lookup and read paths on a generated ext2 image
+//
+// Build (Linux only):
+//     gcc -O2 -o dext2_bench dext2_bench.c -lpthread
+//
+// The image is written directly, without mke2fs, from a seeded generator so
+// the same options always give the same image. Each operation is timed on
+// a freshly mounted filesystem with the image dropped from the page cache
+// (cold) and then once more on the same filesystem (warm). Run with --help
+// for the options, --json prints the results for scripts
+
+#ifndef __linux__
+#error "dext2_bench builds on Linux only"
+#endif
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define DEXT2_IMPLEMENTATION
+#include "dext2.h"
+
+#define BENCH_DEFAULT_IMAGE "/tmp/dext2_bench.img"
+#define BENCH_TIMESTAMP 1700000000     // Every inode and superblock time, keeps images identical
+#define BENCH_FIRST_INODE 11
+#define BENCH_LOST_FOUND_INODE 11
+#define BENCH_ROOT_INODE 2
+#define BENCH_MAX_GAP 8                // Fragmented files skip 1 to BENCH_MAX_GAP blocks
+
+/***********************************************************
+* CONFIGURATION
+************************************************************/
+
+typedef struct {
+    DWORD blockSize;
+    DWORD fileCount;
+    DWORD fanOut;                  // Files and subdirectories per directory
+    DWORD minFileSize;
+    DWORD maxFileSize;
+    ULONGLONG largeFileSize;       // Size of /large.bin, 0 for none
+    DWORD fragmentation;           // Percent of data blocks placed after a gap
+    ULONGLONG seed;
+    LPCSTR imagePath;
+    BOOL keepImage;
+    BOOL mapped;
+    BOOL json;
+} bench_config;
+
+// Deterministic generator, xorshift64*
+ULONGLONG NextRandom(ULONGLONG* state) {
+    ULONGLONG x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+DWORD RandomBelow(ULONGLONG* state, DWORD bound) {
+    return bound == 0 ? 0 : (DWORD) (NextRandom(state) % bound);
+}
+
+void SeedRandom(ULONGLONG* state, ULONGLONG seed) {
+    *state = seed * 0x9E3779B97F4A7C15ULL + 0x6A09E667F3BCC909ULL;
+    if (*state == 0) {
+        *state = 1;
+    }
+}
+
+/***********************************************************
+* IMAGE GENERATOR
+*
+* Revision 1 ext2 with sparse_super and filetype, 128-byte
+* inodes. Directories form a tree where directory i has the
+* subdirectories F*i+1 .. F*i+F and the files F*i .. F*i+F-1,
+* F being the fan-out. Directory 0 is the root
+************************************************************/
+
+typedef struct {
+    int fd;
+    DWORD blockSize;
+    DWORD firstDataBlock;
+    DWORD blocksPerGroup;
+    DWORD inodesPerGroup;
+    DWORD inodeTableBlocks;
+    DWORD descriptorBlocks;
+    DWORD groupCount;
+    DWORD blocksCount;
+    DWORD fragmentation;
+    DWORD nextBlock;               // Allocation cursor
+    DWORD freeBlocks;
+    PBYTE blockBitmaps;            // groupCount bitmaps of blockSize bytes
+    PBYTE inodeTable;              // All inodes, DEXT2_INODE_SIZE each
+    WORD* usedDirs;                // Per group
+    PBYTE scratch;                 // One block
+    ULONGLONG random;
+} bench_image;
+
+// Where the generated files ended up, what the benchmarks look up
+typedef struct {
+    DWORD directoryCount;
+    DWORD fileCount;
+    PDWORD directoryInodes;
+    PDWORD fileInodes;
+    PULONGLONG fileSizes;
+    LPSTR* filePaths;
+    DWORD largeInode;              // 0 when there is no large file
+    ULONGLONG largeSize;
+} bench_tree;
+
+BOOL HasSuperblockCopy(DWORD group) {
+    if (group <= 1) {
+        return TRUE;
+    }
+    DWORD bases[] = { 3, 5, 7 };
+    for (DWORD i = 0; i < 3; i++) {
+        DWORD power = bases[i];
+        while (power < group) {
+            power *= bases[i];
+        }
+        if (power == group) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+DWORD GroupFirstBlock(bench_image* image, DWORD group) {
+    return image->firstDataBlock + group * image->blocksPerGroup;
+}
+
+DWORD GroupBlockCount(bench_image* image, DWORD group) {
+    DWORD remaining = image->blocksCount - GroupFirstBlock(image, group);
+    return remaining < image->blocksPerGroup ? remaining : image->blocksPerGroup;
+}
+
+// First block after the superblock copy and descriptors of the group
+DWORD GroupMetadataStart(bench_image* image, DWORD group) {
+    DWORD start = GroupFirstBlock(image, group);
+    return HasSuperblockCopy(group) ? start + 1 + image->descriptorBlocks : start;
+}
+
+DWORD GroupMetadataBlocks(bench_image* image, DWORD group) {
+    return GroupMetadataStart(image, group) - GroupFirstBlock(image, group) + 2 + image->inodeTableBlocks;
+}
+
+PBYTE GroupBlockBitmap(bench_image* image, DWORD group) {
+    return image->blockBitmaps + (size_t) group * image->blockSize;
+}
+
+void MarkBlockUsed(bench_image* image, DWORD block) {
+    DWORD relative = block - image->firstDataBlock;
+    PBYTE bitmap = GroupBlockBitmap(image, relative / image->blocksPerGroup);
+    DWORD bit = relative % image->blocksPerGroup;
+    bitmap[bit / 8] |= (BYTE) (1 << (bit % 8));
+}
+
+BOOL IsBlockUsed(bench_image* image, DWORD block) {
+    DWORD relative = block - image->firstDataBlock;
+    PBYTE bitmap = GroupBlockBitmap(image, relative / image->blocksPerGroup);
+    DWORD bit = relative % image->blocksPerGroup;
+    return (bitmap[bit / 8] & (1 << (bit % 8))) != 0;
+}
+
+// Next free block at the cursor. With allowGap a fragmented image may
+// leave a few free blocks behind first
+BOOL AllocateBlock(bench_image* image, BOOL allowGap, OUT PDWORD block) {
+    if (allowGap && image->fragmentation > 0 && RandomBelow(&image->random, 100) < image->fragmentation) {
+        image->nextBlock += 1 + RandomBelow(&image->random, BENCH_MAX_GAP);
+    }
+    while (image->nextBlock < image->blocksCount && IsBlockUsed(image, image->nextBlock)) {
+        image->nextBlock++;
+    }
+    if (image->nextBlock >= image->blocksCount) {
+        fprintf(stderr, "The image ran out of blocks\n");
+        return FALSE;
+    }
+    *block = image->nextBlock++;
+    MarkBlockUsed(image, *block);
+    image->freeBlocks--;
+    return TRUE;
+}
+
+BOOL WriteImageBlock(bench_image* image, DWORD block, LPCVOID data) {
+    off_t offset = (off_t) block * image->blockSize;
+    DWORD total = 0;
+    while (total < image->blockSize) {
+        ssize_t written = pwrite(image->fd, (const BYTE*) data + total, image->blockSize - total, offset + total);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            perror("pwrite");
+            return FALSE;
+        }
+        total += (DWORD) written;
+    }
+    return TRUE;
+}
+
+ext2_inode* ImageInode(bench_image* image, DWORD inodeNumber) {
+    return (ext2_inode*) (image->inodeTable + (size_t) (inodeNumber - 1) * DEXT2_INODE_SIZE);
+}
+
+// Allocates and writes the indirect block that maps count blocks at the
+// given depth, 1 being a single indirect block
+BOOL WriteIndirectBlock(bench_image* image, const DWORD* blocks, ULONGLONG count, DWORD depth, OUT PDWORD block, PDWORD metadataBlocks) {
+    DWORD perBlock = image->blockSize / sizeof(DWORD);
+    ULONGLONG span = 1;
+    for (DWORD i = 1; i < depth; i++) {
+        span *= perBlock;
+    }
+    PDWORD table = (PDWORD) calloc(perBlock, sizeof(DWORD));
+    if (table == NULL) {
+        return FALSE;
+    }
+    BOOL success = TRUE;
+    for (DWORD i = 0; success && i < perBlock && (ULONGLONG) i * span < count; i++) {
+        ULONGLONG start = (ULONGLONG) i * span;
+        ULONGLONG length = count - start < span ? count - start : span;
+        if (depth == 1) {
+            table[i] = blocks[start];
+        } else {
+            success = WriteIndirectBlock(image, blocks + start, length, depth - 1, &table[i], metadataBlocks);
+        }
+    }
+    if (success) {
+        success = AllocateBlock(image, FALSE, block) && WriteImageBlock(image, *block, table);
+        (*metadataBlocks)++;
+    }
+    free(table);
+    return success;
+}
+
+// Fills i_block and i_blocks for the data blocks of an inode
+BOOL MapInodeBlocks(bench_image* image, ext2_inode* pInode, const DWORD* blocks, ULONGLONG count) {
+    DWORD perBlock = image->blockSize / sizeof(DWORD);
+    DWORD metadataBlocks = 0;
+    ULONGLONG done = 0;
+    for (DWORD i = 0; i < 12 && done < count; i++) {
+        pInode->i_block[i] = blocks[done++];
+    }
+    ULONGLONG span = perBlock;
+    for (DWORD depth = 1; depth <= 3 && done < count; depth++) {
+        ULONGLONG length = count - done < span ? count - done : span;
+        if (!WriteIndirectBlock(image, blocks + done, length, depth, &pInode->i_block[11 + depth], &metadataBlocks)) {
+            return FALSE;
+        }
+        done += length;
+        span *= perBlock;
+    }
+    if (done < count) {
+        fprintf(stderr, "File too large for the block size\n");
+        return FALSE;
+    }
+    pInode->i_blocks = (DWORD) ((count + metadataBlocks) * (image->blockSize / 512));
+    return TRUE;
+}
+
+void InitImageInode(bench_image* image, DWORD inodeNumber, WORD mode, WORD links) {
+    ext2_inode* pInode = ImageInode(image, inodeNumber);
+    pInode->i_mode = mode;
+    pInode->i_links_count = links;
+    pInode->i_atime = pInode->i_ctime = pInode->i_mtime = BENCH_TIMESTAMP;
+    if ((mode & DEXT2_INODE_FORMAT_MASK) == DEXT2_INODE_IS_DIR) {
+        image->usedDirs[(inodeNumber - 1) / image->inodesPerGroup]++;
+    }
+}
+
+BOOL WriteFileInode(bench_image* image, DWORD inodeNumber, ULONGLONG size) {
+    InitImageInode(image, inodeNumber, DEXT2_INODE_IS_FILE | 0644, 1);
+    ext2_inode* pInode = ImageInode(image, inodeNumber);
+    pInode->i_size = (DWORD) size;
+    pInode->i_dir_acl = (DWORD) (size >> 32);
+    ULONGLONG count = (size + image->blockSize - 1) / image->blockSize;
+    PDWORD blocks = (PDWORD) malloc((count > 0 ? count : 1) * sizeof(DWORD));
+    if (blocks == NULL) {
+        return FALSE;
+    }
+    BOOL success = TRUE;
+    for (ULONGLONG i = 0; success && i < count; i++) {
+        PULONGLONG words = (PULONGLONG) image->scratch;
+        for (DWORD w = 0; w < image->blockSize / sizeof(ULONGLONG); w++) {
+            words[w] = NextRandom(&image->random);
+        }
+        ULONGLONG tail = size - i * image->blockSize;
+        if (tail < image->blockSize) {
+            memset(image->scratch + tail, 0, image->blockSize - (DWORD) tail);
+        }
+        success = AllocateBlock(image, i > 0, &blocks[i]) && WriteImageBlock(image, blocks[i], image->scratch);
+    }
+    success = success && MapInodeBlocks(image, pInode, blocks, count);
+    free(blocks);
+    return success;
+}
+
+typedef struct {
+    DWORD inode;
+    BYTE fileType;
+    CHAR name[16];
+} bench_dir_record;
+
+BOOL WriteDirectoryInode(bench_image* image, DWORD inodeNumber, const bench_dir_record* records, DWORD count, WORD links) {
+    InitImageInode(image, inodeNumber, DEXT2_INODE_IS_DIR | 0755, links);
+    ext2_inode* pInode = ImageInode(image, inodeNumber);
+    // Worst case every record in its own block
+    PDWORD blocks = (PDWORD) malloc(count * sizeof(DWORD));
+    if (blocks == NULL) {
+        return FALSE;
+    }
+    DWORD blockCount = 0;
+    DWORD used = 0;
+    PBYTE previous = NULL;
+    BOOL success = TRUE;
+    memset(image->scratch, 0, image->blockSize);
+    for (DWORD i = 0; success && i <= count; i++) {
+        DWORD nameLength = i < count ? (DWORD) strlen(records[i].name) : 0;
+        DWORD recordLength = 8 + ((nameLength + 3) & ~3u);
+        // Flush the block when the next record does not fit or when done
+        if (i == count || used + recordLength > image->blockSize) {
+            *(WORD*) (previous + 4) = (WORD) (image->blockSize - (previous - image->scratch));
+            success = AllocateBlock(image, blockCount > 0, &blocks[blockCount])
+                && WriteImageBlock(image, blocks[blockCount], image->scratch);
+            blockCount++;
+            used = 0;
+            memset(image->scratch, 0, image->blockSize);
+            if (i == count) {
+                break;
+            }
+        }
+        previous = image->scratch + used;
+        *(PDWORD) previous = records[i].inode;
+        *(WORD*) (previous + 4) = (WORD) recordLength;
+        previous[6] = (BYTE) nameLength;
+        previous[7] = records[i].fileType;
+        memcpy(previous + 8, records[i].name, nameLength);
+        used += recordLength;
+    }
+    pInode->i_size = blockCount * image->blockSize;
+    success = success && MapInodeBlocks(image, pInode, blocks, blockCount);
+    free(blocks);
+    return success;
+}
+
+// Data blocks the tree needs, an upper bound used to size the image
+ULONGLONG EstimateDataBlocks(const bench_config* config, const bench_tree* tree) {
+    DWORD blockSize = config->blockSize;
+    DWORD perBlock = blockSize / sizeof(DWORD);
+    ULONGLONG total = 0;
+    for (DWORD i = 0; i <= tree->fileCount; i++) {
+        ULONGLONG size = i < tree->fileCount ? tree->fileSizes[i] : tree->largeSize;
+        ULONGLONG blocks = (size + blockSize - 1) / blockSize;
+        // Indirect blocks, generously
+        total += blocks + blocks / (perBlock - 1) + 3;
+    }
+    // Records of at most 8 + 12 bytes, both kinds of children and the dots
+    ULONGLONG recordsPerBlock = blockSize / 20;
+    total += (ULONGLONG) tree->directoryCount * ((2ULL * config->fanOut + 3) / recordsPerBlock + 2);
+    total += 4;  // lost+found
+    // Gaps left by fragmentation
+    total += total * config->fragmentation * BENCH_MAX_GAP / 100;
+    return total + 64;
+}
+
+// Picks the group geometry for the tree
+BOOL LayoutImage(const bench_config* config, const bench_tree* tree, bench_image* image) {
+    DWORD blockSize = config->blockSize;
+    DWORD inodesPerBlock = blockSize / DEXT2_INODE_SIZE;
+    ULONGLONG dataBlocks = EstimateDataBlocks(config, tree);
+    ULONGLONG inodes = BENCH_FIRST_INODE + (ULONGLONG) tree->directoryCount + tree->fileCount + 1;
+    image->blockSize = blockSize;
+    image->firstDataBlock = blockSize == 1024 ? 1 : 0;
+    image->blocksPerGroup = 8 * blockSize;
+    for (DWORD groups = 1; groups < 0x10000; groups++) {
+        ULONGLONG inodesPerGroup = (inodes + groups - 1) / groups;
+        inodesPerGroup = (inodesPerGroup + inodesPerBlock - 1) / inodesPerBlock * inodesPerBlock;
+        if (inodesPerGroup > 8ULL * blockSize) {
+            continue;
+        }
+        image->groupCount = groups;
+        image->inodesPerGroup = (DWORD) inodesPerGroup;
+        image->inodeTableBlocks = (DWORD) (inodesPerGroup / inodesPerBlock);
+        image->descriptorBlocks = (groups * DEXT2_GROUP_DESCRIPTOR_ENTRY_SIZE + blockSize - 1) / blockSize;
+        ULONGLONG metadata = 0;
+        for (DWORD g = 0; g < groups; g++) {
+            metadata += (HasSuperblockCopy(g) ? 1 + image->descriptorBlocks : 0) + 2 + image->inodeTableBlocks;
+        }
+        ULONGLONG needed = image->firstDataBlock + metadata + dataBlocks;
+        ULONGLONG capacity = image->firstDataBlock + (ULONGLONG) groups * image->blocksPerGroup;
+        if (needed > capacity) {
+            continue;
+        }
+        // The last group must hold its own metadata and a little more
+        ULONGLONG lastGroupStart = image->firstDataBlock + (ULONGLONG) (groups - 1) * image->blocksPerGroup;
+        ULONGLONG lastMetadata = (HasSuperblockCopy(groups - 1) ? 1 + image->descriptorBlocks : 0) + 2 + image->inodeTableBlocks;
+        if (needed < lastGroupStart + lastMetadata + 64) {
+            needed = lastGroupStart + lastMetadata + 64;
+        }
+        if (needed > capacity || needed > 0xFFFFFFFFULL) {
+            continue;
+        }
+        image->blocksCount = (DWORD) needed;
+        return TRUE;
+    }
+    fprintf(stderr, "No group layout fits the requested tree\n");
+    return FALSE;
+}
+
+void FreeTree(bench_tree* tree) {
+    if (tree->filePaths != NULL) {
+        for (DWORD i = 0; i < tree->fileCount; i++) {
+            free(tree->filePaths[i]);
+        }
+    }
+    free(tree->filePaths);
+    free(tree->fileSizes);
+    free(tree->fileInodes);
+    free(tree->directoryInodes);
+    memset(tree, 0, sizeof(bench_tree));
+}
+
+DWORD DirectoryParent(const bench_config* config, DWORD directory) {
+    return (directory - 1) / config->fanOut;
+}
+
+// Path of directory, "" for the root
+void BuildDirectoryPath(const bench_config* config, DWORD directory, LPSTR buffer, size_t size) {
+    if (directory == 0) {
+        buffer[0] = '\0';
+        return;
+    }
+    BuildDirectoryPath(config, DirectoryParent(config, directory), buffer, size);
+    size_t length = strlen(buffer);
+    snprintf(buffer + length, size - length, "/d%u", directory);
+}
+
+// Sizes, names and inode numbers of the tree, all derived from the seed
+BOOL PlanTree(const bench_config* config, bench_tree* tree) {
+    memset(tree, 0, sizeof(bench_tree));
+    tree->fileCount = config->fileCount;
+    tree->directoryCount = (config->fileCount + config->fanOut - 1) / config->fanOut;
+    if (tree->directoryCount == 0) {
+        tree->directoryCount = 1;
+    }
+    tree->largeSize = config->largeFileSize;
+    tree->directoryInodes = (PDWORD) malloc(tree->directoryCount * sizeof(DWORD));
+    tree->fileInodes = (PDWORD) malloc((tree->fileCount + 1) * sizeof(DWORD));
+    tree->fileSizes = (PULONGLONG) malloc((tree->fileCount + 1) * sizeof(ULONGLONG));
+    tree->filePaths = (LPSTR*) calloc(tree->fileCount + 1, sizeof(LPSTR));
+    if (tree->directoryInodes == NULL || tree->fileInodes == NULL || tree->fileSizes == NULL || tree->filePaths == NULL) {
+        FreeTree(tree);
+        return FALSE;
+    }
+    ULONGLONG random;
+    SeedRandom(&random, config->seed);
+    DWORD next = BENCH_FIRST_INODE + 1;
+    tree->directoryInodes[0] = BENCH_ROOT_INODE;
+    for (DWORD i = 1; i < tree->directoryCount; i++) {
+        tree->directoryInodes[i] = next++;
+    }
+    CHAR path[4096];
+    for (DWORD i = 0; i < tree->fileCount; i++) {
+        tree->fileInodes[i] = next++;
+        tree->fileSizes[i] = config->minFileSize + RandomBelow(&random, config->maxFileSize - config->minFileSize + 1);
+        BuildDirectoryPath(config, i / config->fanOut, path, sizeof(path));
+        size_t length = strlen(path);
+        snprintf(path + length, sizeof(path) - length, "/f%u", i);
+        tree->filePaths[i] = strdup(path);
+        if (tree->filePaths[i] == NULL) {
+            FreeTree(tree);
+            return FALSE;
+        }
+    }
+    if (config->largeFileSize > 0) {
+        tree->largeInode = next++;
+    }
+    return TRUE;
+}
+
+BOOL WriteDirectories(const bench_config* config, const bench_tree* tree, bench_image* image) {
+    DWORD maxRecords = 2 * config->fanOut + 4;
+    bench_dir_record* records = (bench_dir_record*) calloc(maxRecords, sizeof(bench_dir_record));
+    if (records == NULL) {
+        return FALSE;
+    }
+    BOOL success = TRUE;
+    for (DWORD d = 0; success && d < tree->directoryCount; d++) {
+        DWORD count = 0;
+        DWORD self = tree->directoryInodes[d];
+        DWORD parent = d == 0 ? BENCH_ROOT_INODE : tree->directoryInodes[DirectoryParent(config, d)];
+        records[count++] = (bench_dir_record) { self, DEXT2_FT_DIR, "." };
+        records[count++] = (bench_dir_record) { parent, DEXT2_FT_DIR, ".." };
+        WORD links = 2;
+        if (d == 0) {
+            records[count++] = (bench_dir_record) { BENCH_LOST_FOUND_INODE, DEXT2_FT_DIR, "lost+found" };
+            links++;
+            if (tree->largeInode != 0) {
+                records[count++] = (bench_dir_record) { tree->largeInode, DEXT2_FT_REG_FILE, "large.bin" };
+            }
+        }
+        for (DWORD c = 0; c < config->fanOut; c++) {
+            DWORD child = d * config->fanOut + c + 1;
+            if (child < tree->directoryCount) {
+                records[count] = (bench_dir_record) { tree->directoryInodes[child], DEXT2_FT_DIR, "" };
+                snprintf(records[count++].name, sizeof(records[0].name), "d%u", child);
+                links++;
+            }
+        }
+        for (DWORD c = 0; c < config->fanOut; c++) {
+            DWORD file = d * config->fanOut + c;
+            if (file < tree->fileCount) {
+                records[count] = (bench_dir_record) { tree->fileInodes[file], DEXT2_FT_REG_FILE, "" };
+                snprintf(records[count++].name, sizeof(records[0].name), "f%u", file);
+            }
+        }
+        success = WriteDirectoryInode(image, self, records, count, links);
+    }
+    // lost+found gets a few empty blocks like mke2fs makes
+    if (success) {
+        records[0] = (bench_dir_record) { BENCH_LOST_FOUND_INODE, DEXT2_FT_DIR, "." };
+        records[1] = (bench_dir_record) { BENCH_ROOT_INODE, DEXT2_FT_DIR, ".." };
+        success = WriteDirectoryInode(image, BENCH_LOST_FOUND_INODE, records, 2, 2);
+    }
+    free(records);
+    return success;
+}
+
+BOOL WriteGroupMetadata(bench_image* image, ext2_super_block* superBlock) {
+    BOOL success = TRUE;
+    DWORD inodeBitmapBytes = image->blockSize;
+    PBYTE descriptors = (PBYTE) calloc(image->descriptorBlocks, image->blockSize);
+    PBYTE inodeBitmap = (PBYTE) malloc(inodeBitmapBytes);
+    if (descriptors == NULL || inodeBitmap == NULL) {
+        free(descriptors);
+        free(inodeBitmap);
+        return FALSE;
+    }
+    DWORD totalFreeInodes = 0;
+    for (DWORD g = 0; g < image->groupCount; g++) {
+        ext2_group_desc* descriptor = (ext2_group_desc*) (descriptors + g * DEXT2_GROUP_DESCRIPTOR_ENTRY_SIZE);
+        DWORD metadataStart = GroupMetadataStart(image, g);
+        descriptor->bg_block_bitmap = metadataStart;
+        descriptor->bg_inode_bitmap = metadataStart + 1;
+        descriptor->bg_inode_table = metadataStart + 2;
+        PBYTE blockBitmap = GroupBlockBitmap(image, g);
+        DWORD blocksInGroup = GroupBlockCount(image, g);
+        DWORD freeBlocks = 0;
+        for (DWORD b = 0; b < blocksInGroup; b++) {
+            if ((blockBitmap[b / 8] & (1 << (b % 8))) == 0) {
+                freeBlocks++;
+            }
+        }
+        descriptor->bg_free_blocks_count = (WORD) freeBlocks;
+        // Bits past the end of the group are set
+        memset(inodeBitmap, 0xFF, inodeBitmapBytes);
+        DWORD freeInodes = 0;
+        for (DWORD i = 0; i < image->inodesPerGroup; i++) {
+            DWORD inodeNumber = g * image->inodesPerGroup + i + 1;
+            ext2_inode* pInode = ImageInode(image, inodeNumber);
+            if (pInode->i_mode == 0 && inodeNumber >= BENCH_FIRST_INODE) {
+                inodeBitmap[i / 8] &= (BYTE) ~(1 << (i % 8));
+                freeInodes++;
+            }
+        }
+        totalFreeInodes += freeInodes;
+        descriptor->bg_free_inodes_count = (WORD) freeInodes;
+        descriptor->bg_used_dirs_count = image->usedDirs[g];
+        success = success && WriteImageBlock(image, metadataStart, blockBitmap)
+            && WriteImageBlock(image, metadataStart + 1, inodeBitmap);
+        for (DWORD b = 0; success && b < image->inodeTableBlocks; b++) {
+            size_t offset = ((size_t) g * image->inodeTableBlocks + b) * image->blockSize;
+            success = WriteImageBlock(image, descriptor->bg_inode_table + b, image->inodeTable + offset);
+        }
+    }
+    superBlock->s_free_inodes_count = totalFreeInodes;
+    for (DWORD g = 0; success && g < image->groupCount; g++) {
+        if (!HasSuperblockCopy(g)) {
+            continue;
+        }
+        DWORD start = GroupFirstBlock(image, g);
+        BYTE block[DEXT2_SUPERBLOCK_SIZE] = { 0 };
+        superBlock->s_block_group_nr = (WORD) g;
+        memcpy(block, superBlock, sizeof(ext2_super_block));
+        // The primary superblock sits 1024 bytes into the image whatever the block size
+        off_t offset = g == 0 ? DEXT2_SUPERBLOCK_OFFSET : (off_t) start * image->blockSize;
+        success = pwrite(image->fd, block, sizeof(block), offset) == (ssize_t) sizeof(block);
+        for (DWORD b = 0; success && b < image->descriptorBlocks; b++) {
+            success = WriteImageBlock(image, start + 1 + b, descriptors + (size_t) b * image->blockSize);
+        }
+    }
+    free(descriptors);
+    free(inodeBitmap);
+    return success;
+}
+
+BOOL GenerateImage(const bench_config* config, const bench_tree* tree) {
+    bench_image image;
+    memset(&image, 0, sizeof(image));
+    if (!LayoutImage(config, tree, &image)) {
+        return FALSE;
+    }
+    image.fragmentation = config->fragmentation;
+    SeedRandom(&image.random, config->seed ^ 0xD1B54A32D192ED03ULL);
+    image.blockBitmaps = (PBYTE) calloc(image.groupCount, image.blockSize);
+    image.inodeTable = (PBYTE) calloc((size_t) image.groupCount * image.inodesPerGroup, DEXT2_INODE_SIZE);
+    image.usedDirs = (WORD*) calloc(image.groupCount, sizeof(WORD));
+    image.scratch = (PBYTE) malloc(image.blockSize);
+    image.fd = open(config->imagePath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    BOOL success = image.blockBitmaps != NULL && image.inodeTable != NULL && image.usedDirs != NULL
+        && image.scratch != NULL && image.fd >= 0
+        && ftruncate(image.fd, (off_t) image.blocksCount * image.blockSize) == 0;
+    if (success) {
+        image.freeBlocks = image.blocksCount - image.firstDataBlock;
+        for (DWORD g = 0; g < image.groupCount; g++) {
+            DWORD first = GroupFirstBlock(&image, g);
+            DWORD metadata = GroupMetadataBlocks(&image, g);
+            for (DWORD b = 0; b < metadata; b++) {
+                MarkBlockUsed(&image, first + b);
+            }
+            image.freeBlocks -= metadata;
+            // Bits past the end of the last group are set
+            PBYTE bitmap = GroupBlockBitmap(&image, g);
+            for (DWORD b = GroupBlockCount(&image, g); b < image.blocksPerGroup; b++) {
+                bitmap[b / 8] |= (BYTE) (1 << (b % 8));
+            }
+        }
+        image.nextBlock = image.firstDataBlock;
+        success = WriteDirectories(config, tree, &image);
+    }
+    for (DWORD i = 0; success && i < tree->fileCount; i++) {
+        success = WriteFileInode(&image, tree->fileInodes[i], tree->fileSizes[i]);
+    }
+    if (success && tree->largeInode != 0) {
+        success = WriteFileInode(&image, tree->largeInode, tree->largeSize);
+    }
+    if (success) {
+        ext2_super_block superBlock;
+        memset(&superBlock, 0, sizeof(superBlock));
+        superBlock.s_inodes_count = image.groupCount * image.inodesPerGroup;
+        superBlock.s_blocks_count = image.blocksCount;
+        superBlock.s_free_blocks_count = image.freeBlocks;
+        superBlock.s_first_data_block = image.firstDataBlock;
+        superBlock.s_log_block_size = config->blockSize == 1024 ? 0 : config->blockSize == 2048 ? 1 : 2;
+        superBlock.s_log_frag_size = superBlock.s_log_block_size;
+        superBlock.s_blocks_per_group = image.blocksPerGroup;
+        superBlock.s_frags_per_group = image.blocksPerGroup;
+        superBlock.s_inodes_per_group = image.inodesPerGroup;
+        superBlock.s_wtime = superBlock.s_lastcheck = BENCH_TIMESTAMP;
+        superBlock.s_max_mnt_count = 0xFFFF;
+        superBlock.s_magic = DEXT2_SUPER_MAGIC;
+        superBlock.s_state = 1;
+        superBlock.s_errors = 1;
+        superBlock.s_rev_level = 1;
+        superBlock.s_first_ino = BENCH_FIRST_INODE;
+        superBlock.s_inode_size = DEXT2_INODE_SIZE;
+        superBlock.s_feature_incompat = DEXT2_FEATURE_INCOMPAT_FILETYPE;
+        superBlock.s_feature_ro_compat = DEXT2_FEATURE_RO_COMPAT_SPARSE_SUPER;
+        for (DWORD i = 0; i <= tree->fileCount; i++) {
+            ULONGLONG size = i < tree->fileCount ? tree->fileSizes[i] : tree->largeSize;
+            if (size >= 0x80000000ULL) {
+                superBlock.s_feature_ro_compat |= DEXT2_FEATURE_RO_COMPAT_LARGE_FILE;
+            }
+        }
+        ULONGLONG uuidState;
+        SeedRandom(&uuidState, config->seed);
+        ULONGLONG uuid[2] = { NextRandom(&uuidState), NextRandom(&uuidState) };
+        memcpy(superBlock.s_uuid, uuid, sizeof(uuid));
+        strcpy(superBlock.s_volume_name, "dext2_bench");
+        success = WriteGroupMetadata(&image, &superBlock);
+    }
+    if (image.fd >= 0) {
+        success = fsync(image.fd) == 0 && success;
+        close(image.fd);
+    }
+    free(image.blockBitmaps);
+    free(image.inodeTable);
+    free(image.usedDirs);
+    free(image.scratch);
+    return success;
+}
+
+/***********************************************************
+* COUNTING DEVICE
+*
+* Wraps the device the filesystem reads from. Every read and
+* batch reaching it is a system call (or one io_uring
+* submission for a batch), so these stand in for syscall
+* counts. Mapped images read in place and count nothing
+************************************************************/
+
+typedef struct {
+    ULONGLONG reads;
+    ULONGLONG batches;
+    ULONGLONG batchRequests;
+    ULONGLONG bytes;
+} bench_io_counters;
+
+typedef struct {
+    dext2_device base;
+    dext2_device* inner;
+    bench_io_counters counters;
+} bench_counting_device;
+
+BOOL CountingDeviceRead(dext2_device* device, LONGLONG offset, DWORD nBytes, OUT LPVOID destination) {
+    bench_counting_device* counting = (bench_counting_device*) device;
+    __atomic_add_fetch(&counting->counters.reads, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&counting->counters.bytes, nBytes, __ATOMIC_RELAXED);
+    return counting->inner->read(counting->inner, offset, nBytes, destination);
+}
+
+BOOL CountingDeviceReadBatch(dext2_device* device, dext2_io_request* requests, DWORD count) {
+    bench_counting_device* counting = (bench_counting_device*) device;
+    ULONGLONG bytes = 0;
+    for (DWORD i = 0; i < count; i++) {
+        bytes += requests[i].length;
+    }
+    __atomic_add_fetch(&counting->counters.batches, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&counting->counters.batchRequests, count, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&counting->counters.bytes, bytes, __ATOMIC_RELAXED);
+    return counting->inner->readBatch(counting->inner, requests, count);
+}
+
+void CountingDeviceClose(dext2_device* device) {
+    bench_counting_device* counting = (bench_counting_device*) device;
+    CloseDevice(counting->inner);
+    free(counting);
+}
+
+dext2_device* OpenCountingDevice(dext2_device* inner) {
+    if (inner == NULL) {
+        return NULL;
+    }
+    bench_counting_device* counting = (bench_counting_device*) calloc(1, sizeof(bench_counting_device));
+    if (counting == NULL) {
+        CloseDevice(inner);
+        return NULL;
+    }
+    counting->inner = inner;
+    counting->base.read = CountingDeviceRead;
+    counting->base.readBatch = inner->readBatch != NULL ? CountingDeviceReadBatch : NULL;
+    counting->base.close = CountingDeviceClose;
+    counting->base.mappedBase = inner->mappedBase;
+    counting->base.mappedSize = inner->mappedSize;
+    return &counting->base;
+}
+
+/***********************************************************
+* BENCHMARKS
+************************************************************/
+
+typedef struct {
+    const bench_config* config;
+    const bench_tree* tree;
+    ext2_inode* directories;       // Inodes of the tree, read once up front
+    ext2_inode* files;
+    ext2_inode large;
+    PDWORD shuffledInodes;         // Files and directories in random order
+    DWORD shuffledCount;
+    HANDLE hNull;
+} bench_context;
+
+// Runs the operation once over its whole input. Returns FALSE on the
+// first failure, ops and bytes are what completed
+typedef BOOL (*BENCH_FUNCTION)(dext2_fs* hExt2, bench_context* context, OUT PULONGLONG ops, OUT PULONGLONG bytes);
+
+BOOL BenchResolvePath(dext2_fs* hExt2, bench_context* context, OUT PULONGLONG ops, OUT PULONGLONG bytes) {
+    (void) bytes;
+    for (DWORD i = 0; i < context->tree->fileCount; i++) {
+        ext2_inode inode;
+        if (ResolvePath(hExt2, context->tree->filePaths[i], &inode) != DEXT2_NO_ERROR) {
+            fprintf(stderr, "ResolvePath failed for %s\n", context->tree->filePaths[i]);
+            return FALSE;
+        }
+        (*ops)++;
+    }
+    return TRUE;
+}
+
+BOOL BenchGetChilds(dext2_fs* hExt2, bench_context* context, OUT PULONGLONG ops, OUT PULONGLONG bytes) {
+    for (DWORD i = 0; i < context->tree->directoryCount; i++) {
+        ext2_dir_entry* entries = NULL;
+        ULONGLONG count = 0;
+        if (GetChilds(hExt2, &context->directories[i], &entries, &count) != DEXT2_NO_ERROR) {
+            fprintf(stderr, "GetChilds failed for directory %u\n", i);
+            return FALSE;
+        }
+        free(entries);
+        *bytes += context->directories[i].i_size;
+        (*ops)++;
+    }
+    return TRUE;
+}
+
+BOOL BenchGetInodeByNumber(dext2_fs* hExt2, bench_context* context, OUT PULONGLONG ops, OUT PULONGLONG bytes) {
+    (void) bytes;
+    for (DWORD i = 0; i < context->shuffledCount; i++) {
+        ext2_inode inode;
+        if (!GetInodeByNumber(hExt2, context->shuffledInodes[i], &inode)) {
+            fprintf(stderr, "GetInodeByNumber failed for inode %u\n", context->shuffledInodes[i]);
+            return FALSE;
+        }
+        (*ops)++;
+    }
+    return TRUE;
+}
+
+BOOL BenchGetDataBlocks(dext2_fs* hExt2, bench_context* context, OUT PULONGLONG ops, OUT PULONGLONG bytes) {
+    (void) bytes;
+    for (DWORD i = 0; i < context->tree->fileCount; i++) {
+        PDWORD blocks = NULL;
+        ULONGLONG count = 0;
+        if (!GetDataBlocks(hExt2, &context->files[i], &blocks, &count)) {
+            fprintf(stderr, "GetDataBlocks failed for %s\n", context->tree->filePaths[i]);
+            return FALSE;
+        }
+        free(blocks);
+        (*ops)++;
+    }
+    return TRUE;
+}
+
+BOOL BenchReadSmallFiles(dext2_fs* hExt2, bench_context* context, OUT PULONGLONG ops, OUT PULONGLONG bytes) {
+    for (DWORD i = 0; i < context->tree->fileCount; i++) {
+        if (!ReadDataFromInode(hExt2, context->hNull, &context->files[i])) {
+            fprintf(stderr, "ReadDataFromInode failed for %s\n", context->tree->filePaths[i]);
+            return FALSE;
+        }
+        *bytes += context->tree->fileSizes[i];
+        (*ops)++;
+    }
+    return TRUE;
+}
+
+BOOL BenchReadLargeFile(dext2_fs* hExt2, bench_context* context, OUT PULONGLONG ops, OUT PULONGLONG bytes) {
+    if (context->tree->largeInode == 0) {
+        return TRUE;
+    }
+    if (!ReadDataFromInode(hExt2, context->hNull, &context->large)) {
+        fprintf(stderr, "ReadDataFromInode failed for /large.bin\n");
+        return FALSE;
+    }
+    *bytes += context->tree->largeSize;
+    (*ops)++;
+    return TRUE;
+}
+
+typedef struct {
+    LPCSTR name;
+    BENCH_FUNCTION function;
+} bench_case;
+
+static const bench_case benchCases[] = {
+    { "resolve_path", BenchResolvePath },
+    { "get_childs", BenchGetChilds },
+    { "get_inode", BenchGetInodeByNumber },
+    { "get_data_blocks", BenchGetDataBlocks },
+    { "read_small", BenchReadSmallFiles },
+    { "read_large", BenchReadLargeFile },
+};
+
+typedef struct {
+    LPCSTR name;
+    LPCSTR cache;
+    ULONGLONG ops;
+    ULONGLONG bytes;
+    double seconds;
+    bench_io_counters io;
+} bench_result;
+
+double NowSeconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Evicts the image from the page cache so the next reads go to the disk
+void DropImageCache(LPCSTR path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+dext2_fs* MountImage(const bench_config* config) {
+    dext2_device* device = config->mapped ? OpenMappedImageFile(config->imagePath) : OpenImageFile(config->imagePath);
+    dext2_fs* hExt2 = CreateFilesystem(OpenCountingDevice(device));
+    if (hExt2 == NULL) {
+        return NULL;
+    }
+    hExt2->partitionStart = 0;
+    if (InitSuperblock(hExt2) != DEXT2_NO_ERROR) {
+        FreeFilesystem(hExt2);
+        return NULL;
+    }
+    return hExt2;
+}
+
+bench_io_counters TakeCounters(dext2_fs* hExt2) {
+    bench_counting_device* counting = (bench_counting_device*) hExt2->device;
+    bench_io_counters counters = counting->counters;
+    memset(&counting->counters, 0, sizeof(bench_io_counters));
+    return counters;
+}
+
+BOOL RunCase(const bench_case* benchCase, dext2_fs* hExt2, bench_context* context, LPCSTR cache, OUT bench_result* result) {
+    memset(result, 0, sizeof(bench_result));
+    result->name = benchCase->name;
+    result->cache = cache;
+    TakeCounters(hExt2);
+    double start = NowSeconds();
+    BOOL success = benchCase->function(hExt2, context, &result->ops, &result->bytes);
+    result->seconds = NowSeconds() - start;
+    result->io = TakeCounters(hExt2);
+    return success;
+}
+
+// Reads the inodes of the tree once on a separate mount so the timed
+// mounts start with empty caches
+BOOL PrepareContext(const bench_config* config, const bench_tree* tree, bench_context* context) {
+    memset(context, 0, sizeof(bench_context));
+    context->config = config;
+    context->tree = tree;
+    context->directories = (ext2_inode*) calloc(tree->directoryCount, sizeof(ext2_inode));
+    context->files = (ext2_inode*) calloc(tree->fileCount + 1, sizeof(ext2_inode));
+    context->shuffledCount = tree->directoryCount + tree->fileCount;
+    context->shuffledInodes = (PDWORD) malloc(context->shuffledCount * sizeof(DWORD));
+    context->hNull = CreateFileA("/dev/null", GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    dext2_fs* hExt2 = MountImage(config);
+    BOOL success = context->directories != NULL && context->files != NULL && context->shuffledInodes != NULL
+        && context->hNull != INVALID_HANDLE_VALUE && hExt2 != NULL;
+    for (DWORD i = 0; success && i < tree->directoryCount; i++) {
+        success = GetInodeByNumber(hExt2, tree->directoryInodes[i], &context->directories[i]);
+        context->shuffledInodes[i] = tree->directoryInodes[i];
+    }
+    for (DWORD i = 0; success && i < tree->fileCount; i++) {
+        success = GetInodeByNumber(hExt2, tree->fileInodes[i], &context->files[i]);
+        context->shuffledInodes[tree->directoryCount + i] = tree->fileInodes[i];
+    }
+    if (success && tree->largeInode != 0) {
+        success = GetInodeByNumber(hExt2, tree->largeInode, &context->large);
+    }
+    if (success) {
+        ULONGLONG random;
+        SeedRandom(&random, config->seed + 1);
+        for (DWORD i = context->shuffledCount; i > 1; i--) {
+            DWORD j = RandomBelow(&random, i);
+            DWORD swap = context->shuffledInodes[i - 1];
+            context->shuffledInodes[i - 1] = context->shuffledInodes[j];
+            context->shuffledInodes[j] = swap;
+        }
+    }
+    FreeFilesystem(hExt2);
+    return success;
+}
+
+void FreeContext(bench_context* context) {
+    free(context->directories);
+    free(context->files);
+    free(context->shuffledInodes);
+    if (context->hNull != NULL && context->hNull != INVALID_HANDLE_VALUE) {
+        CloseHandle(context->hNull);
+    }
+}
+
+void PrintResultsText(const bench_result* results, DWORD count) {
+    printf("%-16s %-5s %10s %10s %14s %10s %10s %10s %12s\n",
+           "operation", "cache", "ops", "seconds", "ops/s", "MB/s", "reads", "batches", "bytes read");
+    for (DWORD i = 0; i < count; i++) {
+        const bench_result* r = &results[i];
+        double opsPerSecond = r->seconds > 0 ? r->ops / r->seconds : 0;
+        double megabytesPerSecond = r->seconds > 0 ? r->bytes / r->seconds / MiB : 0;
+        printf("%-16s %-5s %10llu %10.4f %14.0f %10.1f %10llu %10llu %12llu\n",
+               r->name, r->cache, (unsigned long long) r->ops, r->seconds, opsPerSecond, megabytesPerSecond,
+               (unsigned long long) r->io.reads, (unsigned long long) r->io.batches, (unsigned long long) r->io.bytes);
+    }
+}
+
+void PrintResultsJson(const bench_config* config, const bench_result* results, DWORD count) {
+    printf("{\n  \"config\": {\"block_size\": %u, \"files\": %u, \"fanout\": %u, \"min_size\": %u, \"max_size\": %u, "
+           "\"large_size\": %llu, \"fragmentation\": %u, \"seed\": %llu, \"mmap\": %s},\n  \"results\": [\n",
+           config->blockSize, config->fileCount, config->fanOut, config->minFileSize, config->maxFileSize,
+           (unsigned long long) config->largeFileSize, config->fragmentation, (unsigned long long) config->seed, config->mapped ? "true" : "false");
+    for (DWORD i = 0; i < count; i++) {
+        const bench_result* r = &results[i];
+        double opsPerSecond = r->seconds > 0 ? r->ops / r->seconds : 0;
+        double megabytesPerSecond = r->seconds > 0 ? r->bytes / r->seconds / MiB : 0;
+        printf("    {\"name\": \"%s\", \"cache\": \"%s\", \"ops\": %llu, \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+               "\"mb_per_sec\": %.3f, \"bytes\": %llu, \"device_reads\": %llu, \"device_batches\": %llu, "
+               "\"device_batch_requests\": %llu, \"device_bytes\": %llu}%s\n",
+               r->name, r->cache, (unsigned long long) r->ops, r->seconds, opsPerSecond, megabytesPerSecond,
+               (unsigned long long) r->bytes, (unsigned long long) r->io.reads, (unsigned long long) r->io.batches,
+               (unsigned long long) r->io.batchRequests, (unsigned long long) r->io.bytes, i + 1 < count ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+/***********************************************************
+* COMMAND LINE
+************************************************************/
+
+void PrintUsage(LPCSTR program) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --block-size=N      1024, 2048 or 4096 (default 4096)\n"
+            "  --files=N           number of small files (default 10000)\n"
+            "  --fanout=N          files and subdirectories per directory (default 32)\n"
+            "  --min-size=N        smallest small file in bytes (default 1024)\n"
+            "  --max-size=N        largest small file in bytes (default 65536)\n"
+            "  --large-size=N      size of /large.bin in bytes, 0 for none (default 64 MiB)\n"
+            "  --fragmentation=N   percent of blocks placed after a gap (default 0)\n"
+            "  --seed=N            generator seed (default 1)\n"
+            "  --image=PATH        where to write the image (default " BENCH_DEFAULT_IMAGE ")\n"
+            "  --keep              leave the image behind\n"
+            "  --mmap              read through the memory-mapped device\n"
+            "  --json              machine-readable output\n",
+            program);
+}
+
+// Matches "--name=value"
+BOOL ParseNumberOption(LPCSTR arg, LPCSTR name, OUT PULONGLONG value) {
+    size_t length = strlen(name);
+    if (strncmp(arg, name, length) != 0 || arg[length] != '=') {
+        return FALSE;
+    }
+    char* end = NULL;
+    *value = strtoull(arg + length + 1, &end, 0);
+    return end != arg + length + 1 && *end == '\0';
+}
+
+BOOL ParseArguments(int argc, char** argv, OUT bench_config* config) {
+    config->blockSize = 4096;
+    config->fileCount = 10000;
+    config->fanOut = 32;
+    config->minFileSize = 1024;
+    config->maxFileSize = 64 * KiB;
+    config->largeFileSize = 64 * MiB;
+    config->fragmentation = 0;
+    config->seed = 1;
+    config->imagePath = BENCH_DEFAULT_IMAGE;
+    for (int i = 1; i < argc; i++) {
+        LPCSTR arg = argv[i];
+        ULONGLONG value;
+        if (strcmp(arg, "--keep") == 0) config->keepImage = TRUE;
+        else if (strcmp(arg, "--mmap") == 0) config->mapped = TRUE;
+        else if (strcmp(arg, "--json") == 0) config->json = TRUE;
+        else if (strncmp(arg, "--image=", 8) == 0) config->imagePath = arg + 8;
+        else if (ParseNumberOption(arg, "--block-size", &value)) config->blockSize = (DWORD) value;
+        else if (ParseNumberOption(arg, "--files", &value)) config->fileCount = (DWORD) value;
+        else if (ParseNumberOption(arg, "--fanout", &value)) config->fanOut = (DWORD) value;
+        else if (ParseNumberOption(arg, "--min-size", &value)) config->minFileSize = (DWORD) value;
+        else if (ParseNumberOption(arg, "--max-size", &value)) config->maxFileSize = (DWORD) value;
+        else if (ParseNumberOption(arg, "--large-size", &value)) config->largeFileSize = value;
+        else if (ParseNumberOption(arg, "--fragmentation", &value)) config->fragmentation = (DWORD) value;
+        else if (ParseNumberOption(arg, "--seed", &value)) config->seed = value;
+        else return FALSE;
+    }
+    if (config->blockSize != 1024 && config->blockSize != 2048 && config->blockSize != 4096) {
+        fprintf(stderr, "Block size must be 1024, 2048 or 4096\n");
+        return FALSE;
+    }
+    if (config->fanOut == 0 || config->fanOut > 4096 || config->minFileSize > config->maxFileSize || config->fragmentation > 100) {
+        fprintf(stderr, "Invalid fan-out, file sizes or fragmentation\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+int main(int argc, char** argv) {
+    bench_config config;
+    memset(&config, 0, sizeof(config));
+    if (!ParseArguments(argc, argv, &config)) {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+    bench_tree tree;
+    if (!PlanTree(&config, &tree)) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    double start = NowSeconds();
+    if (!GenerateImage(&config, &tree)) {
+        fprintf(stderr, "Failed to generate %s\n", config.imagePath);
+        FreeTree(&tree);
+        return 1;
+    }
+    if (!config.json) {
+        printf("Generated %s in %.2f s: %u files in %u directories\n\n",
+               config.imagePath, NowSeconds() - start, tree.fileCount, tree.directoryCount);
+    }
+
+    bench_context context;
+    BOOL success = PrepareContext(&config, &tree, &context);
+    DWORD caseCount = sizeof(benchCases) / sizeof(benchCases[0]);
+    bench_result results[2 * sizeof(benchCases) / sizeof(benchCases[0])];
+    DWORD resultCount = 0;
+    for (DWORD i = 0; success && i < caseCount; i++) {
+        if (benchCases[i].function == BenchReadLargeFile && tree.largeInode == 0) {
+            continue;
+        }
+        DropImageCache(config.imagePath);
+        dext2_fs* hExt2 = MountImage(&config);
+        if (hExt2 == NULL) {
+            fprintf(stderr, "Failed to mount %s\n", config.imagePath);
+            success = FALSE;
+            break;
+        }
+        success = RunCase(&benchCases[i], hExt2, &context, "cold", &results[resultCount++])
+            && RunCase(&benchCases[i], hExt2, &context, "warm", &results[resultCount++]);
+        FreeFilesystem(hExt2);
+    }
+    if (success) {
+        if (config.json) {
+            PrintResultsJson(&config, results, resultCount);
+        } else {
+            PrintResultsText(results, resultCount);
+        }
+    }
+
+    FreeContext(&context);
+    FreeTree(&tree);
+    if (!config.keepImage) {
+        unlink(config.imagePath);
+    }
+    return success ? 0 : 1;
+}
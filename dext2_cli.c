@@ -30,8 +30,8 @@ SOFTWARE.
 #define DEXT2_IMPLEMENTATION
 #include "dext2.h"
 
-#define MAX_INPUT 1024
-#define MAX_ARGS 3
+#define DEXT2_CLI_MAX_INPUT 1024
+#define MAX_ARGS 4
 
 // WARNING - bad code
 // helper functions are written by AI
@@ -64,7 +64,8 @@ int parse_input(char *input, char *args[], int max_args) {
     return arg_count;
 }
 
-int main(void) {
+int main(int argc, char** argv) {
+#ifdef _WIN32
     CHAR drive[50];
     {
         printf("Select disk\n");
@@ -98,6 +99,11 @@ int main(void) {
         printf("Could not open disk.\n");
         return 1;
     }
+    dext2_fs* hExt2 = CreateFilesystem(OpenWin32Device(hDisk, TRUE));
+    if (hExt2 == NULL) {
+        printf("Could not open disk.\n");
+        return 1;
+    }
 
     PPARTITION_INFORMATION_EX partitions;
     DWORD partitionsCount;
@@ -116,8 +122,7 @@ int main(void) {
     }
     BOOL flag = FALSE;
     for (DWORD i = 0; i < partitionsCount; i++) {
-        g_partitionStart = partitions[i].StartingOffset.QuadPart;
-        DEXT2_ERROR status = InitSuperblock(hDisk);
+        DEXT2_ERROR status = ProbeSuperblock(hExt2->device, partitions[i].StartingOffset.QuadPart);
         switch (status)
         {
         case DEXT2_ERROR_INTERNAL:
@@ -148,20 +153,43 @@ int main(void) {
         goto partition_selection;
     }
 
-    g_partitionStart = g_partitionStart = partitions[jToi[selectedPartition]].StartingOffset.QuadPart;
-    DEXT2_ERROR status = InitSuperblock(hDisk);
+    hExt2->partitionStart = partitions[jToi[selectedPartition]].StartingOffset.QuadPart;
+    DEXT2_ERROR status = InitSuperblock(hExt2);
     if (status != DEXT2_NO_ERROR) {
         printf("Error reading file systems superblock");
         free(jToi);
         return 1;
     }
     free(jToi);
+#else
+    BOOL mapImage = argc > 1 && strcmp(argv[1], "--mmap") == 0;
+    if (mapImage) {
+        argc--;
+        argv++;
+    }
+    if (argc < 2) {
+        printf("Usage: dext2_cli [--mmap] <image> [partition offset]\n");
+        return 1;
+    }
+    dext2_fs* hExt2 = CreateFilesystem(mapImage ? OpenMappedImageFile(argv[1]) : OpenImageFile(argv[1]));
+    if (hExt2 == NULL) {
+        printf("Could not open image.\n");
+        return 1;
+    }
+    hExt2->partitionStart = argc > 2 ? strtoll(argv[2], NULL, 0) : 0;
+    DEXT2_ERROR status = InitSuperblock(hExt2);
+    if (status != DEXT2_NO_ERROR) {
+        printf("Error reading file systems superblock");
+        return 1;
+    }
+#endif // _WIN32
 
-    char input[MAX_INPUT];
+    char input[DEXT2_CLI_MAX_INPUT];
     char *args[MAX_ARGS];
 
     ext2_inode currentInode;
-    if (!GetInodeByNumber(hDisk, 2, &currentInode)) {
+    DWORD currentInodeNumber = 2;
+    if (!GetInodeByNumber(hExt2, 2, &currentInode)) {
         printf("Error reading file system");
     }
     while (1) {
@@ -177,7 +205,7 @@ int main(void) {
                 continue;
             }
             if (args[1][0] != '/') {
-                switch (_ResolvePathInner(hDisk, args[1], &currentInode))
+                switch (ResolveRelativePath(hExt2, args[1], &currentInodeNumber, &currentInode))
                 {
                     case DEXT2_ERROR_INTERNAL:
                         printf("Internal error\n");
@@ -197,7 +225,7 @@ int main(void) {
                         return 1;
                 }
             } else { 
-                switch (ResolvePath(hDisk, args[1], &currentInode))
+                switch (ResolvePathEx(hExt2, args[1], &currentInodeNumber, &currentInode))
                 {
                     case DEXT2_ERROR_INTERNAL:
                         printf("Internal error\n");
@@ -223,16 +251,15 @@ int main(void) {
                 printf("Usage: dir\n");
                 continue;
             }
-            ext2_dir_entry* des = NULL;
-            ULONGLONG desSize;
-            if (GetChilds(hDisk, &currentInode, &des, &desSize) != DEXT2_NO_ERROR) {
+            dext2_directory_listing* listing = NULL;
+            if (ListDirectory(hExt2, &currentInode, &listing) != DEXT2_NO_ERROR) {
                 printf("Error reading directory\n");
                 return 1;
             }
-            for (DWORD i = 0; i < desSize; i++) {
-                printf("%s\n", des[i].name);
+            for (ULONGLONG i = 0; i < listing->count; i++) {
+                printf("%s\n", listing->names + listing->entries[i].nameOffset);
             }
-            free(des);
+            FreeDirectoryListing(listing);
 
         } else if (strcmp(args[0], "read") == 0) {
             if (arg_count != 3) {
@@ -240,8 +267,9 @@ int main(void) {
                 continue;
             }
             ext2_inode tmpInode = currentInode;
+            DWORD tmpInodeNumber = currentInodeNumber;
             if (args[1][0] != '/') {
-                switch (_ResolvePathInner(hDisk, args[1], &tmpInode))
+                switch (ResolveRelativePath(hExt2, args[1], &tmpInodeNumber, &tmpInode))
                 {
                     case DEXT2_ERROR_INTERNAL:
                         printf("Internal error\n");
@@ -261,7 +289,7 @@ int main(void) {
                         return 1;
                 }
             } else { 
-                switch (ResolvePath(hDisk, args[1], &tmpInode))
+                switch (ResolvePath(hExt2, args[1], &tmpInode))
                 {
                     case DEXT2_ERROR_INTERNAL:
                         printf("Internal error\n");
@@ -295,9 +323,177 @@ int main(void) {
                 printf("Error creating file on Windows\n");
                 return 1;
             }
-            ReadDataFromInode(hDisk, hWinFile, &tmpInode);
+            ReadDataFromInode(hExt2, hWinFile, &tmpInode);
             CloseHandle(hWinFile);
 
+        } else if (strcmp(args[0], "extract") == 0) {
+            if (arg_count != 3 && arg_count != 4) {
+                printf("Usage: extract <path1> <path2> [threads]\n");
+                continue;
+            }
+            ext2_inode tmpInode = currentInode;
+            DWORD tmpInodeNumber = currentInodeNumber;
+            DEXT2_ERROR extractStatus = args[1][0] != '/' ?
+                ResolveRelativePath(hExt2, args[1], &tmpInodeNumber, &tmpInode) :
+                ResolvePathEx(hExt2, args[1], &tmpInodeNumber, &tmpInode);
+            dext2_extract_stats stats;
+            if (extractStatus == DEXT2_NO_ERROR) {
+                DWORD threads = arg_count == 4 ? (DWORD) strtoul(args[3], NULL, 10) : 0;
+                extractStatus = ExtractTreeFromInode(hExt2, tmpInodeNumber, args[2], threads, &stats);
+            }
+            switch (extractStatus)
+            {
+                case DEXT2_ERROR_INTERNAL:
+                    printf("Internal error\n");
+                    return 1;
+                    break;
+                case DEXT2_ERROR_READING_DISK:
+                    printf("Unable to read disk\n");
+                    return 1;
+                    break;
+                case DEXT2_ERROR_FILE_MISSING:
+                    printf("No such file or directory\n");
+                    break;
+                case DEXT2_NO_ERROR:
+                    printf("%llu files, %llu directories, %llu bytes, %llu skipped, %llu failed\n",
+                           (unsigned long long) stats.files, (unsigned long long) stats.directories, (unsigned long long) stats.bytes,
+                           (unsigned long long) stats.skipped, (unsigned long long) stats.failed);
+                    break;
+                default:
+                    printf("Something went wrong\n");
+                    return 1;
+            }
+
+        } else if (strcmp(args[0], "export") == 0) {
+            // One "<ext2 path>\t<host path>" pair per line of the list
+            if (arg_count != 2) {
+                printf("Usage: export <list file>\n");
+                continue;
+            }
+            FILE* list = fopen(args[1], "r");
+            if (list == NULL) {
+                printf("Could not open %s\n", args[1]);
+                continue;
+            }
+            dext2_export_item* items = NULL;
+            DWORD itemCount = 0;
+            DWORD itemCapacity = 0;
+            char line[2 * DEXT2_CLI_MAX_INPUT];
+            while (fgets(line, sizeof(line), list)) {
+                line[strcspn(line, "\r\n")] = '\0';
+                char* separator = strchr(line, '\t');
+                if (separator == NULL) {
+                    continue;
+                }
+                *separator = '\0';
+                if (itemCount == itemCapacity) {
+                    itemCapacity = itemCapacity == 0 ? 64 : itemCapacity * 2;
+                    items = (dext2_export_item*) realloc(items, itemCapacity * sizeof(dext2_export_item));
+                }
+                items[itemCount].ext2Path = strdup(line);
+                items[itemCount].hostPath = strdup(separator + 1);
+                itemCount++;
+            }
+            fclose(list);
+
+            dext2_export_stats stats;
+            if (ExportFiles(hExt2, currentInodeNumber, items, itemCount, &stats) == DEXT2_ERROR_READING_DISK) {
+                printf("Unable to read disk\n");
+            }
+            for (DWORD i = 0; i < itemCount; i++) {
+                if (items[i].status == DEXT2_ERROR_FILE_MISSING) {
+                    printf("No such file: %s\n", items[i].ext2Path);
+                } else if (items[i].status != DEXT2_NO_ERROR) {
+                    printf("Could not export %s\n", items[i].ext2Path);
+                }
+                free((LPSTR) items[i].ext2Path);
+                free((LPSTR) items[i].hostPath);
+            }
+            free(items);
+            printf("%llu files, %llu bytes, %llu failed\n", (unsigned long long) stats.files,
+                   (unsigned long long) stats.bytes, (unsigned long long) stats.failed);
+
+        } else if (strcmp(args[0], "image") == 0) {
+            if (arg_count != 2 && arg_count != 3) {
+                printf("Usage: image <file> [threads]\n");
+                continue;
+            }
+            DWORD threads = arg_count == 3 ? (DWORD) strtoul(args[2], NULL, 10) : 0;
+            dext2_image_stats stats;
+            DEXT2_ERROR imageStatus = DumpSparseImage(hExt2, args[1], threads, &stats);
+            if (imageStatus == DEXT2_ERROR_READING_DISK) {
+                printf("Unable to read disk\n");
+            } else if (imageStatus != DEXT2_NO_ERROR) {
+                printf("Could not write %s\n", args[1]);
+            } else {
+                printf("%llu of %llu blocks copied, %llu bytes\n", (unsigned long long) stats.copiedBlocks,
+                       (unsigned long long) stats.totalBlocks, (unsigned long long) stats.copiedBytes);
+            }
+
+        } else if (strcmp(args[0], "stats") == 0) {
+            if (arg_count == 2 && strcmp(args[1], "reset") == 0) {
+                ResetFilesystemStats(hExt2);
+                continue;
+            }
+            if (arg_count != 1) {
+                printf("Usage: stats [reset]\n");
+                continue;
+            }
+            dext2_stats stats;
+            GetFilesystemStats(hExt2, &stats);
+            for (DWORD i = 0; i < DEXT2_COUNTER_COUNT; i++) {
+                printf("%-20s %llu\n", GetCounterName((DEXT2_COUNTER) i), (unsigned long long) stats.counters[i]);
+            }
+            newline();
+            struct {
+                LPCSTR name;
+                void (*get)(dext2_fs*, dext2_cache_stats*);
+            } caches[] = {
+                { "block cache", GetBlockCacheStats },
+                { "inode cache", GetInodeCacheStats },
+                { "dentry cache", GetDentryCacheStats },
+                { "path cache", GetPathCacheStats },
+            };
+            printf("%-14s %12s %12s %8s\n", "cache", "hits", "misses", "hit %");
+            for (DWORD i = 0; i < sizeof(caches) / sizeof(caches[0]); i++) {
+                dext2_cache_stats cacheStats;
+                caches[i].get(hExt2, &cacheStats);
+                ULONGLONG lookups = cacheStats.hits + cacheStats.misses;
+                printf("%-14s %12llu %12llu %8.1f\n", caches[i].name, (unsigned long long) cacheStats.hits,
+                       (unsigned long long) cacheStats.misses, lookups > 0 ? 100.0 * cacheStats.hits / lookups : 0.0);
+            }
+            newline();
+            printf("%-18s %10s %12s %12s %12s %12s\n", "latency (us)", "calls", "mean", "p50", "p99", "max");
+            for (DWORD i = 0; i < DEXT2_LATENCY_COUNT; i++) {
+                dext2_latency_histogram* histogram = &stats.latency[i];
+                printf("%-18s %10llu %12.1f %12.1f %12.1f %12.1f\n", GetLatencyName((DEXT2_LATENCY) i),
+                       (unsigned long long) histogram->count,
+                       histogram->count > 0 ? histogram->totalNs / 1000.0 / histogram->count : 0.0,
+                       GetLatencyPercentile(histogram, 50) / 1000.0, GetLatencyPercentile(histogram, 99) / 1000.0,
+                       histogram->maxNs / 1000.0);
+            }
+
+        } else if (strcmp(args[0], "trace") == 0) {
+            if (arg_count >= 2 && strcmp(args[1], "start") == 0 && arg_count <= 3) {
+                ULONGLONG capacity = arg_count == 3 ? strtoull(args[2], NULL, 10) : 0;
+                if (!StartTracing(hExt2, capacity)) {
+                    printf("Could not allocate the trace\n");
+                }
+            } else if (arg_count == 3 && strcmp(args[1], "stop") == 0) {
+                if (hExt2->trace == NULL) {
+                    printf("Tracing is not running\n");
+                    continue;
+                }
+                ULONGLONG dropped = GetTraceDroppedEvents(hExt2->trace);
+                if (!StopTracing(hExt2, args[2])) {
+                    printf("Could not write %s\n", args[2]);
+                } else if (dropped > 0) {
+                    printf("Trace was full, %llu spans dropped\n", (unsigned long long) dropped);
+                }
+            } else {
+                printf("Usage: trace start [events] | trace stop <file.json>\n");
+            }
+
         } else if (strcmp(args[0], "exit") == 0) {
             break;
         } else {
@@ -305,6 +501,7 @@ int main(void) {
         }
     }
 
+    FreeFilesystem(hExt2);
     return 0;
     // ext2_inode inode;
     // ext2_inode newInode;
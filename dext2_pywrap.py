@@ -4,7 +4,11 @@ from ctypes import (
     c_bool,
     c_int,
     c_char_p,
+    c_ubyte,
+    c_uint,
     c_ulonglong,
+    c_ushort,
+    c_void_p,
     byref,
     POINTER,
     string_at
@@ -44,12 +48,29 @@ _lib.wFreeDisks.argtypes = [
 ]
 _lib.wFreeDisks.restype = None
 
-# bool wInitHandle(int diskNum)
-_lib.wInitHandle.argtypes = [c_int]
+# dext2_session* wCreateSession(void)
+_lib.wCreateSession.argtypes = []
+_lib.wCreateSession.restype = c_void_p
+
+# void wFreeSession(dext2_session* session)
+_lib.wFreeSession.argtypes = [c_void_p]
+_lib.wFreeSession.restype = None
+
+# bool wInitHandle(dext2_session* session, int diskNum)
+_lib.wInitHandle.argtypes = [c_void_p, c_int]
 _lib.wInitHandle.restype = c_bool
 
-# bool wListPartitions(unsigned long long** offsets, unsigned long long** partitionsLengths, int* size)
+# bool wOpenImage(dext2_session* session, const char* path)
+_lib.wOpenImage.argtypes = [c_void_p, c_char_p]
+_lib.wOpenImage.restype = c_bool
+
+# bool wOpenImageMapped(dext2_session* session, const char* path)
+_lib.wOpenImageMapped.argtypes = [c_void_p, c_char_p]
+_lib.wOpenImageMapped.restype = c_bool
+
+# bool wListPartitions(dext2_session* session, unsigned long long** offsets, unsigned long long** partitionsLengths, int* size)
 _lib.wListPartitions.argtypes = [
+    c_void_p,
     POINTER(POINTER(c_ulonglong)),
     POINTER(POINTER(c_ulonglong)),
     POINTER(c_int)
@@ -64,20 +85,21 @@ _lib.wFreePartitions.argtypes = [
 ]
 _lib.wFreePartitions.restype = None
 
-# void wInitPartition(unsigned long long partitionStart)
-_lib.wInitPartition.argtypes = [c_ulonglong]
+# void wInitPartition(dext2_session* session, unsigned long long partitionStart)
+_lib.wInitPartition.argtypes = [c_void_p, c_ulonglong]
 _lib.wInitPartition.restype = None
 
-# bool wInitSuperblock(void)
-_lib.wInitSuperblock.argtypes = []
+# bool wInitSuperblock(dext2_session* session)
+_lib.wInitSuperblock.argtypes = [c_void_p]
 _lib.wInitSuperblock.restype = c_bool
 
-# bool wInitFilesystem(void)
-_lib.wInitFilesystem.argtypes = []
+# bool wInitFilesystem(dext2_session* session)
+_lib.wInitFilesystem.argtypes = [c_void_p]
 _lib.wInitFilesystem.restype = c_bool
 
-# bool wGetChilds(char*** subDirs, int* size)
+# bool wGetChilds(dext2_session* session, char*** subDirs, bool** isDirs, int* size)
 _lib.wGetChilds.argtypes = [
+    c_void_p,
     POINTER(POINTER(c_char_p)),
     POINTER(POINTER(c_bool)),
     POINTER(c_int)
@@ -92,14 +114,123 @@ _lib.wFreeChilds.argtypes = [
 ]
 _lib.wFreeChilds.restype = None
 
-# bool cdToDir(char* path)
-_lib.cdToDir.argtypes = [ctypes.c_char_p]
+# Раскладка dext2_listing_entry и dext2_directory_listing из dext2.h
+class ListingEntry(ctypes.Structure):
+    _fields_ = [
+        ("inode", c_uint),
+        ("name_offset", c_uint),
+        ("name_length", c_ubyte),
+        ("file_type", c_ubyte),
+        ("reserved", c_ushort)
+    ]
+
+class DirectoryListing(ctypes.Structure):
+    _fields_ = [
+        ("count", c_ulonglong),
+        ("names_size", c_ulonglong),
+        ("entries", POINTER(ListingEntry)),
+        ("names", c_void_p)
+    ]
+
+DEXT2_FT_DIR = 2
+
+# bool wListDirectory(dext2_session* session, dext2_directory_listing** listing)
+_lib.wListDirectory.argtypes = [c_void_p, POINTER(POINTER(DirectoryListing))]
+_lib.wListDirectory.restype = c_bool
+
+# void wFreeListing(dext2_directory_listing* listing)
+_lib.wFreeListing.argtypes = [POINTER(DirectoryListing)]
+_lib.wFreeListing.restype = None
+
+# Раскладка dext2_stats, dext2_latency_histogram и dext2_cache_stats из dext2.h
+DEXT2_COUNTER_NAMES = [
+    "read_calls", "read_bytes", "device_reads", "device_batches", "device_bytes",
+    "inode_lookups", "inode_table_reads", "directory_blocks", "readahead_blocks"
+]
+DEXT2_LATENCY_NAMES = ["ResolvePath", "GetChilds", "ReadDataFromInode", "ListDirectory"]
+DEXT2_CACHE_NAMES = ["block", "inode", "dentry", "path"]
+DEXT2_LATENCY_BUCKETS = 40
+
+class LatencyHistogram(ctypes.Structure):
+    _fields_ = [
+        ("count", c_ulonglong),
+        ("total_ns", c_ulonglong),
+        ("max_ns", c_ulonglong),
+        ("buckets", c_ulonglong * DEXT2_LATENCY_BUCKETS)
+    ]
+
+class Stats(ctypes.Structure):
+    _fields_ = [
+        ("counters", c_ulonglong * len(DEXT2_COUNTER_NAMES)),
+        ("latency", LatencyHistogram * len(DEXT2_LATENCY_NAMES))
+    ]
+
+class CacheStats(ctypes.Structure):
+    _fields_ = [
+        ("hits", c_ulonglong),
+        ("misses", c_ulonglong),
+        ("entry_count", c_ulonglong),
+        ("capacity", c_ulonglong),
+        ("value_size", c_uint)
+    ]
+
+# bool wGetStats(dext2_session* session, dext2_stats* stats, dext2_cache_stats caches[4])
+_lib.wGetStats.argtypes = [c_void_p, POINTER(Stats), POINTER(CacheStats)]
+_lib.wGetStats.restype = c_bool
+
+# void wResetStats(dext2_session* session)
+_lib.wResetStats.argtypes = [c_void_p]
+_lib.wResetStats.restype = None
+
+# bool wStartTrace(dext2_session* session, unsigned long long capacity)
+_lib.wStartTrace.argtypes = [c_void_p, c_ulonglong]
+_lib.wStartTrace.restype = c_bool
+
+# bool wStopTrace(dext2_session* session, const char* path)
+_lib.wStopTrace.argtypes = [c_void_p, c_char_p]
+_lib.wStopTrace.restype = c_bool
+
+# bool wExportFiles(dext2_session* session, const char** ext2Paths, const char** hostPaths, unsigned int count, bool* succeeded)
+_lib.wExportFiles.argtypes = [c_void_p, POINTER(c_char_p), POINTER(c_char_p), c_uint, POINTER(c_bool)]
+_lib.wExportFiles.restype = c_bool
+
+# bool wDumpImage(dext2_session* session, const char* path, unsigned int threadCount, unsigned long long* copiedBytes)
+_lib.wDumpImage.argtypes = [c_void_p, c_char_p, ctypes.c_uint, POINTER(c_ulonglong)]
+_lib.wDumpImage.restype = c_bool
+
+# bool cdToDir(dext2_session* session, char* path)
+_lib.cdToDir.argtypes = [c_void_p, ctypes.c_char_p]
 _lib.cdToDir.restype = ctypes.c_bool
 
-# bool readFileToWindows(const char* extPath, const char* winPath)
-_lib.readFileToWindows.argtypes = [ctypes.c_char_p, ctypes.c_char_p]
+# bool readFileToWindows(dext2_session* session, const char* extPath, const char* winPath)
+_lib.readFileToWindows.argtypes = [c_void_p, ctypes.c_char_p, ctypes.c_char_p]
 _lib.readFileToWindows.restype = ctypes.c_bool
 
+# bool extractTreeToWindows(dext2_session* session, const char* extPath, const char* winPath, int threadCount, unsigned long long* failed)
+_lib.extractTreeToWindows.argtypes = [c_void_p, ctypes.c_char_p, ctypes.c_char_p, c_int, POINTER(c_ulonglong)]
+_lib.extractTreeToWindows.restype = ctypes.c_bool
+
+# 4) Сессия по умолчанию. Каждая сессия держит свой открытый образ или диск,
+# для работы с несколькими образами сразу создайте отдельные через create_session()
+_default_session = _lib.wCreateSession()
+
+
+def create_session():
+    """
+    Создаёт новую сессию со своим образом, разделом и текущим каталогом.
+    """
+    session = _lib.wCreateSession()
+    if not session:
+        raise InternalDext2Exception("wCreateSession вернул NULL.")
+    return session
+
+
+def free_session(session):
+    """
+    Закрывает образ сессии и освобождает её.
+    """
+    _lib.wFreeSession(session)
+
 
 def list_disks():
     """
@@ -125,16 +256,34 @@ def list_disks():
     return disk_names, disk_nums
 
 
-def init_handle(disk_num: int):
+def init_handle(disk_num: int, session=None):
     """
     Инициализация диска по его номеру.
     """
-    success = _lib.wInitHandle(disk_num)
+    success = _lib.wInitHandle(session or _default_session, disk_num)
     if not success:
         raise InternalDext2Exception(f"Не удалось инициализировать диск {disk_num}.")
 
 
-def list_partitions():
+def open_image(path: str, session=None):
+    """
+    Открывает файл-образ диска или раздела вместо физического диска.
+    """
+    success = _lib.wOpenImage(session or _default_session, path.encode("utf-8"))
+    if not success:
+        raise InternalDext2Exception(f"Не удалось открыть образ {path}.")
+
+
+def open_image_mapped(path: str, session=None):
+    """
+    Открывает файл-образ, отображая его в память (mmap).
+    """
+    success = _lib.wOpenImageMapped(session or _default_session, path.encode("utf-8"))
+    if not success:
+        raise InternalDext2Exception(f"Не удалось отобразить образ {path} в память.")
+
+
+def list_partitions(session=None):
     """
     Возвращает:
         (list of int, list of int) — на самом деле (list of unsigned long long, list of unsigned long long).
@@ -144,7 +293,7 @@ def list_partitions():
     partitions_lengths = POINTER(c_ulonglong)()
     size = c_int()
 
-    success = _lib.wListPartitions(byref(offsets), byref(partitions_lengths), byref(size))
+    success = _lib.wListPartitions(session or _default_session, byref(offsets), byref(partitions_lengths), byref(size))
     if not success:
         raise InternalDext2Exception("wListPartitions вернул false.")
 
@@ -159,59 +308,156 @@ def list_partitions():
     return py_offsets, py_partition_lengths
 
 
-def init_partition(partition_start: int):
+def init_partition(partition_start: int, session=None):
     """
     Устанавливает смещение (старт) выбранного раздела.
     """
-    _lib.wInitPartition(partition_start)
+    _lib.wInitPartition(session or _default_session, partition_start)
 
 
-def init_superblock():
+def init_superblock(session=None):
     """
     Инициализирует суперблок.
     """
-    success = _lib.wInitSuperblock()
+    success = _lib.wInitSuperblock(session or _default_session)
     if not success:
         raise InternalDext2Exception("wInitSuperblock вернул false.")
 
 
-def init_filesystem():
+def init_filesystem(session=None):
     """
     Инициализирует файловую систему (запрашивает root inode).
     """
-    success = _lib.wInitFilesystem()
+    success = _lib.wInitFilesystem(session or _default_session)
     if not success:
         raise InternalDext2Exception("wInitFilesystem вернул false.")
 
 
-def get_childs():
-    subdirs_ptr = POINTER(c_char_p)()
-    is_dirs_ptr = POINTER(c_bool)()
-    size = c_int()
-
-    success = _lib.wGetChilds(byref(subdirs_ptr), byref(is_dirs_ptr), byref(size))
-    print(success)
+def list_directory(session=None):
+    """
+    Содержимое текущего каталога одним вызовом: список (имя, номер inode, тип DEXT2_FT_*).
+    Имена и записи забираются из DLL целиком, без вызова на каждое имя.
+    """
+    listing_ptr = POINTER(DirectoryListing)()
+    success = _lib.wListDirectory(session or _default_session, byref(listing_ptr))
     if not success:
-        raise InternalDext2Exception("wGetChilds вернул false.")
+        raise InternalDext2Exception("wListDirectory вернул false.")
 
-    count = size.value
-    subdirs = [(string_at(subdirs_ptr[i]).decode().strip(), is_dirs_ptr[i]) for i in range(count)]
+    try:
+        listing = listing_ptr.contents
+        count = listing.count
+        names = string_at(listing.names, listing.names_size)
+        entries = (ListingEntry * count).from_address(ctypes.addressof(listing.entries.contents)) if count else []
+        result = [
+            (names[e.name_offset:e.name_offset + e.name_length].decode(errors="replace"), e.inode, e.file_type)
+            for e in entries
+        ]
+    finally:
+        _lib.wFreeListing(listing_ptr)
+
+    return result
 
-    _lib.wFreeChilds(subdirs_ptr, is_dirs_ptr, size)
 
-    return subdirs
+def get_childs(session=None):
+    return [(name, file_type == DEXT2_FT_DIR) for name, _, file_type in list_directory(session)]
 
-def read_file_from_ext2_to_windows(ext2_path: str, windows_path: str):
+def read_file_from_ext2_to_windows(ext2_path: str, windows_path: str, session=None):
     """
     Calls the C function readFileToWindows(const char* extPath, const char* winPath).
     """
     ext2_bytes = ext2_path.encode("utf-8") + b'\0'
     win_bytes = windows_path.encode("utf-8") + b'\0'
-    success = _lib.readFileToWindows(ext2_bytes, win_bytes)
+    success = _lib.readFileToWindows(session or _default_session, ext2_bytes, win_bytes)
     if not success:
         raise InternalDext2Exception("Ошибка при записи файла из ext2 на выбранный путь Windows.")
 
 
+def extract_tree_to_windows(ext2_path: str, windows_path: str, threads: int = 0, session=None):
+    """
+    Копирует файл или каталог со всем содержимым в windows_path.
+    threads = 0 - по потоку на ядро. Возвращает число файлов, которые не удалось скопировать.
+    """
+    failed = c_ulonglong()
+    success = _lib.extractTreeToWindows(session or _default_session, ext2_path.encode("utf-8"),
+                                        windows_path.encode("utf-8"), threads, byref(failed))
+    if not success:
+        raise InternalDext2Exception(f"Не удалось скопировать '{ext2_path}'.")
+    return failed.value
+
+def get_stats(session=None):
+    """
+    Счётчики, задержки вызовов и попадания в кэши открытого образа:
+    {"counters": {имя: значение}, "latency": {имя: {...}}, "caches": {имя: {"hits", "misses"}}}.
+    Задержки в наносекундах, buckets[i] - число вызовов длительностью [2^i, 2^(i+1)) нс.
+    """
+    stats = Stats()
+    caches = (CacheStats * len(DEXT2_CACHE_NAMES))()
+    success = _lib.wGetStats(session or _default_session, byref(stats), caches)
+    if not success:
+        raise InternalDext2Exception("wGetStats вернул false.")
+    return {
+        "counters": {name: stats.counters[i] for i, name in enumerate(DEXT2_COUNTER_NAMES)},
+        "latency": {
+            name: {
+                "count": h.count,
+                "total_ns": h.total_ns,
+                "max_ns": h.max_ns,
+                "buckets": list(h.buckets)
+            }
+            for name, h in zip(DEXT2_LATENCY_NAMES, stats.latency)
+        },
+        "caches": {name: {"hits": c.hits, "misses": c.misses} for name, c in zip(DEXT2_CACHE_NAMES, caches)}
+    }
+
+
+def reset_stats(session=None):
+    """
+    Обнуляет счётчики и гистограммы задержек (статистика кэшей не сбрасывается).
+    """
+    _lib.wResetStats(session or _default_session)
+
+def start_trace(capacity: int = 0, session=None):
+    """
+    Включает запись вызовов (трассировку). capacity - сколько событий поместится, 0 - по умолчанию.
+    """
+    if not _lib.wStartTrace(session or _default_session, capacity):
+        raise InternalDext2Exception("wStartTrace вернул false.")
+
+
+def stop_trace(path: str, session=None):
+    """
+    Выключает трассировку и сохраняет её в path в формате Chrome trace JSON
+    (открывается в chrome://tracing или ui.perfetto.dev).
+    """
+    if not _lib.wStopTrace(session or _default_session, path.encode("utf-8")):
+        raise InternalDext2Exception(f"Не удалось сохранить трассировку в '{path}'.")
+
+
+def export_files(pairs, session=None) -> list:
+    """
+    Копирует сразу много файлов: pairs - список пар (путь в ext2, путь назначения).
+    Блоки всех файлов читаются с диска по возрастанию номера, без скачков головки.
+    Возвращает список путей ext2, которые скопировать не удалось.
+    """
+    count = len(pairs)
+    ext2_paths = (c_char_p * count)(*[src.encode("utf-8") for src, _ in pairs])
+    host_paths = (c_char_p * count)(*[dst.encode("utf-8") for _, dst in pairs])
+    succeeded = (c_bool * count)()
+    if not _lib.wExportFiles(session or _default_session, ext2_paths, host_paths, count, succeeded):
+        raise InternalDext2Exception("Ошибка чтения диска при пакетном копировании.")
+    return [src for (src, _), ok in zip(pairs, succeeded) if not ok]
+
+
+def dump_image(path: str, threads: int = 0, session=None) -> int:
+    """
+    Сохраняет образ раздела в path, копируя только занятые блоки (свободные
+    остаются дырами разреженного файла). threads = 0 - по потоку на процессор.
+    Возвращает число скопированных байт.
+    """
+    copied = c_ulonglong()
+    if not _lib.wDumpImage(session or _default_session, path.encode("utf-8"), threads, byref(copied)):
+        raise InternalDext2Exception(f"Не удалось сохранить образ в '{path}'.")
+    return copied.value
 
 # def get_childs():
 #     subdirs_ptr = POINTER(c_char_p)()
@@ -229,12 +475,12 @@ def read_file_from_ext2_to_windows(ext2_path: str, windows_path: str):
 #     return subdirs
 
 
-def cd_to_dir(path: str):
+def cd_to_dir(path: str, session=None):
     """
     Переход в папку внутри ext2 (меняет текущую директорию).
     """
     path_bytes = path.encode("utf-8") + b'\0'
-    success = _lib.cdToDir(ctypes.c_char_p(path_bytes))
+    success = _lib.cdToDir(session or _default_session, ctypes.c_char_p(path_bytes))
     if not success:
         raise InternalDext2Exception(f"Не удалось перейти в каталог '{path}'.")
 
@@ -522,6 +768,26 @@ class Explorer(tk.Frame):
                                    command=self.refresh)
         refresh_button.pack(pady=5)
 
+        stats_button = tk.Button(self, text="Статистика", font=controller.normal_font,
+                                 command=self.show_stats)
+        stats_button.pack(pady=5)
+
+    def show_stats(self):
+        try:
+            stats = get_stats()
+        except InternalDext2Exception as e:
+            messagebox.showerror("Ошибка", str(e))
+            return
+        lines = [f"{name}: {value}" for name, value in stats["counters"].items()]
+        lines.append("")
+        for name, cache in stats["caches"].items():
+            lines.append(f"Кэш {name}: попаданий {cache['hits']}, промахов {cache['misses']}")
+        lines.append("")
+        for name, latency in stats["latency"].items():
+            mean_us = latency["total_ns"] / latency["count"] / 1000 if latency["count"] else 0
+            lines.append(f"{name}: вызовов {latency['count']}, в среднем {mean_us:.1f} мкс, максимум {latency['max_ns'] / 1000:.1f} мкс")
+        messagebox.showinfo("Статистика", "\n".join(lines))
+
     def load_root_directory(self):
         self.refresh()
 
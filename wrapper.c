@@ -8,9 +8,49 @@
 #define DEXT2_IMPLEMENTATION
 #include "dext2.h"
 
-HANDLE hExt2 = INVALID_HANDLE_VALUE;
-ext2_inode currentInode = {0};
+// Everything one opened image or disk needs. The Python side may keep
+// several sessions, each of them is used by one thread at a time
+typedef struct {
+    dext2_fs* hExt2;
+    ext2_inode currentInode;
+    DWORD currentInodeNumber;
+#ifdef _WIN32
+    HANDLE hDisk;                  // Owned by the device of hExt2
+#endif // _WIN32
+} dext2_session;
+
+EXPORT dext2_session* wCreateSession(void) {
+    dext2_session* session = (dext2_session*) calloc(1, sizeof(dext2_session));
+    if (session == NULL) {
+        return NULL;
+    }
+    session->currentInodeNumber = 2;
+#ifdef _WIN32
+    session->hDisk = INVALID_HANDLE_VALUE;
+#endif // _WIN32
+    return session;
+}
+
+EXPORT void wFreeSession(dext2_session* session) {
+    if (session == NULL) return;
+    FreeFilesystem(session->hExt2);
+    free(session);
+}
+
+EXPORT bool wOpenImage(dext2_session* session, const char* path) {
+    FreeFilesystem(session->hExt2);
+    session->hExt2 = CreateFilesystem(OpenImageFile(path));
+    return session->hExt2 != NULL;
+}
 
+// Same as wOpenImage, but the image is memory-mapped
+EXPORT bool wOpenImageMapped(dext2_session* session, const char* path) {
+    FreeFilesystem(session->hExt2);
+    session->hExt2 = CreateFilesystem(OpenMappedImageFile(path));
+    return session->hExt2 != NULL;
+}
+
+#ifdef _WIN32
 EXPORT bool wListDisks(char*** disks, int** disksNumbers, int* size) {
     return GetAvailableDisks((LPSTR**) disks, (PDWORD*) disksNumbers, (PDWORD) size);
 }
@@ -19,22 +59,35 @@ EXPORT void wFreeDisks(char** disks, int* disksNumbers, int size) {
     FreeDiskArray((LPSTR*) disks, (PDWORD) disksNumbers, (DWORD) size);
 }
 
-EXPORT bool wInitHandle(int diskNum) {
+EXPORT bool wInitHandle(dext2_session* session, int diskNum) {
     char drive[50];
     snprintf(drive, sizeof(drive), "\\\\.\\PhysicalDrive%d\0", diskNum);
-    hExt2 = CreateFileA(drive, GENERIC_READ, 
+    HANDLE hDisk = CreateFileA(drive, GENERIC_READ, 
                                0, // no sharing
                                NULL, OPEN_EXISTING, 0, NULL);
-    if (hExt2 == INVALID_HANDLE_VALUE) {
+    if (hDisk == INVALID_HANDLE_VALUE) {
         return false;
     }
+    FreeFilesystem(session->hExt2);
+    session->hDisk = INVALID_HANDLE_VALUE;
+    dext2_device* device = OpenWin32Device(hDisk, TRUE);
+    if (device == NULL) {
+        CloseHandle(hDisk);
+        session->hExt2 = NULL;
+        return false;
+    }
+    session->hExt2 = CreateFilesystem(device);
+    if (session->hExt2 == NULL) {
+        return false;
+    }
+    session->hDisk = hDisk;
     return true;
 }
 
-EXPORT bool wListPartitions(unsigned long long** offsets, unsigned long long** partitionsLengths, int* size) {
+EXPORT bool wListPartitions(dext2_session* session, unsigned long long** offsets, unsigned long long** partitionsLengths, int* size) {
     PPARTITION_INFORMATION_EX partitions;
     DWORD partitionsCount;
-    if (!GetPartitions(hExt2, &partitions, &partitionsCount)) {
+    if (session->hExt2 == NULL || !GetPartitions(session->hDisk, &partitions, &partitionsCount)) {
         return false;
     }
 
@@ -43,8 +96,7 @@ EXPORT bool wListPartitions(unsigned long long** offsets, unsigned long long** p
     *size = 0;
     int j = 0;
     for (int i = 0; i < partitionsCount; i++) {
-        g_partitionStart = partitions[i].StartingOffset.QuadPart;
-        DEXT2_ERROR status = InitSuperblock(hExt2);
+        DEXT2_ERROR status = ProbeSuperblock(session->hExt2->device, partitions[i].StartingOffset.QuadPart);
         switch (status)
         {
         case DEXT2_ERROR_INTERNAL:
@@ -72,17 +124,20 @@ EXPORT void wFreePartitions(unsigned long long* offsets, unsigned long long* par
     free(offsets);
     free(partitionsLengths);
 }
+#endif // _WIN32
 
-EXPORT void wInitPartition(unsigned long long partitionStart) {
-    g_partitionStart = partitionStart;
+EXPORT void wInitPartition(dext2_session* session, unsigned long long partitionStart) {
+    if (session->hExt2 == NULL) return;
+    session->hExt2->partitionStart = partitionStart;
 }
 
-EXPORT bool wInitSuperblock(void) {
-    return InitSuperblock(hExt2) == DEXT2_NO_ERROR;
+EXPORT bool wInitSuperblock(dext2_session* session) {
+    return session->hExt2 != NULL && InitSuperblock(session->hExt2) == DEXT2_NO_ERROR;
 }
 
-EXPORT bool wInitFilesystem(void) {
-    return GetInodeByNumber(hExt2, 2, &currentInode);
+EXPORT bool wInitFilesystem(dext2_session* session) {
+    session->currentInodeNumber = 2;
+    return GetInodeByNumber(session->hExt2, 2, &session->currentInode);
 }
 
 // EXPORT bool wGetChilds(char*** subDirs, int* size) {
@@ -110,11 +165,11 @@ EXPORT bool wInitFilesystem(void) {
 //     return true;
 // }
 
-EXPORT bool wGetChilds(char*** subDirs, bool** isDirs, int* size) {
+bool _wGetChildsInner(dext2_session* session, char*** subDirs, bool** isDirs, int* size) {
     ext2_dir_entry* des;
     ULONGLONG desSize;
 
-    if (GetChilds(hExt2, &currentInode, &des, &desSize) != DEXT2_NO_ERROR) {
+    if (GetChilds(session->hExt2, &session->currentInode, &des, &desSize) != DEXT2_NO_ERROR) {
         return false;
     }
 
@@ -128,11 +183,12 @@ EXPORT bool wGetChilds(char*** subDirs, bool** isDirs, int* size) {
         return false;
     }
 
-    for (int i = 0; i < desSize; i++) {
-        size_t dirNameLen = strnlen(des[i].name, 256);
+    for (ULONGLONG i = 0; i < desSize; i++) {
+        // A 255-byte name fills the field and has no terminator
+        size_t dirNameLen = des[i].name_len;
         (*subDirs)[i] = malloc((dirNameLen + 1) * sizeof(char));
         if (!(*subDirs)[i]) {
-            for (int j = 0; j < i; j++) free((*subDirs)[j]);
+            for (ULONGLONG j = 0; j < i; j++) free((*subDirs)[j]);
             free(*subDirs);
             free(*isDirs);
             free(des);
@@ -140,20 +196,28 @@ EXPORT bool wGetChilds(char*** subDirs, bool** isDirs, int* size) {
         }
         strncpy((*subDirs)[i], des[i].name, dirNameLen);
         (*subDirs)[i][dirNameLen] = '\0';
-        ext2_inode tmp;
-        if (!GetInodeByNumber(hExt2, des[i].inode, &tmp)) {
+        BYTE fileType;
+        if (GetDirEntryType(session->hExt2, &des[i], &fileType) != DEXT2_NO_ERROR) {
+            for (ULONGLONG j = 0; j <= i; j++) free((*subDirs)[j]);
             free(*subDirs);
             free(*isDirs);
             free(des);
             return false;
         }
-        (*isDirs)[i] = tmp.i_mode & DEXT2_INODE_IS_DIR;
+        (*isDirs)[i] = fileType == DEXT2_FT_DIR;
     }
 
     free(des);
     return true;
 }
 
+EXPORT bool wGetChilds(dext2_session* session, char*** subDirs, bool** isDirs, int* size) {
+    dext2_trace_span span = BeginTraceSpan(session->hExt2->trace, "wGetChilds");
+    bool success = _wGetChildsInner(session, subDirs, isDirs, size);
+    EndTraceSpan(&span, 0);
+    return success;
+}
+
 EXPORT void wFreeChilds(char** subDirs, bool* isDirs, int size) {
     if (!subDirs) return;
     for (int i = 0; i < size; i++) {
@@ -163,9 +227,81 @@ EXPORT void wFreeChilds(char** subDirs, bool* isDirs, int size) {
     free(isDirs);
 }
 
-EXPORT bool cdToDir(char* path) {
+// Lists the current directory in one block: names packed together plus
+// an array of {inode, offset, length, type}. Free with wFreeListing
+EXPORT bool wListDirectory(dext2_session* session, dext2_directory_listing** listing) {
+    dext2_trace_span span = BeginTraceSpan(session->hExt2->trace, "wListDirectory");
+    bool success = ListDirectory(session->hExt2, &session->currentInode, listing) == DEXT2_NO_ERROR;
+    EndTraceSpan(&span, 0);
+    return success;
+}
+
+EXPORT void wFreeListing(dext2_directory_listing* listing) {
+    FreeDirectoryListing(listing);
+}
+
+// Counters and latency histograms of the session, plus hits and misses
+// of the block, inode, dentry and path caches in that order
+EXPORT bool wGetStats(dext2_session* session, dext2_stats* stats, dext2_cache_stats caches[4]) {
+    if (session->hExt2 == NULL) {
+        return false;
+    }
+    GetFilesystemStats(session->hExt2, stats);
+    GetBlockCacheStats(session->hExt2, &caches[0]);
+    GetInodeCacheStats(session->hExt2, &caches[1]);
+    GetDentryCacheStats(session->hExt2, &caches[2]);
+    GetPathCacheStats(session->hExt2, &caches[3]);
+    return true;
+}
+
+EXPORT void wResetStats(dext2_session* session) {
+    if (session->hExt2 == NULL) return;
+    ResetFilesystemStats(session->hExt2);
+}
+
+// Records spans of every call on the session until wStopTrace writes
+// them to path as Chrome trace JSON. capacity 0 keeps the default
+EXPORT bool wStartTrace(dext2_session* session, unsigned long long capacity) {
+    return session->hExt2 != NULL && StartTracing(session->hExt2, capacity);
+}
+
+EXPORT bool wStopTrace(dext2_session* session, const char* path) {
+    return session->hExt2 != NULL && StopTracing(session->hExt2, path);
+}
+
+// Copies count files in one go, ext2Paths[i] to hostPaths[i], with the disk
+// read in ascending block order across all of them. Relative paths start at
+// the current directory. succeeded[i] tells how each file went
+EXPORT bool wExportFiles(dext2_session* session, const char** ext2Paths, const char** hostPaths, unsigned int count, bool* succeeded) {
+    if (session->hExt2 == NULL) return false;
+    dext2_export_item* items = (dext2_export_item*) calloc(count, sizeof(dext2_export_item));
+    if (items == NULL) return false;
+    for (unsigned int i = 0; i < count; i++) {
+        items[i].ext2Path = ext2Paths[i];
+        items[i].hostPath = hostPaths[i];
+    }
+    dext2_export_stats stats;
+    bool success = ExportFiles(session->hExt2, session->currentInodeNumber, items, count, &stats) == DEXT2_NO_ERROR;
+    for (unsigned int i = 0; i < count; i++) {
+        succeeded[i] = items[i].status == DEXT2_NO_ERROR;
+    }
+    free(items);
+    return success;
+}
+
+// Writes a raw image of the partition with only the used blocks filled in,
+// free blocks become holes. threadCount 0 uses one thread per processor
+EXPORT bool wDumpImage(dext2_session* session, const char* path, unsigned int threadCount, unsigned long long* copiedBytes) {
+    if (session->hExt2 == NULL) return false;
+    dext2_image_stats stats;
+    bool success = DumpSparseImage(session->hExt2, path, threadCount, &stats) == DEXT2_NO_ERROR;
+    *copiedBytes = stats.copiedBytes;
+    return success;
+}
+
+EXPORT bool cdToDir(dext2_session* session, char* path) {
     if (path[0] != '/') {
-        switch (_ResolvePathInner(hExt2, (LPSTR) path, &currentInode))
+        switch (ResolveRelativePath(session->hExt2, (LPSTR) path, &session->currentInodeNumber, &session->currentInode))
         {
             case DEXT2_ERROR_INTERNAL:
                 return false;
@@ -182,7 +318,7 @@ EXPORT bool cdToDir(char* path) {
                 return false;
         }
     } else { 
-        switch (ResolvePath(hExt2, (LPSTR) path, &currentInode))
+        switch (ResolvePathEx(session->hExt2, (LPSTR) path, &session->currentInodeNumber, &session->currentInode))
         {
             case DEXT2_ERROR_INTERNAL:
                 return false;
@@ -202,10 +338,12 @@ EXPORT bool cdToDir(char* path) {
     return true;
 }
 
-EXPORT bool readFileToWindows(const char* extPath, const char* winPath) {
-    ext2_inode tmpInode = currentInode;
+EXPORT bool readFileToWindows(dext2_session* session, const char* extPath, const char* winPath) {
+    dext2_fs* hExt2 = session->hExt2;
+    ext2_inode tmpInode = session->currentInode;
+    DWORD tmpInodeNumber = session->currentInodeNumber;
     if (extPath[0] != '/') {
-        switch (_ResolvePathInner(hExt2, extPath, &tmpInode))
+        switch (ResolveRelativePath(hExt2, extPath, &tmpInodeNumber, &tmpInode))
         {
             case DEXT2_ERROR_INTERNAL:
                 return false;
@@ -255,5 +393,25 @@ EXPORT bool readFileToWindows(const char* extPath, const char* winPath) {
     ReadDataFromInode(hExt2, hWinFile, &tmpInode);
     CloseHandle(hWinFile);
 
+    return true;
+}
+
+// Copies a file or a whole directory tree, relative paths start at the
+// current directory. threadCount 0 uses one thread per processor. Entries
+// that could not be copied are skipped and counted in *failed
+EXPORT bool extractTreeToWindows(dext2_session* session, const char* extPath, const char* winPath, int threadCount, unsigned long long* failed) {
+    ext2_inode tmpInode = session->currentInode;
+    DWORD tmpInodeNumber = session->currentInodeNumber;
+    DEXT2_ERROR status = extPath[0] != '/' ?
+        ResolveRelativePath(session->hExt2, extPath, &tmpInodeNumber, &tmpInode) :
+        ResolvePathEx(session->hExt2, extPath, &tmpInodeNumber, &tmpInode);
+    if (status != DEXT2_NO_ERROR) {
+        return false;
+    }
+    dext2_extract_stats stats;
+    if (ExtractTreeFromInode(session->hExt2, tmpInodeNumber, winPath, threadCount < 0 ? 0 : (DWORD) threadCount, &stats) != DEXT2_NO_ERROR) {
+        return false;
+    }
+    *failed = stats.failed;
     return true;
 }
\ No newline at end of file